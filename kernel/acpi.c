@@ -0,0 +1,117 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <acpi.h>
+#include <console.h>
+#include <string.h>
+#include <vmm.h>
+
+typedef struct {
+	char signature[8];
+	uint8_t checksum;
+	char oem_id[6];
+	uint8_t revision;
+	uint32_t rsdt_address;
+	// XXX: the ACPI 2.0 fields (xsdt) follow, every table we need is in the rsdt too
+} __attribute__((packed)) acpi_rsdp_t;
+
+#define BIOS_EBDA_SEGMENT 0x40E
+#define BIOS_ROM_START 0xE0000
+#define BIOS_ROM_END 0x100000
+
+static acpi_sdt_header_t *rsdt = NULL;
+
+static bool acpi_checksum(const void *p, size_t length) {
+	uint8_t sum = 0;
+	for (size_t i = 0; i < length; i++) {
+		sum += ((const uint8_t *)p)[i];
+	}
+	return sum == 0;
+}
+
+static uintptr_t acpi_scan_range(uintptr_t start, size_t length, const char *signature, size_t signature_length, size_t size) {
+	const uint8_t *v = map_physical(start, length, PAGE_PRESENT);
+	assert(v != NULL);
+
+	uintptr_t found = 0;
+	for (size_t i = 0; i + size <= length; i += 16) {
+		if ((memcmp(v + i, signature, signature_length) == 0) && acpi_checksum(v + i, size)) {
+			found = start + i;
+			break;
+		}
+	}
+	unmap_physical((void *)v, length);
+	return found;
+}
+
+/* the first kb of the extended bios data area, then the bios rom */
+uintptr_t acpi_scan_bios(const char *signature, size_t signature_length, size_t size) {
+	const uint16_t *bda = map_physical(BIOS_EBDA_SEGMENT, sizeof(uint16_t), PAGE_PRESENT);
+	assert(bda != NULL);
+	uintptr_t ebda = (uintptr_t)*bda << 4;
+	unmap_physical((void *)bda, sizeof(uint16_t));
+
+	uintptr_t found = 0;
+	if ((ebda != 0) && (ebda < BIOS_ROM_START)) {
+		found = acpi_scan_range(ebda, 1024, signature, signature_length, size);
+	}
+	if (found == 0) {
+		found = acpi_scan_range(BIOS_ROM_START, BIOS_ROM_END - BIOS_ROM_START, signature, signature_length, size);
+	}
+	return found;
+}
+
+/* map a whole table, the header tells how long it is */
+static acpi_sdt_header_t *acpi_map_table(uintptr_t phys) {
+	acpi_sdt_header_t *header = map_physical(phys, sizeof(acpi_sdt_header_t), PAGE_PRESENT);
+	assert(header != NULL);
+	uint32_t length = header->length;
+	unmap_physical(header, sizeof(acpi_sdt_header_t));
+
+	acpi_sdt_header_t *table = map_physical(phys, length, PAGE_PRESENT);
+	assert(table != NULL);
+	if (!acpi_checksum(table, length)) {
+		printf("%s: table at 0x%x has a bad checksum\n", __func__, phys);
+		unmap_physical(table, length);
+		return NULL;
+	}
+	return table;
+}
+
+void acpi_init(void) {
+	uintptr_t rsdp_phys = acpi_scan_bios("RSD PTR ", 8, sizeof(acpi_rsdp_t));
+	if (rsdp_phys == 0) {
+		printf("%s: no rsdp found\n", __func__);
+		return;
+	}
+
+	acpi_rsdp_t *rsdp = map_physical(rsdp_phys, sizeof(acpi_rsdp_t), PAGE_PRESENT);
+	assert(rsdp != NULL);
+	printf("%s: rsdp at 0x%x, revision %u, rsdt at 0x%x\n", __func__, rsdp_phys, rsdp->revision, rsdp->rsdt_address);
+	uintptr_t rsdt_phys = rsdp->rsdt_address;
+	unmap_physical(rsdp, sizeof(acpi_rsdp_t));
+
+	rsdt = acpi_map_table(rsdt_phys);
+}
+
+acpi_sdt_header_t *acpi_find_table(const char *signature) {
+	if (rsdt == NULL) {
+		return NULL;
+	}
+
+	const uint32_t *entries = (const uint32_t *)((uintptr_t)rsdt + sizeof(acpi_sdt_header_t));
+	size_t n = (rsdt->length - sizeof(acpi_sdt_header_t)) / sizeof(uint32_t);
+	for (size_t i = 0; i < n; i++) {
+		acpi_sdt_header_t *header = map_physical(entries[i], sizeof(acpi_sdt_header_t), PAGE_PRESENT);
+		assert(header != NULL);
+		bool match = memcmp(header->signature, signature, 4) == 0;
+		unmap_physical(header, sizeof(acpi_sdt_header_t));
+
+		if (match) {
+			return acpi_map_table(entries[i]);
+		}
+	}
+	return NULL;
+}
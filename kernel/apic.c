@@ -0,0 +1,170 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <apic.h>
+#include <console.h>
+#include <cpu.h>
+#include <isr.h>
+#include <mmio.h>
+#include <pit.h>
+#include <pmm.h>
+#include <task.h>
+#include <vmm.h>
+
+#define CPUID_EDX_APIC (1 << 9)
+#define MSR_APIC_BASE 0x1B
+#define MSR_APIC_BASE_ENABLE (1 << 11)
+
+/* register offsets */
+#define LAPIC_ID            0x020
+#define LAPIC_TPR           0x080
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_LVT_LINT0     0x350
+#define LAPIC_LVT_LINT1     0x360
+#define LAPIC_LVT_ERROR     0x370
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_SVR_ENABLE (1 << 8)
+#define LAPIC_LVT_MASKED (1 << 16)
+#define LAPIC_LVT_TIMER_PERIODIC (1 << 17)
+#define LAPIC_TIMER_DIVIDE_16 0x3
+
+#define LAPIC_ICR_INIT    0x00000500
+#define LAPIC_ICR_STARTUP 0x00000600
+#define LAPIC_ICR_PENDING 0x00001000
+#define LAPIC_ICR_ASSERT  0x00004000
+
+// pit ticks to measure the timer over
+#define LAPIC_CALIBRATE_TICKS 10
+
+static uintptr_t lapic_base = 0;
+// timer counts (divided by 16) per pit tick
+static uint32_t lapic_timer_count = 0;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+	return mmio_read32(lapic_base + reg);
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+	mmio_write32(lapic_base + reg, value);
+}
+
+bool lapic_present(void) {
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(CPUID_FEATURES, &eax, &ebx, &ecx, &edx);
+	return edx & CPUID_EDX_APIC;
+}
+
+static void lapic_timer_handler(registers_t *regs) {
+	(void)regs;
+	lapic_eoi();
+	scheduler_tick();
+}
+
+static void lapic_spurious_handler(registers_t *regs) {
+	(void)regs;
+	// XXX: no eoi for spurious interrupts
+}
+
+void lapic_map(void) {
+	assert(lapic_base == 0);
+	uintptr_t base = (uintptr_t)(rdmsr(MSR_APIC_BASE) & 0xFFFFF000);
+	lapic_base = (uintptr_t)map_physical(base, BLOCK_SIZE, PAGE_PRESENT | PAGE_READWRITE | PAGE_CACHE_DISABLE);
+	assert(lapic_base != 0);
+	printf("%s: local apic 0x%x mapped at 0x%x\n", __func__, base, lapic_base);
+
+	isr_set_handler(APIC_VECTOR_TIMER, lapic_timer_handler);
+	isr_set_handler(APIC_VECTOR_SPURIOUS, lapic_spurious_handler);
+}
+
+void lapic_init(bool bootstrap) {
+	assert(lapic_base != 0);
+	wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | MSR_APIC_BASE_ENABLE);
+
+	lapic_write(LAPIC_TPR, 0);
+	lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+	lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+	if (!bootstrap) {
+		// XXX: the bios routed the pic through LINT0 of the bootstrap processor, keep that
+		lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+		lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_MASKED);
+	}
+	lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_VECTOR_SPURIOUS);
+	lapic_eoi();
+}
+
+uint8_t lapic_id(void) {
+	return (uint8_t)(lapic_read(LAPIC_ID) >> 24);
+}
+
+void lapic_eoi(void) {
+	lapic_write(LAPIC_EOI, 0);
+}
+
+static void lapic_send(uint8_t apic_id, uint32_t command) {
+	lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+	lapic_write(LAPIC_ICR_LOW, command);
+	while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+		__asm__ __volatile__ ("pause");
+	}
+}
+
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector) {
+	uint32_t eflags = 0;
+	__asm__ __volatile__ ("pushf\npop %0\ncli" : "=r"(eflags) : : "memory");
+	// XXX: ICR_HIGH and ICR_LOW are written separately, don't let an irq handler send in between
+	lapic_send(apic_id, LAPIC_ICR_ASSERT | vector);
+	if (eflags & (1 << 9)) {
+		interrupts_enable();
+	}
+}
+
+void lapic_send_init(uint8_t apic_id) {
+	lapic_send(apic_id, LAPIC_ICR_ASSERT | LAPIC_ICR_INIT);
+}
+
+void lapic_send_startup(uint8_t apic_id, uint8_t page) {
+	lapic_send(apic_id, LAPIC_ICR_ASSERT | LAPIC_ICR_STARTUP | page);
+}
+
+static void lapic_wait_ticks(uint64_t target) {
+	while (*(volatile uint64_t *)&timer_ticks < target) {
+		hlt();
+	}
+}
+
+void lapic_timer_calibrate(void) {
+	lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+	lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+
+	// start right after a tick
+	lapic_wait_ticks(*(volatile uint64_t *)&timer_ticks + 1);
+	uint64_t start = *(volatile uint64_t *)&timer_ticks;
+	lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+	lapic_wait_ticks(start + LAPIC_CALIBRATE_TICKS);
+	uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+	lapic_write(LAPIC_TIMER_INITIAL, 0);
+
+	lapic_timer_count = elapsed / LAPIC_CALIBRATE_TICKS;
+	printf("%s: %u counts per tick\n", __func__, lapic_timer_count);
+	assert(lapic_timer_count != 0);
+}
+
+void lapic_timer_start(void) {
+	assert(lapic_timer_count != 0);
+	lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+	lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_TIMER_PERIODIC | APIC_VECTOR_TIMER);
+	lapic_write(LAPIC_TIMER_INITIAL, lapic_timer_count);
+}
+
+void lapic_timer_stop(void) {
+	lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+	lapic_write(LAPIC_TIMER_INITIAL, 0);
+}
@@ -1,7 +1,12 @@
 #include <assert.h>
 #include <atomic.h>
+#include <cpu.h>
 #include <task.h>
 
+#define SPIN_TICKET_SHIFT 16
+#define SPIN_OWNER(v) ((uint16_t)((v) & 0xFFFF))
+#define SPIN_NEXT(v) ((uint16_t)((v) >> SPIN_TICKET_SHIFT))
+
 void spin_init(spin_t lock) {
 	lock[0] = 0;
 }
@@ -11,20 +16,59 @@ inline int arch_atomic_swap(volatile int *location, int value) {
 	return value;
 }
 
-void spin_lock(spin_t lock) {
-	scheduler_lock();
+inline uint32_t arch_atomic_fetch_add(volatile uint32_t *location, uint32_t value) {
+	__asm__ __volatile__ ("lock xadd %0, %1" : "+r"(value), "+m"(*location) : : "memory");
+	return value;
+}
+
+inline uint32_t arch_atomic_cmpxchg(volatile uint32_t *location, uint32_t expected, uint32_t value) {
+	__asm__ __volatile__ ("lock cmpxchg %2, %1" : "+a"(expected), "+m"(*location) : "r"(value) : "memory");
+	return expected;
+}
 
-	while ( arch_atomic_swap(lock, 1) != 0) {
-		// XXX: shouldn't happen basically
-		panic("couldn't acquire spin lock on single processor system: deadlock");
+void arch_spin_lock(spin_t lock) {
+	uint16_t ticket = SPIN_NEXT(arch_atomic_fetch_add(lock, 1 << SPIN_TICKET_SHIFT));
+	// XXX: taking a lock twice on the same cpu spins forever
+	while (SPIN_OWNER(lock[0]) != ticket) {
+		cpu_relax();
 	}
 }
 
-void spin_unlock(spin_t lock) {
-	int u = arch_atomic_swap(lock, 0);
-	if (u != 1) {
+void arch_spin_unlock(spin_t lock) {
+	uint32_t v = lock[0];
+	if (SPIN_OWNER(v) == SPIN_NEXT(v)) {
 		panic("trying to unlock lock that wasn't locked");
 	}
 
-	scheduler_unlock();
+	// XXX: only the owner ever touches the low half, it wraps without carrying into the high one
+	__asm__ __volatile__ ("lock incw %0" : "+m"(*(volatile uint16_t *)lock) : : "memory");
+}
+
+void spin_lock(spin_t lock) {
+	preempt_disable();
+	arch_spin_lock(lock);
+}
+
+uint32_t spin_lock_irqsave(spin_t lock) {
+	uint32_t eflags;
+	__asm__ __volatile__ ("pushf\n"
+	                      "pop %0\n"
+	                      "cli\n"
+	                      : "=r"(eflags) : : "memory");
+
+	arch_spin_lock(lock);
+	return eflags;
+}
+
+void spin_unlock_irqrestore(spin_t lock, uint32_t eflags) {
+	arch_spin_unlock(lock);
+
+	if (eflags & (1<<9)) {
+		interrupts_enable();
+	}
+}
+
+void spin_unlock(spin_t lock) {
+	arch_spin_unlock(lock);
+	preempt_enable();
 }
@@ -1,12 +1,38 @@
 #ifndef ARCH_ATOMIC_H
 #define ARCH_ATOMIC_H 1
 
-typedef volatile int spin_t[1];
+#include <stdint.h>
+
+/*
+ticket lock: the low half is the ticket being served, the high half the next one handed out,
+waiting cpus get the lock in the order they arrived
+*/
+typedef volatile uint32_t spin_t[1];
 
 int arch_atomic_swap(volatile int *location, int value);
+// returns the old value
+uint32_t arch_atomic_fetch_add(volatile uint32_t *location, uint32_t value);
+// stores value only if location holds expected, returns the old value
+uint32_t arch_atomic_cmpxchg(volatile uint32_t *location, uint32_t expected, uint32_t value);
+
+// spinning cpus keep answering tlb shootdowns, see smp_tlb_shootdown
+void smp_tlb_poll(void);
+#define cpu_relax() do { smp_tlb_poll(); __asm__ __volatile__ ("pause" : : : "memory"); } while (0)
+
+/* only the lock itself, neither preemption nor interrupts are touched */
+extern void arch_spin_lock(spin_t lock);
+extern void arch_spin_unlock(spin_t lock);
 
 extern void spin_init(spin_t lock);
+// disables preemption on this cpu until spin_unlock
 extern void spin_lock(spin_t lock);
 extern void spin_unlock(spin_t lock);
 
+/*
+disable interrupts on this cpu instead of preemption, usable from irq handlers
+returns the eflags to pass to spin_unlock_irqrestore
+*/
+extern uint32_t spin_lock_irqsave(spin_t lock);
+extern void spin_unlock_irqrestore(spin_t lock, uint32_t eflags);
+
 #endif
@@ -15,6 +15,7 @@ $(ARCHDIR)/paging.o \
 $(ARCHDIR)/task.o \
 $(ARCHDIR)/memcpy.o \
 $(ARCHDIR)/mmio.o \
+$(ARCHDIR)/smp_trampoline.o \
 $(ARCHDIR)/atomic.o
 
 ARCH_SRCS:= \
@@ -45,6 +45,59 @@ inline __attribute__((noreturn)) void halt() {
 	_halt();
 }
 
+void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+	__asm__ __volatile__("cpuid"
+		: "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+		: "a" (leaf), "c" (0));
+}
+
+uint64_t rdmsr(uint32_t msr) {
+	uint32_t lo, hi;
+	__asm__ __volatile__("rdmsr" : "=a" (lo), "=d" (hi) : "c" (msr));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+void wrmsr(uint32_t msr, uint64_t value) {
+	__asm__ __volatile__("wrmsr" : : "c" (msr), "a" ((uint32_t)value), "d" ((uint32_t)(value >> 32)));
+}
+
+/* sets EFER.NXE when the cpu supports no-execute pages, returns false otherwise */
+bool cpu_enable_nx(void) {
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(CPUID_EXTENDED, &eax, &ebx, &ecx, &edx);
+	if (eax < CPUID_EXTENDED_FEATURES) {
+		return false;
+	}
+
+	cpuid(CPUID_EXTENDED_FEATURES, &eax, &ebx, &ecx, &edx);
+	if (!(edx & CPUID_EXT_EDX_NX)) {
+		return false;
+	}
+
+	wrmsr(MSR_EFER, rdmsr(MSR_EFER) | MSR_EFER_NXE);
+	return true;
+}
+
+uint32_t read_cr0(void) {
+	uint32_t value;
+	__asm__ __volatile__ ("mov %%cr0, %0" : "=r"(value));
+	return value;
+}
+
+void write_cr0(uint32_t value) {
+	__asm__ __volatile__ ("mov %0, %%cr0" : : "r"(value) : "memory");
+}
+
+uint32_t read_cr4(void) {
+	uint32_t value;
+	__asm__ __volatile__ ("mov %%cr4, %0" : "=r"(value));
+	return value;
+}
+
+void write_cr4(uint32_t value) {
+	__asm__ __volatile__ ("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
 void interrupts_disable(void) {
 	__asm__ __volatile__("cli");
 }
@@ -73,7 +126,7 @@ static bool is_mapped(uintptr_t v_addr) {
 	if (kernel_directory == NULL) {
 		return true;
 	} else {
-		uintptr_t v = kernel_directory->physical_tables[v_addr >> 22];
+		page_t v = kernel_directory->physical_tables[PAGE_DIRECTORY_INDEX(v_addr)];
 		if (!(v & PAGE_TABLE_PRESENT)) {
 			return false;
 		} else {
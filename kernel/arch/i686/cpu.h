@@ -1,6 +1,7 @@
 #ifndef ARCH_CPU_H
 #define ARCH_CPU_H 1
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <vmm.h>
 
@@ -44,6 +45,33 @@ void outl(uint16_t port, uint32_t data);
 
 void iowait();
 
+#define CPUID_FEATURES 0x01
+#define CPUID_EDX_FXSR (1 << 24)
+#define CPUID_EDX_SSE (1 << 25)
+#define CPUID_EXTENDED 0x80000000
+#define CPUID_EXTENDED_FEATURES 0x80000001
+#define CPUID_EXT_EDX_NX (1 << 20)
+
+#define MSR_EFER 0xC0000080
+#define MSR_EFER_NXE (1 << 11)
+
+void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx);
+uint64_t rdmsr(uint32_t msr);
+void wrmsr(uint32_t msr, uint64_t value);
+bool cpu_enable_nx(void);
+
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
+#define CR0_NE (1 << 5)
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+
+uint32_t read_cr0(void);
+void write_cr0(uint32_t value);
+uint32_t read_cr4(void);
+void write_cr4(uint32_t value);
+
 #define hlt() __asm__ __volatile__ ("hlt")
 
 void interrupts_disable(void);
@@ -56,4 +56,10 @@ extern void _isr47();
 // syscall
 extern void _isr128();
 
+// local apic
+extern void _isr240();
+extern void _isr241();
+extern void _isr242();
+extern void _isr255();
+
 #endif
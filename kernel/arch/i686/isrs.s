@@ -29,6 +29,7 @@ isr_common_stub:
 	mov ds, ax
 	mov es, ax
 	mov fs, ax
+	mov ax, 0x30        ; per cpu data segment gdt index
 	mov gs, ax
 	cld
 
@@ -131,5 +132,10 @@ ISR_CUSTOM 45,13
 ISR_CUSTOM 46,14
 ISR_CUSTOM 47,15
 ISR_CUSTOM 128,0
+; local apic
+ISR_NOERR 240
+ISR_NOERR 241
+ISR_NOERR 242
+ISR_NOERR 255
 
 align 4096
@@ -9,6 +9,10 @@ load_page_directory:
 
 global enable_paging:function (enable_paging.end - enable_paging)
 enable_paging:
+	; PAE has to be enabled before paging
+	mov eax, cr4
+	or eax, 0x20
+	mov cr4, eax
 	mov eax, cr0
 	or eax, 0x80010001
 	mov cr0, eax
@@ -0,0 +1,73 @@
+; application processor startup, smp_init copies this to SMP_TRAMPOLINE and points the
+; startup ipi at it, the cpu starts in real mode at SMP_TRAMPOLINE:0000
+; everything up to the jump into smp_ap_main runs from the copy, hence TRAMPOLINE_ADDR
+
+SMP_TRAMPOLINE equ 0x8000
+%define TRAMPOLINE_ADDR(x) (SMP_TRAMPOLINE + ((x) - smp_trampoline_start))
+
+extern smp_ap_main
+extern smp_ap_cr3
+extern smp_ap_stack
+extern smp_ap_nx
+
+section .text
+align 16
+bits 16
+global smp_trampoline_start
+smp_trampoline_start:
+	cli
+	cld
+	xor ax, ax
+	mov ds, ax
+	lgdt [TRAMPOLINE_ADDR(trampoline_gdt_pointer)]
+	mov eax, cr0
+	or eax, 1
+	mov cr0, eax
+	jmp dword 0x08:TRAMPOLINE_ADDR(trampoline_protected)
+
+bits 32
+trampoline_protected:
+	mov ax, 0x10
+	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov gs, ax
+	mov ss, ax
+
+	; same as enable_paging, PAE before paging
+	mov eax, cr4
+	or eax, 0x20
+	mov cr4, eax
+	cmp BYTE [ smp_ap_nx ], 0
+	je .skip_nx
+	mov ecx, 0xC0000080 ; EFER
+	rdmsr
+	or eax, 1 << 11     ; NXE
+	wrmsr
+.skip_nx:
+	mov eax, DWORD [ smp_ap_cr3 ]
+	mov cr3, eax
+	mov eax, cr0
+	or eax, 0x80010001
+	mov cr0, eax
+
+	mov esp, DWORD [ smp_ap_stack ]
+	xor ebp, ebp
+	mov eax, smp_ap_main ; absolute, a relative call would be off in the copy
+	call eax
+.halt:
+	cli
+	hlt
+	jmp .halt
+
+align 8
+trampoline_gdt:
+	dq 0x0000000000000000 ; NULL segment
+	dq 0x00CF9A000000FFFF ; kernel code
+	dq 0x00CF92000000FFFF ; kernel data
+trampoline_gdt_pointer:
+	dw trampoline_gdt_pointer - trampoline_gdt - 1
+	dd TRAMPOLINE_ADDR(trampoline_gdt)
+
+global smp_trampoline_end
+smp_trampoline_end:
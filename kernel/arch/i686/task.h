@@ -1,13 +1,12 @@
 #ifndef ARCH_TASK_H
 #define ARCH_TASK_H 1
 
+#include <stdbool.h>
 #include <stdint.h>
 
-/* save all registers and call switch_task(void *) */
-extern void call_switch_task(void *);
+/* save the callee saved registers and esp to *prev_esp, continue on next_esp */
+extern void switch_context(uint32_t *prev_esp, uint32_t next_esp, volatile bool *prev_on_cpu);
 /* internal methods */
 extern void __attribute__((noreturn)) return_to_regs(void);
 
-extern uintptr_t read_eip();
-
 #endif
@@ -1,26 +1,25 @@
-global read_eip:function (read_eip.end - read_eip)
-read_eip:
-	mov eax, [esp]
-	ret
-.end:
+; void switch_context(uint32_t *prev_esp, uint32_t next_esp, volatile bool *prev_on_cpu)
+; save the callee saved registers on the current stack, switch to next_esp and
+; pop them from there, the caller saved ones are already taken care of by the compiler
+; new tasks start with a frame of four zeros and the address of their entry point
+global switch_context:function (switch_context.end - switch_context)
+switch_context:
+	mov eax, [esp + 4]
+	mov edx, [esp + 8]
+	mov ecx, [esp + 12]
 
-extern switch_task
-global call_switch_task:function (call_switch_task.end - call_switch_task)
-call_switch_task:
 	push ebp
-	mov ebp, esp
-
-	pushf
-	pusha
-
-	push DWORD [ebp + 8]
-	call switch_task
-	add esp, 4
+	push ebx
+	push esi
+	push edi
 
-	popa
-	popf
+	mov [eax], esp
+	mov esp, edx
+	mov BYTE [ecx], 0 ; prev->on_cpu = false, other cpus may pick it up from here on
 
-	mov esp, ebp
+	pop edi
+	pop esi
+	pop ebx
 	pop ebp
 	ret
 .end:
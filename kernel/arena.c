@@ -0,0 +1,91 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <arena.h>
+#include <heap.h>
+#include <string.h>
+
+#define ARENA_ALIGN 8
+// chunks are at least this large so a busy arena only hits kmalloc a couple of times
+#define ARENA_CHUNK_SIZE 1024
+
+typedef struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+} arena_chunk_t;
+
+#define ARENA_ROUND(x) (((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void arena_init(arena_t *arena, void *buffer, size_t size) {
+	assert(arena != NULL);
+	assert((buffer != NULL) || (size == 0));
+	assert(((uintptr_t)buffer % ARENA_ALIGN) == 0);
+	arena->buffer = buffer;
+	arena->size = size;
+	arena->used = 0;
+	arena->chunks = NULL;
+}
+
+void arena_release(arena_t *arena) {
+	arena_chunk_t *chunk = arena->chunks;
+	while (chunk != NULL) {
+		arena_chunk_t *next = chunk->next;
+		kfree(chunk);
+		chunk = next;
+	}
+	arena->chunks = NULL;
+	arena->used = 0;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+	assert(arena != NULL);
+	size = ARENA_ROUND(size);
+
+	if (arena->size - arena->used >= size) {
+		void *p = arena->buffer + arena->used;
+		arena->used += size;
+		return p;
+	}
+
+	arena_chunk_t *chunk = arena->chunks;
+	if ((chunk == NULL) || (chunk->size - chunk->used < size)) {
+		const size_t header = ARENA_ROUND(sizeof(arena_chunk_t));
+		const size_t chunk_size = (size > ARENA_CHUNK_SIZE - header) ? size : ARENA_CHUNK_SIZE - header;
+		chunk = kmalloc(header + chunk_size);
+		if (chunk == NULL) {
+			return NULL;
+		}
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+
+	void *p = (char *)chunk + ARENA_ROUND(sizeof(arena_chunk_t)) + chunk->used;
+	chunk->used += size;
+	return p;
+}
+
+void *arena_calloc(arena_t *arena, size_t nmemb, size_t size) {
+	void *p = arena_alloc(arena, nmemb * size);
+	if (p != NULL) {
+		memset(p, 0, nmemb * size);
+	}
+	return p;
+}
+
+char *arena_strndup(arena_t *arena, const char *s, size_t n) {
+	size_t len = 0;
+	while ((len < n) && (s[len] != '\0')) {
+		len++;
+	}
+
+	char *p = arena_alloc(arena, len + 1);
+	if (p != NULL) {
+		memcpy(p, s, len);
+		p[len] = '\0';
+	}
+	return p;
+}
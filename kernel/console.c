@@ -131,7 +131,11 @@ void vprintf(const char *fmt, va_list args) {
 	char buf[256]; // probably too much
 	char *s;
 
-	mutex_lock(&print_mutex);
+	// XXX: irq handlers and code holding spin locks can't sleep on the mutex, their output may interleave
+	bool locked = preemptible();
+	if (locked) {
+		mutex_lock(&print_mutex);
+	}
 	while (*fmt != 0) {
 		if (*fmt == '%') {
 			fmt++;
@@ -179,7 +183,9 @@ void vprintf(const char *fmt, va_list args) {
 				case 0:
 				default:
 					// XXX: we need to unlock the mutex or assert will deadlock calling printf
-					mutex_unlock(&print_mutex);
+					if (locked) {
+						mutex_unlock(&print_mutex);
+					}
 					assert(0);
 					return;
 			}
@@ -188,7 +194,9 @@ void vprintf(const char *fmt, va_list args) {
 		}
 		fmt++;
 	}
-	mutex_unlock(&print_mutex);
+	if (locked) {
+		mutex_unlock(&print_mutex);
+	}
 }
 
 void __attribute__((format(printf,1,2))) printf(const char *fmt, ...) {
@@ -0,0 +1,108 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic.h>
+#include <console.h>
+#include <dma_pool.h>
+#include <heap.h>
+#include <list.h>
+#include <pmm.h>
+#include <string.h>
+#include <vmm.h>
+
+dma_pool_t *dma_pool_create(const char *name, size_t size, size_t align) {
+	assert(size != 0);
+	// power of two alignments only, at least enough to keep the freelist pointer aligned
+	assert((align & (align - 1)) == 0);
+	if (align < sizeof(void *)) {
+		align = sizeof(void *);
+	}
+	size = (size + align - 1) & ~(align - 1);
+	assert(size <= BLOCK_SIZE);
+
+	dma_pool_t *pool = kcalloc(1, sizeof(dma_pool_t));
+	assert(pool != NULL);
+	pool->name = name;
+	pool->size = size;
+	pool->align = align;
+	pool->free = NULL;
+	pool->pages = list_init();
+	spin_init(pool->lock);
+	return pool;
+}
+
+/* all objects have to be freed before */
+void dma_pool_destroy(dma_pool_t *pool) {
+	assert(pool != NULL);
+	assert(pool->n_active == 0);
+
+	while (pool->pages->length > 0) {
+		void *page = list_dequeue(pool->pages);
+		dma_free(page, BLOCK_SIZE);
+	}
+	list_free(pool->pages);
+	kfree(pool->pages);
+	kfree(pool);
+}
+
+/*
+the freelist link lives in the last word of a free object, hardware that still looks at a
+just freed descriptor (eg. a queue head being unlinked) only sees its header unchanged
+*/
+#define DMA_POOL_LINK(pool, obj) (*(void **)((uintptr_t)(obj) + (pool)->size - sizeof(void *)))
+
+/* carve a new page into objects and push them onto the freelist, called with the lock held */
+static void dma_pool_add_page(dma_pool_t *pool, void *page) {
+	list_insert(pool->pages, page);
+	for (size_t offset = 0; offset + pool->size <= BLOCK_SIZE; offset += pool->size) {
+		void *obj = (void *)((uintptr_t)page + offset);
+		DMA_POOL_LINK(pool, obj) = pool->free;
+		pool->free = obj;
+	}
+}
+
+void *dma_pool_alloc(dma_pool_t *pool, uintptr_t *phys) {
+	assert(pool != NULL);
+
+	uint32_t eflags = spin_lock_irqsave(pool->lock);
+	if (pool->free == NULL) {
+		// XXX: dma_malloc may be slow, don't keep interrupts disabled while it searches
+		spin_unlock_irqrestore(pool->lock, eflags);
+		void *page = dma_malloc(BLOCK_SIZE);
+		if (page == NULL) {
+			printf("%s(%s): out of memory\n", __func__, pool->name);
+			return NULL;
+		}
+		eflags = spin_lock_irqsave(pool->lock);
+		dma_pool_add_page(pool, page);
+	}
+
+	void *obj = pool->free;
+	pool->free = DMA_POOL_LINK(pool, obj);
+	pool->n_active++;
+	if (pool->n_active > pool->n_peak) {
+		pool->n_peak = pool->n_active;
+	}
+	spin_unlock_irqrestore(pool->lock, eflags);
+
+	memset(obj, 0, pool->size);
+	if (phys != NULL) {
+		// dma memory is identity mapped
+		*phys = (uintptr_t)obj;
+	}
+	return obj;
+}
+
+void dma_pool_free(dma_pool_t *pool, void *obj) {
+	assert(pool != NULL);
+	assert(obj != NULL);
+	assert(((uintptr_t)obj & (pool->align - 1)) == 0);
+
+	uint32_t eflags = spin_lock_irqsave(pool->lock);
+	assert(pool->n_active > 0);
+	DMA_POOL_LINK(pool, obj) = pool->free;
+	pool->free = obj;
+	pool->n_active--;
+	spin_unlock_irqrestore(pool->lock, eflags);
+}
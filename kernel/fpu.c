@@ -0,0 +1,164 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <atomic.h>
+#include <console.h>
+#include <cpu.h>
+#include <fpu.h>
+#include <isr.h>
+#include <slab.h>
+#include <smp.h>
+#include <string.h>
+#include <task.h>
+
+// fpu_cpu of a task whose state isn't loaded on any cpu
+#define FPU_NO_CPU ((unsigned int)-1)
+
+static kmem_cache_t fpu_state_cache = KMEM_CACHE_INIT_SIZE("fpu_state", FPU_STATE_SIZE, NULL);
+
+static bool fpu_fxsr = false;
+// state every task starts with, saved right after fninit on the bootstrap processor
+static uint8_t fpu_initial_state[FPU_STATE_SIZE] __attribute__((aligned(16)));
+
+static inline void fpu_save(void *state) {
+	if (fpu_fxsr) {
+		__asm__ __volatile__ ("fxsave (%0)" : : "r"(state) : "memory");
+	} else {
+		// XXX: fnsave reinitializes the fpu, load the state again so it's still valid for fpu_owner
+		__asm__ __volatile__ ("fnsave (%0)\n"
+		                      "frstor (%0)" : : "r"(state) : "memory");
+	}
+}
+
+static inline void fpu_restore(void *state) {
+	if (fpu_fxsr) {
+		__asm__ __volatile__ ("fxrstor (%0)" : : "r"(state) : "memory");
+	} else {
+		__asm__ __volatile__ ("frstor (%0)" : : "r"(state) : "memory");
+	}
+}
+
+/* #NM, the current task used the fpu for the first time since it was switched to */
+static void fpu_device_not_available(registers_t *regs) {
+	(void)regs;
+	cpu_t *cpu = this_cpu();
+	task_t *task = cpu->current;
+	assert(task != NULL);
+	assert(!cpu->fpu_used);
+
+	__asm__ __volatile__ ("clts");
+	cpu->fpu_used = true;
+
+	if ((cpu->fpu_owner == task) && (task->fpu_cpu == cpu->id) && (task->fpu_state != NULL)) {
+		// nobody else used the fpu here since the task was switched away from
+		return;
+	}
+
+	if (task->fpu_state == NULL) {
+		task->fpu_state = kmem_cache_alloc(&fpu_state_cache);
+		// TODO: kill the task instead
+		assert(task->fpu_state != NULL);
+		memcpy(task->fpu_state, fpu_initial_state, FPU_STATE_SIZE);
+	}
+
+	fpu_restore(task->fpu_state);
+	cpu->fpu_owner = task;
+	task->fpu_cpu = cpu->id;
+}
+
+void fpu_init_cpu(void) {
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(CPUID_FEATURES, &eax, &ebx, &ecx, &edx);
+	fpu_fxsr = (edx & CPUID_EDX_FXSR) != 0;
+
+	// fpu errors as #MF instead of through the pic, fwait honors CR0.TS
+	write_cr0((read_cr0() & ~CR0_EM) | CR0_MP | CR0_NE);
+	if (fpu_fxsr) {
+		uint32_t cr4 = read_cr4() | CR4_OSFXSR;
+		if (edx & CPUID_EDX_SSE) {
+			cr4 |= CR4_OSXMMEXCPT;
+		}
+		write_cr4(cr4);
+	}
+
+	__asm__ __volatile__ ("clts\n"
+	                      "fninit");
+
+	cpu_t *cpu = this_cpu();
+	if (cpu->id == 0) {
+		fpu_save(fpu_initial_state);
+		isr_set_handler(7, fpu_device_not_available);
+	}
+
+	cpu->fpu_owner = NULL;
+	cpu->fpu_used = false;
+	write_cr0(read_cr0() | CR0_TS);
+}
+
+/*
+XXX: the state is saved on the way out (not when the next task traps) because prev may
+     be picked up by another cpu before this one uses the fpu again
+*/
+void fpu_switch(cpu_t *cpu, task_t *prev) {
+	if (!cpu->fpu_used) {
+		// CR0.TS is still set, prev didn't touch the fpu
+		return;
+	}
+
+	assert(cpu->fpu_owner == prev);
+	if (prev->state == TASK_STATE_TERMINATED) {
+		cpu->fpu_owner = NULL;
+	} else {
+		fpu_save(prev->fpu_state);
+	}
+	cpu->fpu_used = false;
+	write_cr0(read_cr0() | CR0_TS);
+}
+
+void fpu_task_copy(task_t *dst, task_t *src) {
+	assert(dst->fpu_state == NULL);
+	if (src->fpu_state == NULL) {
+		return;
+	}
+
+	dst->fpu_state = kmem_cache_alloc(&fpu_state_cache);
+	assert(dst->fpu_state != NULL);
+
+	preempt_disable();
+	cpu_t *cpu = this_cpu();
+	if (cpu->fpu_used && (cpu->fpu_owner == src)) {
+		// the saved state is stale, src used the fpu since it was switched to
+		fpu_save(src->fpu_state);
+	}
+	memcpy(dst->fpu_state, src->fpu_state, FPU_STATE_SIZE);
+	preempt_enable();
+	// the new task_t may be at the address of a dead task some fpu_owner still points at
+	dst->fpu_cpu = FPU_NO_CPU;
+}
+
+void fpu_task_reset(task_t *task) {
+	preempt_disable();
+	cpu_t *cpu = this_cpu();
+	if (cpu->fpu_owner == task) {
+		if (cpu->fpu_used) {
+			cpu->fpu_used = false;
+			write_cr0(read_cr0() | CR0_TS);
+		}
+		cpu->fpu_owner = NULL;
+	}
+	fpu_task_free(task);
+	preempt_enable();
+}
+
+void fpu_task_free(task_t *task) {
+	// forget task everywhere, a new task at the same address would take the fpu contents for its own
+	for (unsigned int i = 0; i < smp_num_cpus; i++) {
+		arch_atomic_cmpxchg((volatile uint32_t *)&cpus[i].fpu_owner, (uint32_t)task, 0);
+	}
+	task->fpu_cpu = FPU_NO_CPU;
+	if (task->fpu_state != NULL) {
+		kmem_cache_free(&fpu_state_cache, task->fpu_state);
+		task->fpu_state = NULL;
+	}
+}
@@ -3,16 +3,21 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <arena.h>
 #include <list.h>
 #include <console.h>
 #include <fs.h>
 #include <heap.h>
+#include <slab.h>
 #include <string.h>
+#include <task.h>
 
 /**
 root node of the mount graph
 */
 fs_mount_t *fs_root_mount = NULL;
+// path lookups read the mount graph concurrently, only (un)mounting writes to it
+static rwlock_t fs_mount_lock;
 
 /* misc. helpers */
 /* strlen for path elements */
@@ -24,12 +29,32 @@ size_t path_element_size(const char *path) {
 	return i;
 }
 
-/* XXX: free the return value if not NULL */
-static char *tokenize_path(const char *path) {
+/*
+path resolution works on lists of path elements, the list, its nodes and the strings
+are all allocated from the arena of the lookup and go away with it
+*/
+static list_t *path_elements_new(arena_t *arena) {
+	list_t *elements = arena_calloc(arena, 1, sizeof(list_t));
+	assert(elements != NULL); // TODO: handle
+	return elements;
+}
+
+static void path_element_push(arena_t *arena, list_t *elements, const char *s, size_t len) {
+	node_t *node = arena_alloc(arena, sizeof(node_t) + len + 1);
+	assert(node != NULL); // TODO: handle
+	char *value = (char *)(node + 1);
+	memcpy(value, s, len);
+	value[len] = 0;
+	node->value = value;
+	node->owner = NULL;
+	list_append(elements, node);
+}
+
+static char *tokenize_path(arena_t *arena, const char *path) {
 	assert(path != NULL);
 
 	const size_t path_len = strlen(path);
-	char *s = kmalloc(sizeof(char) * (path_len + 2));
+	char *s = arena_alloc(arena, sizeof(char) * (path_len + 2));
 	if (s == NULL) {
 		return NULL;
 	}
@@ -59,35 +84,27 @@ static char *tokenize_path(const char *path) {
 	return s;
 }
 
-/* XXX: list_free on the return value if not NULL */
-static list_t *tokenize_path_list(const char *path) {
+static list_t *tokenize_path_list(arena_t *arena, const char *path) {
 	assert(path != NULL);
 
-	list_t *elements = list_init();
-	if (elements == NULL) {
-		return NULL;
-	}
+	list_t *elements = path_elements_new(arena);
 	const size_t path_len = strlen(path);
 	size_t i = 0;
 	while (i < path_len) {
 		const size_t j = path_element_size(&path[i]);
-		char *s = strndup(&path[i], j);
-		assert(s != NULL); // TODO: handle
-		if (strlen(s) == 0) {
-			kfree(s);
-		} else {
-			list_insert(elements, s);
+		if (j != 0) {
+			path_element_push(arena, elements, &path[i], j);
 		}
 		i += j + 1;
 	}
 	return elements;
 }
 
-static list_t *canonicalize_path_push_path(const char *path, list_t *elements) {
+static list_t *canonicalize_path_push_path(arena_t *arena, const char *path, list_t *elements) {
 	assert(path != NULL);
 	assert(elements != NULL);
 
-	char *path_t = tokenize_path(path);
+	char *path_t = tokenize_path(arena, path);
 	assert(path_t != NULL);
 	char *s = path_t;
 
@@ -98,78 +115,72 @@ static list_t *canonicalize_path_push_path(const char *path, list_t *elements) {
 			node_t *tail = elements->tail;
 			/* TODO: properly handle underflow */
 			assert(tail != NULL);
-			kfree(tail->value);
 			list_delete(elements, tail);
-			kfree(tail);
 		} else if (!memcmp(s, ".", 2)) {
 			;
 			/* do-nothing */
 		} else {
-			char *s_n = kmalloc(sizeof(char) * j);
-			/* TODO: handle out of memory graefully */
-			assert(s_n != NULL);
-			strncpy(s_n, s, j);
-			list_insert(elements, s_n);
+			path_element_push(arena, elements, s, j - 1);
 		}
 		s += j;
 	}
 
-	kfree(path_t);
 	return elements;
 }
 
 // XXX: for performance reasons, parent must already be canonical
-static list_t *canonicalize_path_list(const char *parent, const char *relative_path) {
+static list_t *canonicalize_path_list(arena_t *arena, const char *parent, const char *relative_path) {
 	assert(parent != NULL);
 	assert(relative_path != NULL);
 
-	list_t *elements = list_init();
-	assert(elements != NULL);
+	list_t *elements = path_elements_new(arena);
 
 	const size_t path_l = strlen(relative_path);
 	if ((path_l > 0) && (relative_path[0] != '/')) {
 		/* relative path, tokenize and push parent path */
-		char *p_t = tokenize_path(parent);
+		char *p_t = tokenize_path(arena, parent);
 		assert(p_t != NULL);
 		char *s = p_t;
 		while (*s != 0) {
 			const size_t j = strlen(s) + 1;
-			char *sn = kmalloc(sizeof(char) * j);
-			assert(sn != NULL);
-			strncpy(sn, s, j);
-			list_insert(elements, sn);
+			path_element_push(arena, elements, s, j - 1);
 			s += j;
 		}
-		kfree(p_t);
 	}
 
-	return canonicalize_path_push_path(relative_path, elements);
+	return canonicalize_path_push_path(arena, relative_path, elements);
 }
 
 /* XXX: end has to be non-null and it has to appear in the list after start */
-static list_t *copy_elements(node_t *start, node_t *end) {
-	list_t *elements = list_init();
-	if (elements == NULL) {
-		return NULL;
-	}
+static list_t *copy_elements(arena_t *arena, node_t *start, node_t *end) {
+	list_t *elements = path_elements_new(arena);
 
 	for (node_t *node = start; node != end; node = node->next) {
 		assert(node != NULL);
 		const char *value = node->value;
-		const size_t value_len = strlen(value) + 1;
-		assert(value_len != 1);
-		char *new_value = kmalloc(sizeof(char) * value_len);
-		assert(new_value != NULL);
-		memcpy(new_value, value, value_len);
-		list_insert(elements, new_value);
+		const size_t value_len = strlen(value);
+		assert(value_len != 0);
+		path_element_push(arena, elements, value, value_len);
 	}
 
 	return elements;
 }
 
+static kmem_cache_t fs_node_cache = KMEM_CACHE_INIT("fs_node_t", fs_node_t, NULL);
+static kmem_cache_t dirent_cache = KMEM_CACHE_INIT("dirent", struct dirent, NULL);
+
+/* struct dirent helpers, readdir implementations return these */
+struct dirent *fs_dirent_new(void) {
+	return kmem_cache_alloc(&dirent_cache);
+}
+
+void fs_dirent_free(struct dirent *dirent) {
+	kmem_cache_free(&dirent_cache, dirent);
+}
+
 /* fs_node_t helpers */
 fs_node_t *fs_node_new(void) {
-	fs_node_t *node = kcalloc(1, sizeof(fs_node_t));
+	fs_node_t *node = kmem_cache_alloc(&fs_node_cache);
 	if (node == NULL) {
 		return NULL;
 	}
@@ -186,7 +197,7 @@ static void fs_node_free(fs_node_t **node) {
 		(*node)->close(*node);
 	}
 
-	kfree(*node);
+	kmem_cache_free(&fs_node_cache, *node);
 	*node = NULL;
 }
 
@@ -352,11 +363,14 @@ void fs_mount_root(fs_node_t *node) {
 	assert(mount != NULL);
 	assert(mount->mounts != NULL);
 
+	mount->node = fs_node_reference(node);
+	mount->element = kmalloc(sizeof(char) * 2);
+	mount->element[0] = '/';
+	mount->element[1] = 0;
+
+	rwlock_write_lock(&fs_mount_lock);
 	fs_root_mount = mount;
-	fs_root_mount->node = fs_node_reference(node);
-	fs_root_mount->element = kmalloc(sizeof(char) * 2);
-	fs_root_mount->element[0] = '/';
-	fs_root_mount->element[1] = 0;
+	rwlock_write_unlock(&fs_mount_lock);
 }
 
 static fs_mount_t *fs_mount_submount(fs_mount_t *parent, fs_node_t *node, const char *path_element) {
@@ -415,13 +429,21 @@ static fs_mount_t *walk_mount_graph(list_t *elements, fs_mount_t *mount) {
 			node_t *tmp = node;
 			node = node->next;
 			list_delete(elements, tmp);
-			kfree(tmp);
 		}
 	}
 	return mount;
 }
 
-static fs_node_t *findfile_recursive(list_t *elements, fs_node_t *root_node, unsigned int level) {
+/* walk the mount graph from the root, returns a reference to the root node of the last mount on the path */
+static fs_node_t *fs_mount_lookup(list_t *elements) {
+	rwlock_read_lock(&fs_mount_lock);
+	fs_mount_t *mount = walk_mount_graph(elements, fs_root_mount);
+	fs_node_t *node = fs_node_reference(mount->node);
+	rwlock_read_unlock(&fs_mount_lock);
+	return node;
+}
+
+static fs_node_t *findfile_recursive(arena_t *arena, list_t *elements, fs_node_t *root_node, unsigned int level) {
 	assert(elements != NULL);
 	assert(root_node != NULL);
 
@@ -454,18 +476,13 @@ static fs_node_t *findfile_recursive(list_t *elements, fs_node_t *root_node, uns
 			assert(buf[len] == 0);
 
 			// copy all leading list elements
-			list_t *l = copy_elements(elements->head, element);
+			list_t *l = copy_elements(arena, elements->head, element);
 
-			canonicalize_path_push_path(buf, l);
+			canonicalize_path_push_path(arena, buf, l);
 
-			fs_mount_t *mount = walk_mount_graph(l, fs_root_mount);
-			next_node = findfile_recursive(l, mount->node, level + 1);
-
-			list_foreach(node, l) {
-				kfree(node->value);
-				node->value = NULL;
-			}
-			list_free(l);
+			fs_node_t *mount_node = fs_mount_lookup(l);
+			next_node = findfile_recursive(arena, l, mount_node, level + 1);
+			fs_node_release(&mount_node);
 
 			if (next_node != NULL) {
 				fs_node_release(&node);
@@ -483,15 +500,15 @@ static fs_node_t *findfile_recursive(list_t *elements, fs_node_t *root_node, uns
 }
 
 static fs_node_t *findfile(const char *root, const char *relative_path) {
-	list_t *l = canonicalize_path_list(root, relative_path);
-	fs_mount_t *mount = walk_mount_graph(l, fs_root_mount);
-	fs_node_t *f = findfile_recursive(l, mount->node, 0);
+	// enough for the element lists of most lookups, deep paths and symlinks spill into the heap
+	ARENA_ON_STACK(arena, 512);
 
-	list_foreach(node, l) {
-		kfree(node->value);
-		node->value = NULL;
-	}
-	list_free(l);
+	list_t *l = canonicalize_path_list(&arena, root, relative_path);
+	fs_node_t *mount_node = fs_mount_lookup(l);
+	fs_node_t *f = findfile_recursive(&arena, l, mount_node, 0);
+	fs_node_release(&mount_node);
+
+	arena_release(&arena);
 	return f;
 }
 
@@ -500,11 +517,13 @@ fs_node_t *kopen(const char *path, unsigned int flags) {
 	fs_node_t *node;
 
 	if (!memcmp(path, "/", 2)) {
+		rwlock_read_lock(&fs_mount_lock);
 		if (fs_root_mount != NULL) {
 			node = fs_node_reference(fs_root_mount->node);
 		} else {
 			node = NULL;
 		}
+		rwlock_read_unlock(&fs_mount_lock);
 	} else {
 		node = findfile("/", path);
 	}
@@ -524,10 +543,8 @@ bool kmount(const char *path, fs_node_t *node) {
 	assert(node != NULL);
 	printf("%s(path: '%s', node: %p)\n", __func__, path, node);
 
-	list_t *elements = tokenize_path_list(path);
-	if (elements == NULL) {
-		return false;
-	}
+	ARENA_ON_STACK(arena, 256);
+	list_t *elements = tokenize_path_list(&arena, path);
 
 	list_foreach(node, elements) {
 		const char *s = (const char *)node->value;
@@ -535,24 +552,29 @@ bool kmount(const char *path, fs_node_t *node) {
 	}
 
 	if (elements->length < 1) {
+		arena_release(&arena);
 		return false;
 	}
 
 	char *mount_element = elements->tail->value;
 	assert(mount_element != NULL);
 
+	rwlock_write_lock(&fs_mount_lock);
 	fs_mount_t *parent1 = walk_mount_graph(elements, fs_root_mount);
 	printf("%s: parent1: %p\n", __func__, parent1);
 
 	if (elements->length == 0) {
+		rwlock_write_unlock(&fs_mount_lock);
 		printf("%s: TODO: there is already a mount at that location\n", __func__);
-		// TODO: properly handle and free memory
+		arena_release(&arena);
 		return false;
 	}
 
 	if (elements->length == 1) {
 		fs_mount_t *submount = fs_mount_submount(parent1, node, mount_element);
+		rwlock_write_unlock(&fs_mount_lock);
 		if (submount == NULL) {
+			arena_release(&arena);
 			return false;
 		} else {
 			printf("%s: submount->__refcount == %i\n", __func__, submount->__refcount);
@@ -561,14 +583,10 @@ bool kmount(const char *path, fs_node_t *node) {
 		}
 	} else {
 		// TODO: insert "empty" submount entries
+		rwlock_write_unlock(&fs_mount_lock);
 		assert(0);
 	}
 
-	list_foreach(node, elements) {
-		kfree(node->value);
-		node->value = NULL;
-	}
-	list_free(elements);
-
+	arena_release(&arena);
 	return true;
 }
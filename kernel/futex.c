@@ -0,0 +1,140 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <futex.h>
+#include <pit.h>
+#include <pmm.h>
+#include <task.h>
+#include <vmm.h>
+
+// power of two
+#define FUTEX_HASH_SIZE 64
+
+/* XXX: all protected by the scheduler lock, waiters with different keys may share a queue */
+static task_queue_t futex_queues[FUTEX_HASH_SIZE];
+
+/* physical address of the futex word at uaddr, 0 if it isn't a valid one */
+static uint64_t futex_key(page_directory_t *pdir, uintptr_t uaddr) {
+	if ((uaddr & (sizeof(uint32_t) - 1)) != 0) {
+		return 0;
+	}
+
+	page_table_t *table = get_table(uaddr, pdir);
+	if (table == NULL) {
+		return 0;
+	}
+
+	page_t page = get_page(table, uaddr);
+	if ((page & (PAGE_PRESENT | PAGE_USER)) != (PAGE_PRESENT | PAGE_USER)) {
+		return 0;
+	}
+	return PAGE_FRAME(page) | (uaddr & (BLOCK_SIZE - 1));
+}
+
+static task_queue_t *futex_queue(uint64_t key) {
+	uint32_t k = (uint32_t)(key >> 2);
+	return &futex_queues[(k ^ (k >> 10)) & (FUTEX_HASH_SIZE - 1)];
+}
+
+/* wake up to n waiters on key, with the scheduler locked */
+static uint32_t __futex_wake(uint64_t key, uint32_t n) {
+	task_queue_t *queue = futex_queue(key);
+	uint32_t woken = 0;
+	task_t *task = queue->first;
+	while ((task != NULL) && (woken < n)) {
+		task_t *next = task->next_task;
+		if (task->futex_key == key) {
+			task_unblock(task);
+			woken++;
+		}
+		task = next;
+	}
+	return woken;
+}
+
+int32_t futex_wait(page_directory_t *pdir, uintptr_t uaddr, uint32_t val, uint64_t timeout) {
+	assert(pdir != NULL);
+
+	// XXX: the value check and queueing have to be atomic with respect to futex_wake
+	scheduler_lock();
+	uint64_t key = futex_key(pdir, uaddr);
+	if (key == 0) {
+		scheduler_unlock();
+		return -FUTEX_EFAULT;
+	}
+
+	volatile uint32_t *word = map_physical(key, sizeof(uint32_t), PAGE_PRESENT);
+	if (word == NULL) {
+		scheduler_unlock();
+		return -FUTEX_EFAULT;
+	}
+	uint32_t current = *word;
+	unmap_physical((void *)word, sizeof(uint32_t));
+	if (current != val) {
+		scheduler_unlock();
+		return -FUTEX_EAGAIN;
+	}
+
+	task_t *task = current_task;
+	task->futex_key = key;
+	if (timeout == 0) {
+		task_block(futex_queue(key), TASK_STATE_BLOCKED);
+	} else {
+		task_block_timeout(futex_queue(key), TASK_STATE_BLOCKED, timer_now() + timeout);
+	}
+	// blocks here
+	scheduler_unlock();
+
+	task->futex_key = 0;
+	return ((timeout != 0) && task->timed_out) ? -FUTEX_ETIMEDOUT : 0;
+}
+
+int32_t futex_wake(page_directory_t *pdir, uintptr_t uaddr, uint32_t n) {
+	assert(pdir != NULL);
+
+	scheduler_lock();
+	uint64_t key = futex_key(pdir, uaddr);
+	if (key == 0) {
+		scheduler_unlock();
+		return -FUTEX_EFAULT;
+	}
+	uint32_t woken = __futex_wake(key, n);
+	scheduler_unlock();
+	return (int32_t)woken;
+}
+
+/* wake up to n_wake waiters on uaddr and move up to n_requeue of the others over to uaddr2 */
+int32_t futex_requeue(page_directory_t *pdir, uintptr_t uaddr, uint32_t n_wake, uintptr_t uaddr2, uint32_t n_requeue) {
+	assert(pdir != NULL);
+
+	scheduler_lock();
+	uint64_t key = futex_key(pdir, uaddr);
+	uint64_t key2 = futex_key(pdir, uaddr2);
+	if ((key == 0) || (key2 == 0)) {
+		scheduler_unlock();
+		return -FUTEX_EFAULT;
+	}
+
+	uint32_t n = __futex_wake(key, n_wake);
+
+	task_queue_t *queue = futex_queue(key);
+	task_queue_t *queue2 = futex_queue(key2);
+	uint32_t requeued = 0;
+	task_t *task = queue->first;
+	// XXX: requeued tasks may land behind task on the same queue, stop at the old last one
+	task_t *last = queue->last;
+	while ((task != NULL) && (requeued < n_requeue)) {
+		task_t *next = (task == last) ? NULL : task->next_task;
+		if (task->futex_key == key) {
+			task->futex_key = key2;
+			if (queue2 != queue) {
+				task_requeue(task, queue2);
+			}
+			requeued++;
+		}
+		task = next;
+	}
+	scheduler_unlock();
+	return (int32_t)(n + requeued);
+}
@@ -2,51 +2,65 @@
 
 #include <gdt.h>
 #include <gdt_flush.h>
+#include <smp.h>
 #include <string.h>
 #include <tss_flush.h>
 
-gdt_pointer_t gdt_pointer;
-__attribute__((section("shared_data"))) __attribute__((aligned(4096))) gdt_entry_t gdt[6];
-__attribute__((section("shared_data"))) __attribute__((aligned(4096))) tss_t tss;
-
-static void gdt_set_gate(uint8_t i, uint32_t base, uint32_t limit, uint8_t access, uint8_t granularity) {
-	gdt[i].limit_low = (uint16_t)(limit & 0xFFFF);
-	gdt[i].base_low = (uint16_t)(base & 0xFFFF);
-	gdt[i].base_middle = (uint8_t)((base >> 16) & 0xFF);
-	gdt[i].access = access;
-	gdt[i].granularity = (uint8_t)(((limit >> 16) & 0x0F) | (granularity & 0xF0));
-	gdt[i].base_high = (uint8_t)((base >> 24) & 0xFF);
+__attribute__((section("shared_data"))) __attribute__((aligned(4096))) gdt_entry_t gdt[SMP_MAX_CPUS][GDT_ENTRIES];
+__attribute__((section("shared_data"))) __attribute__((aligned(4096))) tss_t tss[SMP_MAX_CPUS];
+
+static void gdt_set_gate(gdt_entry_t *table, uint8_t i, uint32_t base, uint32_t limit, uint8_t access, uint8_t granularity) {
+	table[i].limit_low = (uint16_t)(limit & 0xFFFF);
+	table[i].base_low = (uint16_t)(base & 0xFFFF);
+	table[i].base_middle = (uint8_t)((base >> 16) & 0xFF);
+	table[i].access = access;
+	table[i].granularity = (uint8_t)(((limit >> 16) & 0x0F) | (granularity & 0xF0));
+	table[i].base_high = (uint8_t)((base >> 24) & 0xFF);
 }
 
-void gdt_init(void) {
-	memset(&tss, 0, sizeof(tss));
-
-	uint32_t tss_base = (uint32_t)&tss;
-	uint32_t tss_limit = (uint32_t)sizeof(tss);
-	tss.ss0 = 0x10;
-	tss.esp0 = 0x0;
-	tss.iopb_offset = sizeof(tss);
-	tss.cs = 0x0b;
-	tss.ss = 0x13;
-	tss.ds = 0x13;
-	tss.es = 0x13;
-	tss.fs = 0x13;
-	tss.gs = 0x13;
+void gdt_init_cpu(cpu_t *cpu) {
+	gdt_entry_t *table = gdt[cpu->id];
+	tss_t *t = &tss[cpu->id];
+	memset(t, 0, sizeof(tss_t));
+
+	uint32_t tss_base = (uint32_t)t;
+	uint32_t tss_limit = (uint32_t)sizeof(tss_t);
+	t->ss0 = 0x10;
+	t->esp0 = 0x0;
+	t->iopb_offset = sizeof(tss_t);
+	t->cs = 0x0b;
+	t->ss = 0x13;
+	t->ds = 0x13;
+	t->es = 0x13;
+	t->fs = 0x13;
+	t->gs = 0x13;
+
+	cpu->self = cpu;
+	cpu->tss = t;
 
 	/* XXX: all gdt descriptors have been set as accessed so we can map them read-only into userspace page directories */
-	gdt_set_gate(0, 0, 0x00000000, 0x01, 0x00); /* NULL segment */
-	gdt_set_gate(1, 0, 0xFFFFFFFF, 0x9b, 0xC0); /* kernel segment */
-	gdt_set_gate(2, 0, 0xFFFFFFFF, 0x93, 0xC0); /* kernel segment */
-	gdt_set_gate(3, 0, 0xFFFFFFFF, 0xF9, 0xC0); /* user segment */
-	gdt_set_gate(4, 0, 0xFFFFFFFF, 0xF3, 0xC0); /* user segment */
-	gdt_set_gate(5, tss_base, tss_limit, 0x89, 0x40); /* tss segment */
-
-	gdt_pointer.limit = sizeof(gdt) - 1;
-	gdt_pointer.base = (uintptr_t)&gdt;
+	gdt_set_gate(table, 0, 0, 0x00000000, 0x01, 0x00); /* NULL segment */
+	gdt_set_gate(table, 1, 0, 0xFFFFFFFF, 0x9b, 0xC0); /* kernel segment */
+	gdt_set_gate(table, 2, 0, 0xFFFFFFFF, 0x93, 0xC0); /* kernel segment */
+	gdt_set_gate(table, 3, 0, 0xFFFFFFFF, 0xF9, 0xC0); /* user segment */
+	gdt_set_gate(table, 4, 0, 0xFFFFFFFF, 0xF3, 0xC0); /* user segment */
+	gdt_set_gate(table, 5, tss_base, tss_limit, 0x89, 0x40); /* tss segment */
+	gdt_set_gate(table, 6, (uint32_t)cpu, sizeof(cpu_t) - 1, 0x93, 0x40); /* per cpu data, byte granular */
+
+	gdt_pointer_t gdt_pointer;
+	gdt_pointer.limit = sizeof(gdt[0]) - 1;
+	gdt_pointer.base = (uintptr_t)table;
 	gdt_flush((uintptr_t)&gdt_pointer);
 	tss_flush();
+
+	__asm__ __volatile__ ("mov %0, %%gs" : : "r"((uint32_t)GDT_SELECTOR_PERCPU));
+}
+
+void gdt_init(void) {
+	cpus[0].id = 0;
+	gdt_init_cpu(&cpus[0]);
 }
 
 void tss_set_kstack(uintptr_t stack) {
-	tss.esp0 = stack;
+	this_cpu()->tss->esp0 = stack;
 }
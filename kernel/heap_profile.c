@@ -0,0 +1,370 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic.h>
+#include <console.h>
+#include <fs.h>
+#include <heap.h>
+#include <heap_profile.h>
+#include <itoa.h>
+#include <pit.h>
+#include <string.h>
+
+/*
+every callsite of kmalloc/kcalloc/krealloc gets a tag, every live allocation made while
+profiling is enabled gets a record (pointer -> tag, size) so kfree can be attributed
+both tables are static, the profiler must never allocate from the heap it is watching
+*/
+#define HEAP_PROFILE_TAG_BITS 8
+#define HEAP_PROFILE_TAGS (1u << HEAP_PROFILE_TAG_BITS)
+#define HEAP_PROFILE_RECORD_BITS 13
+#define HEAP_PROFILE_RECORDS (1u << HEAP_PROFILE_RECORD_BITS)
+// keep the record table at most 3/4 full so probe sequences stay short
+#define HEAP_PROFILE_RECORDS_MAX (HEAP_PROFILE_RECORDS / 4 * 3)
+// all sizes above KMALLOC_MAX_SIZE
+#define HEAP_PROFILE_CLASS_LARGE KMALLOC_CLASSES
+
+typedef struct {
+	void *caller;
+	uint32_t allocs;
+	uint32_t frees;
+	uint32_t live_count;
+	uint32_t live_bytes;
+	uint32_t peak_bytes;
+	uint32_t classes; // bitmap of the size classes requested from this callsite
+} heap_tag_t;
+
+typedef struct {
+	void *ptr;
+	uint32_t size;
+	uint32_t tag;
+} heap_record_t;
+
+bool heap_profile_enabled = false;
+
+static heap_tag_t heap_tags[HEAP_PROFILE_TAGS];
+static heap_record_t heap_records[HEAP_PROFILE_RECORDS];
+static unsigned int heap_tags_used = 0;
+static unsigned int heap_records_used = 0;
+// allocations that didn't fit into one of the tables
+static uint32_t heap_untracked = 0;
+static uint64_t heap_profile_start = 0;
+static spin_t heap_profile_lock;
+
+static inline uint32_t heap_profile_hash(uintptr_t v, unsigned int bits) {
+	return ((uint32_t)(v >> 2) * 2654435761u) >> (32 - bits);
+}
+
+static unsigned int heap_size_class(size_t size) {
+	if (size > KMALLOC_MAX_SIZE) {
+		return HEAP_PROFILE_CLASS_LARGE;
+	}
+
+	unsigned int i = 0;
+	while (((size_t)1 << (i + KMALLOC_MIN_SHIFT)) < size) {
+		i++;
+	}
+	return i;
+}
+
+/* returns the tag of caller, HEAP_PROFILE_TAGS if the table is full */
+static unsigned int heap_tag_get(void *caller) {
+	unsigned int i = heap_profile_hash((uintptr_t)caller, HEAP_PROFILE_TAG_BITS);
+	for (unsigned int n = 0; n < HEAP_PROFILE_TAGS; n++, i = (i + 1) & (HEAP_PROFILE_TAGS - 1)) {
+		if (heap_tags[i].caller == caller) {
+			return i;
+		} else if (heap_tags[i].caller == NULL) {
+			if (heap_tags_used >= HEAP_PROFILE_TAGS - 1) {
+				return HEAP_PROFILE_TAGS;
+			}
+			heap_tags[i].caller = caller;
+			heap_tags_used++;
+			return i;
+		}
+	}
+	return HEAP_PROFILE_TAGS;
+}
+
+static heap_record_t *heap_record_find(void *ptr) {
+	unsigned int i = heap_profile_hash((uintptr_t)ptr, HEAP_PROFILE_RECORD_BITS);
+	while (heap_records[i].ptr != NULL) {
+		if (heap_records[i].ptr == ptr) {
+			return &heap_records[i];
+		}
+		i = (i + 1) & (HEAP_PROFILE_RECORDS - 1);
+	}
+	return NULL;
+}
+
+/* linear probing with backward shift deletion, no tombstones */
+static void heap_record_remove(heap_record_t *record) {
+	unsigned int i = record - heap_records;
+	unsigned int j = i;
+
+	while (1) {
+		heap_records[i].ptr = NULL;
+		unsigned int k;
+		do {
+			j = (j + 1) & (HEAP_PROFILE_RECORDS - 1);
+			if (heap_records[j].ptr == NULL) {
+				heap_records_used--;
+				return;
+			}
+			k = heap_profile_hash((uintptr_t)heap_records[j].ptr, HEAP_PROFILE_RECORD_BITS);
+		} while ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)));
+
+		heap_records[i] = heap_records[j];
+		i = j;
+	}
+}
+
+static void heap_record_release(heap_record_t *record) {
+	heap_tag_t *tag = &heap_tags[record->tag];
+	tag->frees++;
+	tag->live_count--;
+	tag->live_bytes -= record->size;
+	heap_record_remove(record);
+}
+
+void __heap_profile_alloc(void *ptr, size_t size, void *caller) {
+	uint32_t eflags = spin_lock_irqsave(heap_profile_lock);
+
+	// a stale record from before the last disable, the memory has been freed since
+	heap_record_t *record = heap_record_find(ptr);
+	if (record != NULL) {
+		heap_record_release(record);
+	}
+
+	unsigned int t = heap_tag_get(caller);
+	if ((t == HEAP_PROFILE_TAGS) || (heap_records_used >= HEAP_PROFILE_RECORDS_MAX)) {
+		heap_untracked++;
+		spin_unlock_irqrestore(heap_profile_lock, eflags);
+		return;
+	}
+
+	heap_tag_t *tag = &heap_tags[t];
+	tag->allocs++;
+	tag->live_count++;
+	tag->live_bytes += size;
+	if (tag->live_bytes > tag->peak_bytes) {
+		tag->peak_bytes = tag->live_bytes;
+	}
+	tag->classes |= 1u << heap_size_class(size);
+
+	unsigned int i = heap_profile_hash((uintptr_t)ptr, HEAP_PROFILE_RECORD_BITS);
+	while (heap_records[i].ptr != NULL) {
+		i = (i + 1) & (HEAP_PROFILE_RECORDS - 1);
+	}
+	heap_records[i].ptr = ptr;
+	heap_records[i].size = size;
+	heap_records[i].tag = t;
+	heap_records_used++;
+
+	spin_unlock_irqrestore(heap_profile_lock, eflags);
+}
+
+void __heap_profile_free(void *ptr) {
+	uint32_t eflags = spin_lock_irqsave(heap_profile_lock);
+	heap_record_t *record = heap_record_find(ptr);
+	if (record != NULL) {
+		heap_record_release(record);
+	}
+	spin_unlock_irqrestore(heap_profile_lock, eflags);
+}
+
+void heap_profile_reset(void) {
+	uint32_t eflags = spin_lock_irqsave(heap_profile_lock);
+	memset(heap_tags, 0, sizeof(heap_tags));
+	memset(heap_records, 0, sizeof(heap_records));
+	heap_tags_used = 0;
+	heap_records_used = 0;
+	heap_untracked = 0;
+	heap_profile_start = timer_now();
+	spin_unlock_irqrestore(heap_profile_lock, eflags);
+}
+
+void heap_profile_enable(bool enable) {
+	if (enable && !heap_profile_enabled) {
+		heap_profile_start = timer_now();
+	}
+	heap_profile_enabled = enable;
+}
+
+/* report */
+
+// one report line is well below this
+#define HEAP_PROFILE_LINE 128
+#define HEAP_PROFILE_REPORT_SIZE ((HEAP_PROFILE_TAGS + 4) * HEAP_PROFILE_LINE)
+
+typedef struct {
+	char *buf;
+	size_t len;
+	size_t size;
+} heap_report_t;
+
+static void report_str(heap_report_t *r, const char *s) {
+	while ((*s != '\0') && (r->len + 1 < r->size)) {
+		r->buf[r->len++] = *s++;
+	}
+	r->buf[r->len] = '\0';
+}
+
+/* right aligned in a field of width characters */
+static void report_uint(heap_report_t *r, uint32_t value, int base, size_t width) {
+	char num[33];
+	utoa(value, num, base, 0);
+	for (size_t n = strlen(num); n < width; n++) {
+		report_str(r, " ");
+	}
+	report_str(r, num);
+}
+
+static void report_classes(heap_report_t *r, uint32_t classes) {
+	bool first = true;
+	for (unsigned int i = 0; i <= HEAP_PROFILE_CLASS_LARGE; i++) {
+		if (!(classes & (1u << i))) {
+			continue;
+		}
+		report_str(r, first ? " " : ",");
+		first = false;
+		if (i == HEAP_PROFILE_CLASS_LARGE) {
+			report_str(r, "large");
+		} else {
+			report_uint(r, 1u << (i + KMALLOC_MIN_SHIFT), 10, 0);
+		}
+	}
+}
+
+static size_t heap_profile_report(char *buf, size_t size) {
+	heap_tag_t *tags = kmalloc_flags(sizeof(heap_tags), KMALLOC_MAY_SLEEP);
+	if (tags == NULL) {
+		return 0;
+	}
+
+	uint32_t eflags = spin_lock_irqsave(heap_profile_lock);
+	memcpy(tags, heap_tags, sizeof(heap_tags));
+	uint32_t records = heap_records_used;
+	uint32_t untracked = heap_untracked;
+	uint32_t elapsed = (uint32_t)(timer_now() - heap_profile_start) / (FREQUENCY / 1000);
+	spin_unlock_irqrestore(heap_profile_lock, eflags);
+
+	// biggest live footprint first, leaks float to the top
+	for (unsigned int i = 1; i < HEAP_PROFILE_TAGS; i++) {
+		heap_tag_t t = tags[i];
+		unsigned int j = i;
+		for (; (j > 0) && (tags[j - 1].live_bytes < t.live_bytes); j--) {
+			tags[j] = tags[j - 1];
+		}
+		tags[j] = t;
+	}
+
+	heap_report_t r = {.buf = buf, .len = 0, .size = size};
+	uint32_t live_bytes = 0;
+	for (unsigned int i = 0; i < HEAP_PROFILE_TAGS; i++) {
+		live_bytes += tags[i].live_bytes;
+	}
+
+	report_str(&r, "heap profile: ");
+	report_str(&r, heap_profile_enabled ? "enabled" : "disabled");
+	report_str(&r, ", ");
+	report_uint(&r, elapsed, 10, 0);
+	report_str(&r, " ms, ");
+	report_uint(&r, records, 10, 0);
+	report_str(&r, " live allocations, ");
+	report_uint(&r, live_bytes, 10, 0);
+	report_str(&r, " live bytes, ");
+	report_uint(&r, untracked, 10, 0);
+	report_str(&r, " untracked\n");
+	report_str(&r, "  caller        allocs     frees      live  live bytes  peak bytes  allocs/s  classes\n");
+
+	for (unsigned int i = 0; i < HEAP_PROFILE_TAGS; i++) {
+		heap_tag_t *t = &tags[i];
+		if (t->caller == NULL) {
+			continue;
+		}
+		report_str(&r, "  0x");
+		report_uint(&r, (uintptr_t)t->caller, 16, 8);
+		report_uint(&r, t->allocs, 10, 10);
+		report_uint(&r, t->frees, 10, 10);
+		report_uint(&r, t->live_count, 10, 10);
+		report_uint(&r, t->live_bytes, 10, 12);
+		report_uint(&r, t->peak_bytes, 10, 12);
+		report_uint(&r, (elapsed >= 1000) ? t->allocs / (elapsed / 1000) : t->allocs, 10, 10);
+		report_str(&r, " ");
+		report_classes(&r, t->classes);
+		report_str(&r, "\n");
+	}
+
+	kfree(tags);
+	return r.len;
+}
+
+void heap_profile_dump(void) {
+	char *buf = kmalloc_flags(HEAP_PROFILE_REPORT_SIZE, KMALLOC_MAY_SLEEP);
+	if (buf == NULL) {
+		printf("%s: out of memory\n", __func__);
+		return;
+	}
+
+	heap_profile_report(buf, HEAP_PROFILE_REPORT_SIZE);
+	printf("%s", buf);
+	kfree(buf);
+}
+
+/* kernel node */
+
+static uint32_t heap_profile_read(fs_node_t *node, uint32_t offset, uint32_t size, void *buffer) {
+	(void)node;
+	char *buf = kmalloc_flags(HEAP_PROFILE_REPORT_SIZE, KMALLOC_MAY_SLEEP);
+	if (buf == NULL) {
+		return 0;
+	}
+
+	size_t len = heap_profile_report(buf, HEAP_PROFILE_REPORT_SIZE);
+	if (offset >= len) {
+		kfree(buf);
+		return 0;
+	}
+	if (size > len - offset) {
+		size = len - offset;
+	}
+	memcpy(buffer, buf + offset, size);
+	kfree(buf);
+	return size;
+}
+
+static uint32_t heap_profile_write(fs_node_t *node, uint32_t offset, uint32_t size, void *buffer) {
+	(void)node; (void)offset;
+	const char *cmd = buffer;
+	for (uint32_t i = 0; i < size; i++) {
+		switch (cmd[i]) {
+			case '1':
+				heap_profile_enable(true);
+				break;
+			case '0':
+				heap_profile_enable(false);
+				break;
+			case 'r':
+				heap_profile_reset();
+				break;
+			case 'd':
+				heap_profile_dump();
+				break;
+			default:
+				break;
+		}
+	}
+	return size;
+}
+
+fs_node_t *heap_profile_create(void) {
+	fs_node_t *f = fs_node_new();
+	assert(f != NULL);
+	strncpy(f->name, "heapstat", 255);
+	f->flags = FS_NODE_CHARDEVICE;
+	f->read = heap_profile_read;
+	f->write = heap_profile_write;
+	return f;
+}
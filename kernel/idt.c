@@ -27,3 +27,8 @@ void idt_install(void) {
 
 	idt_load((uintptr_t)&idt_p);
 }
+
+// the idt is shared, application processors only have to load it
+void idt_install_ap(void) {
+	idt_load((uintptr_t)&idt_p);
+}
@@ -0,0 +1,51 @@
+#ifndef ACPI_H
+#define ACPI_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+	char signature[4];
+	uint32_t length; // including the header
+	uint8_t revision;
+	uint8_t checksum;
+	char oem_id[6];
+	char oem_table_id[8];
+	uint32_t oem_revision;
+	uint32_t creator_id;
+	uint32_t creator_revision;
+} __attribute__((packed)) acpi_sdt_header_t;
+
+/* MADT ("APIC"), the interrupt controllers of the system */
+typedef struct {
+	acpi_sdt_header_t header;
+	uint32_t lapic_address;
+	uint32_t flags;
+	// followed by a list of acpi_madt_entry_t
+} __attribute__((packed)) acpi_madt_t;
+
+#define ACPI_MADT_LAPIC  0
+#define ACPI_MADT_IOAPIC 1
+
+typedef struct {
+	uint8_t type;
+	uint8_t length;
+} __attribute__((packed)) acpi_madt_entry_t;
+
+#define ACPI_MADT_LAPIC_ENABLED (1 << 0)
+
+typedef struct {
+	acpi_madt_entry_t entry;
+	uint8_t processor_id;
+	uint8_t apic_id;
+	uint32_t flags;
+} __attribute__((packed)) acpi_madt_lapic_t;
+
+// search the ebda and the bios rom for a 16 byte aligned structure starting with signature, returns its physical address or 0
+uintptr_t acpi_scan_bios(const char *signature, size_t signature_length, size_t size);
+
+void acpi_init(void);
+// the table with signature (eg. "APIC") mapped into the kernel, NULL if there is none
+acpi_sdt_header_t *acpi_find_table(const char *signature);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef APIC_H
+#define APIC_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* interrupt vectors of the local apic, above the pic irqs and the syscall gate */
+#define APIC_VECTOR_TIMER      0xF0
+#define APIC_VECTOR_RESCHEDULE 0xF1
+#define APIC_VECTOR_TLB        0xF2
+#define APIC_VECTOR_SPURIOUS   0xFF
+
+bool lapic_present(void);
+// map the local apic registers (the same physical page on every cpu), call once on the bootstrap processor
+void lapic_map(void);
+// enable the local apic of the calling cpu
+void lapic_init(bool bootstrap);
+
+uint8_t lapic_id(void);
+void lapic_eoi(void);
+
+/* inter processor interrupts */
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector);
+void lapic_send_init(uint8_t apic_id);
+void lapic_send_startup(uint8_t apic_id, uint8_t page);
+
+/* timer, only used on the application processors, the bootstrap processor keeps the pit */
+// measure the timer against the pit, needs interrupts enabled
+void lapic_timer_calibrate(void);
+// periodic, FREQUENCY times a second
+void lapic_timer_start(void);
+void lapic_timer_stop(void);
+
+#endif
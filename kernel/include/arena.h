@@ -0,0 +1,37 @@
+#ifndef ARENA_H
+#define ARENA_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+bump allocator for short lived allocations that all die at the same time
+(path resolution, exec argument marshalling)
+allocations come from a caller supplied (usually on-stack) buffer first,
+once that is used up from kmalloc'd chunks, arena_release frees everything at once
+there is no per allocation free
+*/
+
+struct arena_chunk;
+
+typedef struct {
+	char *buffer;
+	size_t size;
+	size_t used;
+	struct arena_chunk *chunks;
+} arena_t;
+
+// declare an arena backed by size bytes of stack
+#define ARENA_ON_STACK(_name, _size) \
+	char _name ## _buffer[(_size)] __attribute__((aligned(8))); \
+	arena_t _name; \
+	arena_init(&(_name), _name ## _buffer, (_size))
+
+void arena_init(arena_t *arena, void *buffer, size_t size);
+void arena_release(arena_t *arena);
+
+void * __attribute__((malloc)) arena_alloc(arena_t *arena, size_t size);
+void * __attribute__((malloc)) arena_calloc(arena_t *arena, size_t nmemb, size_t size);
+char *arena_strndup(arena_t *arena, const char *s, size_t n);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef DMA_POOL_H
+#define DMA_POOL_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic.h>
+#include <list.h>
+
+/*
+pools of small, fixed size dma buffers (descriptors, packet buffers)
+objects are packed into identity mapped pages and never cross a page boundary,
+freed objects are recycled, pages are only returned by dma_pool_destroy
+*/
+typedef struct dma_pool {
+	const char *name;
+	size_t size; // object size, rounded up to the alignment
+	size_t align;
+	void *free;
+	list_t *pages;
+	spin_t lock;
+
+	/* statistics */
+	uint32_t n_active;
+	uint32_t n_peak;
+} dma_pool_t;
+
+dma_pool_t *dma_pool_create(const char *name, size_t size, size_t align);
+void dma_pool_destroy(dma_pool_t *pool);
+
+// returns a zeroed object and (if phys != NULL) its physical address, NULL if out of memory
+void *dma_pool_alloc(dma_pool_t *pool, uintptr_t *phys);
+void dma_pool_free(dma_pool_t *pool, void *obj);
+
+#endif
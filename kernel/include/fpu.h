@@ -0,0 +1,28 @@
+#ifndef FPU_H
+#define FPU_H 1
+
+#include <smp.h>
+#include <task.h>
+
+/*
+lazy fpu/sse context switching
+CR0.TS is set whenever a task is switched to, its first fpu instruction raises #NM,
+only then the state is loaded (if the fpu doesn't hold it already)
+the state of a task that used the fpu is saved when it is switched away from
+*/
+
+// fxsave needs 512 bytes aligned to 16, fnsave (no FXSR) 108
+#define FPU_STATE_SIZE 512
+
+void fpu_init_cpu(void);
+
+// XXX: only call with interrupts disabled, before switching away from prev
+void fpu_switch(cpu_t *cpu, task_t *prev);
+
+// copy the fpu state of src (usually the current task) to dst, for fork
+void fpu_task_copy(task_t *dst, task_t *src);
+// drop the fpu state of task (exec), it starts from scratch on its next fpu instruction
+void fpu_task_reset(task_t *task);
+void fpu_task_free(task_t *task);
+
+#endif
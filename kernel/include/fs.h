@@ -73,6 +73,10 @@ fs_node_t *fs_node_new(void);
 void fs_node_release(fs_node_t **node);
 fs_node_t *fs_node_reference(fs_node_t *node);
 
+/* struct dirent helpers */
+struct dirent *fs_dirent_new(void);
+void fs_dirent_free(struct dirent *dirent);
+
 /* mount graph nodes */
 struct fs_mount;
 typedef struct fs_mount {
@@ -112,7 +116,7 @@ XXX: will only call node->close before fs_node is freed
 void fs_close(fs_node_t **node);
 /*
 dirent fs_readdir(node, i);
-XXX: the caller has to call kfree on the returned value if not null
+XXX: the caller has to call fs_dirent_free on the returned value if not null
 */
 struct dirent *fs_readdir(struct fs_node *node, uint32_t i);
 /*
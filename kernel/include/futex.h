@@ -0,0 +1,31 @@
+#ifndef FUTEX_H
+#define FUTEX_H 1
+
+#include <stdint.h>
+
+#include <vmm.h>
+
+/* same values as linux, so the (patched) musl can use them as is */
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+#define FUTEX_REQUEUE 3
+#define FUTEX_PRIVATE_FLAG 128
+
+/* futex_* return negative errnos, like the linux syscall */
+#define FUTEX_EAGAIN 11
+#define FUTEX_EFAULT 14
+#define FUTEX_EINVAL 22
+#define FUTEX_ENOSYS 38
+#define FUTEX_ETIMEDOUT 110
+
+/*
+fast userspace mutexes
+waiters are hashed by the physical address of the futex word, so processes sharing
+the page (or threads sharing the whole directory) meet on the same queue
+timeout is in ticks relative to now, 0 waits forever
+*/
+int32_t futex_wait(page_directory_t *pdir, uintptr_t uaddr, uint32_t val, uint64_t timeout);
+int32_t futex_wake(page_directory_t *pdir, uintptr_t uaddr, uint32_t n);
+int32_t futex_requeue(page_directory_t *pdir, uintptr_t uaddr, uint32_t n_wake, uintptr_t uaddr2, uint32_t n_requeue);
+
+#endif
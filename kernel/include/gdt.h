@@ -48,12 +48,21 @@ typedef struct {
 	uintptr_t base __attribute__((packed));
 } __attribute__((packed)) gdt_pointer_t;
 
-extern gdt_pointer_t gdt_pointer;
-extern gdt_entry_t gdt[6];
-extern tss_t tss;
+#define GDT_ENTRIES 7
+// the per cpu data segment, loaded into %gs while in the kernel
+#define GDT_SELECTOR_PERCPU 0x30
 
+struct cpu;
+
+// every cpu has its own gdt and tss, both are indexed by cpu->id
+extern gdt_entry_t gdt[][GDT_ENTRIES];
+extern tss_t tss[];
+
+// gdt_init_cpu for the bootstrap processor
 void gdt_init(void);
+void gdt_init_cpu(struct cpu *cpu);
 
+// sets the kernel stack of the calling cpu
 void tss_set_kstack(uintptr_t stack);
 
 #endif
@@ -5,10 +5,34 @@
 
 void liballoc_init(void);
 void liballoc_dump(void);
+// give unused heap memory back to the pmm
+void liballoc_trim(void);
 
+enum kmalloc_flags {
+	KMALLOC_DEFAULT   = 0x00,
+	// zero the returned memory
+	KMALLOC_ZERO      = 0x02,
+	// on OOM trim the heap and sleep before retrying, only returns NULL after KMALLOC_SLEEP_RETRIES tries
+	// (does not sleep if the caller can't block)
+	KMALLOC_MAY_SLEEP = 0x04,
+};
+
+#define KMALLOC_SLEEP_RETRIES 10
+#define KMALLOC_SLEEP_MS 10
+
+// small requests are served from power of two size classes, KMALLOC_MIN_SIZE..KMALLOC_MAX_SIZE
+#define KMALLOC_MIN_SHIFT 4
+#define KMALLOC_MAX_SHIFT 10
+#define KMALLOC_MAX_SIZE (1ul << KMALLOC_MAX_SHIFT)
+#define KMALLOC_CLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+// all allocators return NULL on OOM
 void * __attribute__((malloc)) kmalloc(size_t size);
+void * __attribute__((malloc)) kmalloc_flags(size_t size, unsigned int flags);
 void * __attribute__((alloc_size(1,2))) kcalloc(size_t nmemb, size_t size);
 void * __attribute__((alloc_size(2))) krealloc(void *ptr, size_t size);
 void kfree(void *ptr);
+// the number of bytes ptr can actually hold, krealloc up to this size never moves it
+size_t kmalloc_usable_size(void *ptr);
 
 #endif
@@ -0,0 +1,37 @@
+#ifndef HEAP_PROFILE_H
+#define HEAP_PROFILE_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <fs.h>
+
+/*
+per-callsite accounting of kmalloc/kfree, off by default
+allocations made while profiling is disabled are not tracked (and neither are their frees)
+*/
+extern bool heap_profile_enabled;
+
+void heap_profile_enable(bool enable);
+void heap_profile_reset(void);
+// print the per-callsite report over serial/console
+void heap_profile_dump(void);
+// read only report node, writing '1'/'0' enables/disables profiling, 'r' resets and 'd' dumps
+fs_node_t *heap_profile_create(void);
+
+void __heap_profile_alloc(void *ptr, size_t size, void *caller);
+void __heap_profile_free(void *ptr);
+
+static inline void heap_profile_alloc(void *ptr, size_t size, void *caller) {
+	if (heap_profile_enabled && (ptr != NULL)) {
+		__heap_profile_alloc(ptr, size, caller);
+	}
+}
+
+static inline void heap_profile_free(void *ptr) {
+	if (heap_profile_enabled && (ptr != NULL)) {
+		__heap_profile_free(ptr);
+	}
+}
+
+#endif
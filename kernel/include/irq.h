@@ -3,13 +3,25 @@
 
 #define IRQ_IGNORED 0
 #define IRQ_HANDLED 1
+// handled, the rest is done by the threaded handler
+#define IRQ_WAKE_THREAD 2
 
 typedef unsigned int (*irq_handler_t)(unsigned int irq, void *extra);
 
 void irq_set_handler(unsigned int irq, irq_handler_t irq_handler, void *extra);
+/*
+split handlers: irq_handler only quiets the device and acks the irq, returning IRQ_WAKE_THREAD
+thread_handler then runs in the ktask of the irq, where it may block,
+the irq line stays masked until it returned
+*/
+void irq_set_threaded_handler(unsigned int irq, irq_handler_t irq_handler, irq_handler_t thread_handler, void *extra);
 
 void irq_ack(unsigned int irq);
+void irq_mask(unsigned int irq);
+void irq_unmask(unsigned int irq);
 
 void irq_init(void);
+// start the irq ktasks, threaded handlers run in the irq handler until then
+void irq_threads_init(void);
 
 #endif
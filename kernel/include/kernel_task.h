@@ -13,7 +13,10 @@ typedef struct {
 	void *extra;
 } ktask_t;
 
+// XXX: not yet known to the scheduler, see task_add
+ktask_t *ktask_create(ktask_func *func, const char *name, void *extra);
 void ktask_spawn(ktask_func *func, const char *name, void *extra);
+void ktask_destroy(ktask_t *ktask);
 __attribute__((noreturn)) void __ktask_exit(unsigned int status);
 
 #endif
@@ -126,6 +126,9 @@ typedef struct {
 	list_t *arp_cache;
 } netif_t;
 
+packet_t *net_packet_new(void);
+void net_packet_free(packet_t *packet);
+
 void net_register_netif(const send_packet_t send, const receive_packet_t receive, const uint8_t mac[6], void *extra);
 
 bool net_send_ethernet(netif_t *netif, const uint8_t srcmac[6], const uint8_t dstmac[6], enum ethernet_type type, const uint8_t *data, size_t data_size);
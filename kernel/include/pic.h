@@ -15,5 +15,7 @@ void pic_init(void);
 #define irq_from_isr(i) ((unsigned int)((unsigned int)(i))-32)
 #define isr_from_irq(i) ((unsigned int)((unsigned int)(i))+32)
 void pic_send_eoi(unsigned int irq);
+void pic_mask(unsigned int irq);
+void pic_unmask(unsigned int irq);
 
 #endif
@@ -8,4 +8,12 @@
 extern uint64_t timer_ticks;
 void pit_init(void);
 
+/* tickless operation, call with interrupts disabled */
+void timer_oneshot(uint64_t target);
+void timer_periodic(void);
+// timer_ticks is only updated lazily while the periodic tick is stopped, this isn't
+uint64_t timer_now(void);
+// for when timer_ticks can't advance (interrupts disabled)
+void timer_busy_wait(uint32_t ticks);
+
 #endif
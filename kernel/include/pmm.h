@@ -6,21 +6,42 @@
 #include <stdint.h>
 
 #define BLOCK_SIZE 4096
+#define BLOCK_SHIFT 12
+
+/* blocks below 4GiB, these can be identity mapped (page tables, dma, heap) */
+#define PMM_LOW_BLOCKS 0x100000
+/* largest amount of memory we track, 36-bit physical addresses */
+#define PMM_MAX_MEMORY 0x1000000000ULL
+
+typedef uint64_t phys_addr_t;
 
 extern uint32_t *block_map;
 extern uint32_t block_map_size;
 
+/*
+the block map is shared by all cpus, the helpers below don't lock, callers that use them
+directly (outside of early boot) hold pmm_lock
+*/
+uint32_t pmm_lock(void);
+void pmm_unlock(uint32_t eflags);
+
 void pmm_set_block(uintptr_t block);
 void pmm_unset_block(uintptr_t block);
 bool pmm_test_block(uintptr_t block);
 
-void pmm_init(void *mem_map, size_t mem_size);
+void pmm_init(void *mem_map, uint64_t mem_size);
+size_t pmm_map_size(void);
 
 uint32_t pmm_count_free_blocks(void);
+// only below 4GiB, what pmm_alloc_blocks can hand out
+uint32_t pmm_count_free_low_blocks(void);
 
 uint32_t pmm_find_region(size_t size);
 uintptr_t pmm_alloc_blocks(size_t size);
-void pmm_free_blocks(uintptr_t p, size_t size);
+void pmm_free_blocks(phys_addr_t p, size_t size);
 uintptr_t pmm_alloc_blocks_safe(size_t size);
+// may return blocks above 4GiB, only use for memory that is accessed through a mapping
+phys_addr_t pmm_alloc_blocks_high(size_t size);
+phys_addr_t pmm_alloc_blocks_high_safe(size_t size);
 
 #endif
@@ -35,6 +35,9 @@ typedef struct process {
 	fd_table_t *fd_table;
 	tree_node_t *ptree_node;
 	task_queue_t wait_queue;
+	// cpu times (ticks) of exited children and their children, added when they exit, under the scheduler lock
+	uint64_t cutime;
+	uint64_t cstime;
 } process_t;
 
 #define current_process ((process_t *)(current_task->type == TASK_TYPE_USER_PROCESS ? current_task->obj : NULL))
@@ -89,6 +92,15 @@ process_t *process_clone(process_t *oldproc, enum syscall_clone_flags flags, uin
 
 void process_add(process_t *process);
 void process_init(void);
+/*
+nice value of process pid (0 for the calling one), looked up and accessed under the process tree lock
+so it can't be freed meanwhile, -1 if there is no such process (or it may not be changed)
+only the calling process and its children can be changed, and their nice values only raised
+*/
+int process_getpriority(pid_t pid, int *nice);
+int process_setpriority(pid_t pid, int nice);
+// calls fn for every process under the process tree lock, fn must not take it itself
+void process_foreach(void (*fn)(process_t *process, void *extra), void *extra);
 
 uint32_t process_waitpid(pid_t pid, uint32_t status, uint32_t options);
 
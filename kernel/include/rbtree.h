@@ -0,0 +1,36 @@
+#ifndef RBTREE_H
+#define RBTREE_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+intrusive red-black tree, the node is embedded into the object and the tree never allocates
+equal keys are inserted after the existing ones, the smallest node is cached
+*/
+typedef struct rbtree_node {
+	struct rbtree_node *parent;
+	struct rbtree_node *left;
+	struct rbtree_node *right;
+	bool red;
+} rbtree_node_t;
+
+typedef struct {
+	rbtree_node_t *root;
+	rbtree_node_t *leftmost;
+} rbtree_t;
+
+// true if a sorts before b
+typedef bool (rbtree_less_func)(const rbtree_node_t *a, const rbtree_node_t *b);
+
+#define rbtree_entry(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+void rbtree_insert(rbtree_t *tree, rbtree_node_t *node, rbtree_less_func *less);
+void rbtree_remove(rbtree_t *tree, rbtree_node_t *node);
+rbtree_node_t *rbtree_next(rbtree_node_t *node);
+
+static inline rbtree_node_t *rbtree_first(rbtree_t *tree) {
+	return tree->leftmost;
+}
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef SCHEDSTAT_H
+#define SCHEDSTAT_H 1
+
+#include <fs.h>
+
+// read only node: idle time per cpu, cpu time, time spent waiting for a cpu and switches per process
+fs_node_t *schedstat_create(void);
+
+#endif
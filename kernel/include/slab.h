@@ -0,0 +1,57 @@
+#ifndef SLAB_H
+#define SLAB_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic.h>
+
+/*
+object caches for fixed size kernel objects
+every slab is a single page, the slab header lives at the start of the page
+and free objects are kept in a per slab freelist
+caches only disable interrupts while locked, so they can be used from irq handlers
+*/
+
+struct kmem_slab;
+
+typedef struct kmem_cache {
+	const char *name;
+	size_t size;
+	// called on every object returned by kmem_cache_alloc (after zeroing)
+	void (*ctor)(void *obj);
+
+	/* set up on first use */
+	size_t object_size;
+	size_t offset;
+	size_t objects_per_slab;
+
+	struct kmem_slab *partial;
+	struct kmem_slab *empty;
+	size_t n_empty;
+	struct kmem_cache *next;
+	spin_t lock;
+
+	/* statistics */
+	uint32_t n_slabs;
+	uint32_t n_active;
+	uint32_t n_peak;
+	uint32_t n_allocs;
+	uint32_t n_frees;
+} kmem_cache_t;
+
+// XXX: caches are statically allocated, so they can be used before the heap is initialised
+#define KMEM_CACHE_INIT_SIZE(_name, _size, _ctor) { .name = (_name), .size = (_size), .ctor = (_ctor) }
+#define KMEM_CACHE_INIT(_name, _type, _ctor) KMEM_CACHE_INIT_SIZE(_name, sizeof(_type), _ctor)
+
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+void kmem_cache_shrink(kmem_cache_t *cache);
+void kmem_cache_reap(void);
+
+bool kmem_is_slab(const void *ptr);
+kmem_cache_t *kmem_ptr_cache(const void *ptr);
+void kmem_cache_dump(void);
+
+#endif
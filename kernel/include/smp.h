@@ -0,0 +1,71 @@
+#ifndef SMP_H
+#define SMP_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <gdt.h>
+
+#define SMP_MAX_CPUS 8
+// the application processors start in real mode here, see smp_trampoline.s, kmain keeps the page free
+#define SMP_TRAMPOLINE 0x8000
+
+struct task;
+
+/*
+per cpu state, %gs is a segment over the cpu_t of the cpu we're running on (see gdt_init_cpu)
+XXX: self has to stay the first member, this_cpu() reads it
+*/
+typedef struct cpu {
+	struct cpu *self;
+	unsigned int id; // index into cpus[], 0 is the bootstrap processor
+	uint8_t apic_id;
+	volatile bool online;
+
+	struct task *current; // XXX: use current_task, it can't be preempted halfway
+	struct task *idle_task;
+
+	/* scheduler state, see task.c */
+	unsigned int preempt_count;
+	unsigned int sched_lock_depth;
+	bool postponed_schedule;
+	bool enable_ints;
+	uint64_t idle_time; // ticks halted in the idle task
+
+	/* lazy fpu state, see fpu.c */
+	struct task *fpu_owner; // last task whose state was loaded into the fpu
+	bool fpu_used; // CR0.TS is clear, the running task used the fpu since it was switched to
+
+	volatile bool tlb_flush_pending; // has to flush the range of the current shootdown, see smp.c
+
+	tss_t *tss;
+} cpu_t;
+
+extern cpu_t cpus[SMP_MAX_CPUS];
+// cpus found in the MADT (or MP table), 1 if there are none
+extern unsigned int smp_num_cpus;
+
+static inline cpu_t *this_cpu(void) {
+	cpu_t *cpu;
+	__asm__ __volatile__ ("mov %%gs:0, %0" : "=r"(cpu));
+	return cpu;
+}
+
+/* a single gs relative load, a task can't migrate between finding its cpu and reading the field */
+static inline struct task *get_current_task(void) {
+	struct task *task;
+	__asm__ __volatile__ ("mov %%gs:%c1, %0" : "=r"(task) : "i"(offsetof(cpu_t, current)));
+	return task;
+}
+
+// bring up the application processors, call after vmm_init with interrupts enabled
+void smp_init(void);
+
+// makes cpu call schedule()
+void smp_send_reschedule(cpu_t *cpu);
+
+// flush n pages from virtaddr out of the tlb of every cpu, returns once all of them did
+void smp_tlb_shootdown(uintptr_t virtaddr, size_t n);
+
+#endif
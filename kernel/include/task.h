@@ -7,16 +7,28 @@
 #include <cpu.h>
 #include <vmm.h>
 #include <atomic.h>
+#include <rbtree.h>
+#include <smp.h>
 
 // kernel stack size in pages, including guard pages
 #define KSTACK_SIZE 8
 
+/* scheduling priorities, nice values map 1:1 to static priorities, 0 is the highest */
+#define TASK_NICE_MIN (-20)
+#define TASK_NICE_MAX 19
+#define TASK_PRIORITIES (TASK_NICE_MAX - TASK_NICE_MIN + 1)
+
 enum task_type {
 	TASK_TYPE_INVALID      = 0,
 	TASK_TYPE_KTASK        = 1,
 	TASK_TYPE_USER_PROCESS = 2,
 };
 
+enum task_policy {
+	TASK_POLICY_FAIR     = 0, // default, the cpu is shared by nice weight
+	TASK_POLICY_PRIORITY = 1, // runs before all fair tasks, for latency sensitive kernel tasks
+};
+
 enum task_state {
 	TASK_STATE_READY = 0,
 	TASK_STATE_BLOCKED = 1,
@@ -26,34 +38,91 @@ enum task_state {
 	TASK_STATE_BLOCKED_LOCK = 5,
 };
 
+struct task_queue;
+struct mutex;
+
 typedef struct task {
 	registers_t *registers;
-	uint32_t esp, ebp, eip;
+	uint32_t esp; // saved by switch_context, see task_set_entry for new tasks
+	void *fpu_state; // fxsave area, allocated on first use of the fpu
+	unsigned int fpu_cpu; // cpu the fpu state was last loaded on
 	/* XXX: kstack points to the top of the kerel stack */
 	uintptr_t kstack;
 	/* XXX: it's the clients responsibility to map the kernel stack into pdir */
 	page_directory_t *pdir;
 	enum task_type type;
 	void *obj;
+	/* intrusive links of the task_queue_t (run or blocked queue) the task is on */
 	struct task *next_task;
+	struct task *prev_task;
+	struct task_queue *queue;
 	enum task_state state;
+	/* timeout of a sleeping (or blocked with a timeout) task, links of the sorted wait queue */
 	uint64_t wait_target;
+	struct task *timer_next;
+	struct task *timer_prev;
+	bool timer_pending;
+	bool timed_out; // the last task_block_timeout ended because of the timeout
+	uint64_t futex_key; // physical address the task waits on, see futex.c
+
+	/* scheduling */
+	enum task_policy policy;
+	int nice;
+	unsigned int priority; // dynamic priority, nice plus/minus the interactivity bonus
+	unsigned int timeslice; // ticks left
+	unsigned int sleep_avg; // ticks, grows while blocked and shrinks while running
+	uint64_t sleep_start;
+	uint64_t exec_start; // when the task was last accounted
+	uint64_t sum_exec_runtime; // ticks spent running
+
+	/* cpu time accounting (ticks), see task_cputime */
+	uint64_t utime; // running in user mode
+	uint64_t stime; // running in the kernel
+	uint64_t wait_time; // ready, waiting for a cpu
+	uint32_t cputime_start; // when utime/stime were last charged, low bits of the clock
+	uint32_t ready_start; // when it was last put on a run queue
+	bool user_mode; // the running time is charged to utime
+	uint32_t nvcsw; // switches away because it blocked, slept or exited
+	uint32_t nivcsw; // switches away because it was preempted
+
+	/* priority inheritance, only changed with the scheduler locked */
+	struct mutex *blocked_on; // the mutex it's blocked on
+	struct mutex *pi_mutexes; // held mutexes with blocked tasks, linked through pi_next
+	unsigned int pi_rank; // best rank inherited from those, see task_rank
+
+	/* TASK_POLICY_FAIR */
+	uint64_t vruntime;
+	unsigned int weight;
+	rbtree_node_t run_node;
+
+	/* smp */
+	unsigned int cpu; // the cpu it runs (or last ran) on, its run queue is the one it's queued on
+	// still on its stack, another cpu may only switch to it once this is false
+	volatile bool on_cpu;
 } task_t;
 
-extern task_t *current_task;
+#define current_task get_current_task()
 
 /* task_t kernel stack helpers */
 void task_kstack_alloc(task_t *task);
 void task_kstack_free(task_t *task);
+void task_kstack_cache_fill(unsigned int n);
+// set up the stack of a new task to start at entry
+void task_set_entry(task_t *task, uintptr_t esp, uintptr_t entry);
 
-/* task_t blocking */
-typedef struct {
+/* task_t blocking, a task is on at most one queue at a time */
+typedef struct task_queue {
 	task_t *first;
 	task_t *last;
 } task_queue_t;
 
 void task_block(task_queue_t *queue, unsigned int reason);
+// block until woken up or timer_ticks reaches target, current_task->timed_out tells which one it was
+void task_block_timeout(task_queue_t *queue, unsigned int reason, uint64_t target);
 void task_unblock_next(task_queue_t *queue);
+/* XXX: task has to be blocked on a queue, call with the scheduler locked while looking for it */
+void task_unblock(task_t *task);
+void task_requeue(task_t *task, task_queue_t *queue);
 
 void task_sleep_until(uint64_t target);
 void task_sleep_miliseconds(uint64_t time);
@@ -68,37 +137,102 @@ typedef struct {
 void semaphore_acquire(semaphore_t *semaphore);
 void semaphore_release(semaphore_t *semaphore);
 
-/* mutex_t */
-typedef struct {
-	volatile int lock[1];
-	// XXX: locked_task might be NULL even when lock is 1
-	task_t *locked_task;
+/* mutex_t
+XXX: called where we can't block (irq handlers, spin locks held) mutex_lock spins,
+that only ends if the owner runs on another cpu
+contended locks spin for a bit while the owner is running on another cpu, then block,
+mutex_unlock hands the lock directly to the most urgent blocked task
+the owner lends the priority of its blocked tasks until it unlocks (priority inheritance),
+if it is blocked on another mutex itself that owner gets it too
+*/
+typedef struct mutex {
+	// the lock word, NULL if unlocked
+	task_t * volatile owner;
 	// XXX: only modify after scheduler_lock();
 	task_queue_t blocked_tasks;
+	struct mutex *pi_next; // owner->pi_mutexes list
+	bool pi_queued; // on owner->pi_mutexes
+
+	/* statistics */
+	uint32_t n_acquired;
+	uint32_t n_contended; // had to spin or block
 } mutex_t;
 
 void mutex_lock(mutex_t *mutex);
 void mutex_unlock(mutex_t *mutex);
 
+/* rwlock_t
+any number of readers or a single writer, blocked writers keep new readers out,
+unlocking hands the lock over to all blocked readers or the first blocked writer
+XXX: not recursive, a reader taking it again can deadlock with a blocked writer
+*/
+typedef struct {
+	unsigned int readers;
+	task_t *writer;
+	// XXX: only modify after scheduler_lock();
+	task_queue_t blocked_readers;
+	task_queue_t blocked_writers;
+
+	/* statistics */
+	uint32_t n_contended;
+} rwlock_t;
+
+void rwlock_read_lock(rwlock_t *rwlock);
+void rwlock_read_unlock(rwlock_t *rwlock);
+void rwlock_write_lock(rwlock_t *rwlock);
+void rwlock_write_unlock(rwlock_t *rwlock);
+
 /* yield, don't block but give up the cpu until scheduled again */
 void yield(void);
 
+/* priorities */
+// takes effect with the next time slice of task
+void task_set_nice(task_t *task, int nice);
+// XXX: only for the calling task
+void task_set_policy(task_t *task, enum task_policy policy);
+
 /* everything else */
-// XXX: don't use
-void _sleep(uint64_t delta);
+// false during early boot, in irq handlers and with spin locks held, see wait.h for waiting anyway
+bool task_can_block(void);
 
 void task_add(task_t *task);
 
+/*
+split the running time of the current task into utime and stime, handle_isr calls these
+around traps from user mode (with interrupts disabled)
+*/
+void task_trap_enter(void);
+void task_trap_exit(void);
+// charge the running time of the current task so far, before reading its times
+void task_cputime_update(void);
+
+/*
+preempt_disable keeps the calling task on this cpu (and interrupts off) until preempt_enable,
+scheduler_lock additionally takes the lock of all run queues
+both nest, a postponed schedule() happens once the outermost one is released
+*/
+void preempt_disable(void);
+void preempt_enable(void);
+// false in irq handlers and with preemption disabled
+bool preemptible(void);
+
 void scheduler_lock(void);
 void scheduler_unlock(void);
 // XXX: only call after scheduler_lock
 void schedule(void);
+// pit tick on the bootstrap processor
 void scheduler_wakeup(void);
+// local apic timer tick on the application processors
+void scheduler_tick(void);
 
 // XXX: only call after scheduler_lock
 __attribute__((noreturn)) void task_exit(void);
 
 /* kmain exit call */
 __attribute__((noreturn)) void tasking_enable(void);
+// the idle task of cpu, the bootstrap processor gets its own in tasking_enable
+void task_idle_init(cpu_t *cpu);
+// entered by the application processors once they're up
+__attribute__((noreturn)) void tasking_enable_ap(void);
 
 #endif
@@ -2,9 +2,12 @@
 #define VMM_H 1
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 
+#include <pmm.h>
+
 #define PAGE_SIZE 4096
 
 enum page_directory_flags {
@@ -27,24 +30,46 @@ enum page_flags {
 	PAGE_ACCESSED      = 0x20,
 	PAGE_DIRTY         = 0x40,
 	// pat bit         = 0x80,
+	// global          = 0x100,
+	/* bits 9-11 are available to us */
+	PAGE_SLAB          = 0x200, // kmem_cache slab page
 };
 
+/* only valid when the cpu supports it, map_page strips it otherwise */
+#define PAGE_NO_EXECUTE 0x8000000000000000ULL
+
 #define PAGE_VALUE_GUARD 0xFFFFF000
 #define PAGE_VALUE_RESERVED 0xFFFF100
 
-typedef uint32_t page_t;
+/*
+we use PAE paging: a 4 entry page directory pointer table (pdpt) points to
+4 page directories of 512 entries each, every page table maps 2 MiB
+we treat the 4 page directories as one array of 2048 entries
+*/
+#define PAGE_TABLE_ENTRIES 512
+#define PAGE_DIRECTORY_POINTERS 4
+#define PAGE_DIRECTORY_ENTRIES (PAGE_DIRECTORY_POINTERS * 512)
+#define PAGE_TABLE_SHIFT 21
+
+#define PAGE_TABLE_INDEX(v) (((v) >> 12) & (PAGE_TABLE_ENTRIES - 1))
+#define PAGE_DIRECTORY_INDEX(v) ((v) >> PAGE_TABLE_SHIFT)
+#define PAGE_FRAME(page) ((phys_addr_t)((page) & 0x000FFFFFFFFFF000ULL))
+
+typedef uint64_t page_t;
 typedef struct page_table {
-	page_t pages[1024] __attribute__((packed)) __attribute__((aligned(4096)));
+	page_t pages[PAGE_TABLE_ENTRIES] __attribute__((packed)) __attribute__((aligned(4096)));
 } page_table_t;
 static_assert(sizeof(page_table_t) == PAGE_SIZE);
 
 typedef struct page_directory {
-	// this is a pointer to the real page directory
-	uintptr_t *physical_tables;
+	// this is a pointer to the real page directories (PAGE_DIRECTORY_POINTERS continuous pages)
+	page_t *physical_tables;
 	// these are pointers to where ever the page_tables might be mapped in kernel space
 	// if you need to access the tables, use this
-	page_table_t *tables[1024];
-	// real address of physical_tables
+	page_table_t *tables[PAGE_DIRECTORY_ENTRIES];
+	// the page directory pointer table (mapped in kernel space)
+	uint64_t *pdpt;
+	// real address of the pdpt (this is what goes into cr3, always below 4GiB)
 	uintptr_t physical_address;
 	/* reference count, only used for userspace directories */
 	int32_t __refcount;
@@ -57,26 +82,37 @@ page_directory_t *page_directory_reference(page_directory_t *pdir);
 page_directory_t *page_directory_new(void);
 void page_directory_release(page_directory_t *pdir);
 
+/* the kernel directory is shared by all cpus, these flush the tlb of every one of them */
 void invalidate_page(uintptr_t virtaddr);
+void invalidate_pages(uintptr_t virtaddr, size_t n);
+// only the calling cpu, for addresses no other cpu can have cached
+void invalidate_pages_local(uintptr_t virtaddr, size_t n);
 page_table_t *get_table(uintptr_t virtaddr, page_directory_t *directory);
 page_table_t *get_table_alloc(uintptr_t virtaddr, page_directory_t *directory);
 page_t get_page(page_table_t *table, uintptr_t virtaddr);
 void set_page(page_table_t *table, uintptr_t virtaddr, page_t page);
 // XXX: behaviour undefined when (virtaddr & 0xFFF) != 0
-void map_page(page_table_t *table, uintptr_t virtaddr, uintptr_t physaddr, enum page_flags flags);
-void map_pages(uintptr_t start, uintptr_t end, enum page_flags flags, const char *name);
+void map_page(page_table_t *table, uintptr_t virtaddr, phys_addr_t physaddr, page_t flags);
+void map_pages(uintptr_t start, uintptr_t end, page_t flags, const char *name);
 
 // directly map a range into the kernel directory
 // XXX: don't use unless absolutely needed
 void map_direct_kernel(uintptr_t v);
 
+// map physical memory that isn't managed by the pmm (firmware tables, mmio) into free kernel vspace
+void *map_physical(phys_addr_t phys, size_t size, page_t flags);
+void unmap_physical(void *p, size_t size);
+
 uintptr_t find_vspace(page_directory_t *dir, size_t n); // size in blocks
 uintptr_t vmm_find_dma_region(size_t size);
 void *dma_malloc(size_t m);
+void dma_free(void *p, size_t m);
 
 /* debug helpers */
 void dump_directory(page_directory_t *directory);
 
+extern bool vmm_nx_enabled;
+
 void vmm_init(void);
 void vmm_enable(void);
 
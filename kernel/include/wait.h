@@ -0,0 +1,68 @@
+#ifndef WAIT_H
+#define WAIT_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <pit.h>
+#include <task.h>
+
+/*
+wait queues
+wait_event checks cond with the scheduler locked, whoever makes cond true and calls wake_up
+afterwards can't slip in between the check and the task blocking
+XXX: cond runs with interrupts disabled, keep it short and never block in it
+where we can't block (early boot, irq handlers, spin locks held) wait_event polls cond instead,
+halting between checks if interrupts are enabled and busy-waiting a tick on the pit otherwise
+*/
+typedef struct {
+	task_queue_t waiters;
+} wait_queue_t;
+
+// timeouts are in ticks (ms)
+#define WAIT_FOREVER 0
+
+/* internal, see wait_event_timeout */
+bool __wait_begin(void);
+bool __wait_sleep(wait_queue_t *wq, bool can_block, uint64_t target, uint64_t *now);
+uint64_t __wait_target(uint64_t now, uint64_t timeout);
+
+// true once cond holds, false if timeout ran out first
+#define wait_event_timeout(_wq, _cond, _timeout) ({ \
+	uint64_t __now = timer_now(); \
+	uint64_t __target = __wait_target(__now, _timeout); \
+	bool __done; \
+	while (true) { \
+		bool __can_block = __wait_begin(); \
+		__done = (_cond); \
+		if (__done) { \
+			scheduler_unlock(); \
+			break; \
+		} \
+		if (!__wait_sleep((_wq), __can_block, __target, &__now)) { \
+			break; \
+		} \
+	} \
+	__done; \
+})
+
+#define wait_event(_wq, _cond) ((void)wait_event_timeout((_wq), (_cond), WAIT_FOREVER))
+
+void wake_up(wait_queue_t *wq);
+void wake_up_one(wait_queue_t *wq);
+
+// sleep for ms (or poll the timer if we can't block)
+void delay_ms(uint64_t ms);
+
+/* condition variables, the mutex is released while waiting and held again on return */
+typedef struct {
+	task_queue_t waiters;
+} cond_t;
+
+void cond_wait(cond_t *cond, mutex_t *mutex);
+// false if timeout ran out before a signal
+bool cond_wait_timeout(cond_t *cond, mutex_t *mutex, uint64_t timeout);
+void cond_signal(cond_t *cond);
+void cond_broadcast(cond_t *cond);
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+workqueues, deferred work run by a shared pool of worker ktasks
+work can be queued from anywhere, including irq handlers, the function runs later in a
+worker where it may allocate, take mutexes and block
+a workqueue limits how many of its items run at once, max_active 1 runs them one after another
+in the order they were queued
+XXX: a work function that blocks for long keeps a worker from all other queues
+*/
+
+struct work;
+struct workqueue;
+
+typedef void (work_func)(struct work *work);
+
+enum work_state {
+	WORK_IDLE    = 0, // not queued, may be running
+	WORK_DELAYED = 1, // waiting for its timeout, see queue_delayed_work
+	WORK_QUEUED  = 2, // waiting for a free slot of its workqueue
+	WORK_READY   = 3, // waiting for a worker
+};
+
+typedef struct work {
+	work_func *func;
+	struct workqueue *wq;
+	struct work *next;
+	enum work_state state;
+	uint64_t target; // delayed work, when it's due (ticks)
+} work_t;
+
+// the struct containing work, for work functions
+#define work_entry(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define WORK_INIT(_func) { .func = (_func) }
+
+typedef struct workqueue {
+	const char *name;
+	unsigned int max_active;
+	unsigned int active; // ready or running items
+	// waiting for a slot
+	work_t *first;
+	work_t *last;
+
+	/* statistics */
+	uint32_t n_queued;
+	uint32_t n_peak_backlog;
+} workqueue_t;
+
+#define WORKQUEUE_INIT(_name, _max_active) { .name = (_name), .max_active = (_max_active) }
+
+// for anything that doesn't need its own limit
+extern workqueue_t system_workqueue;
+
+void work_init(work_t *work, work_func *func);
+
+// false if work is already queued (or delayed), it then only runs once
+bool queue_work(workqueue_t *wq, work_t *work);
+// queue work once delay (ms) passed
+bool queue_delayed_work(workqueue_t *wq, work_t *work, uint64_t delay);
+// take work off its queue before it runs, false if it wasn't queued, doesn't wait for a running work function
+bool cancel_work(work_t *work);
+
+// start the workers, before anything queues work
+void workqueue_init(void);
+
+#endif
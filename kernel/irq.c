@@ -1,31 +1,50 @@
 #include <assert.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #include <console.h>
 #include <irq.h>
 #include <cpu.h>
 #include <isr.h>
+#include <kernel_task.h>
 #include <pic.h>
+#include <task.h>
+#include <wait.h>
 
 // TODO: handle spurious IRQs correctly
 
+// irq ktasks run before the [net] ktask and everything else
+#define IRQ_THREAD_NICE (-15)
+
 // 16 IRQs 8 irq handlers depth
 typedef struct {
 	irq_handler_t handler;
+	irq_handler_t thread_handler; // NULL if not threaded
 	void *extra;
+	volatile bool thread_pending;
 } irq_entry_t;
 
 static irq_entry_t irq_handlers[16][8];
 
-// FIXME: rename to irq_add_handler ?
-void irq_set_handler(unsigned int irq, irq_handler_t irq_handler, void *extra) {
-//	printf("irq_set_handler(irq: %u, irq_handler: 0x%x, extra: 0x%x)\n", irq, (uintptr_t)irq_handler, (uintptr_t)extra);
+/* threaded handlers of an irq line, they all run in the same ktask */
+typedef struct {
+	wait_queue_t wait;
+	volatile bool pending; // the line stays masked until the ktask ran
+	bool threaded;
+} irq_line_t;
+
+static irq_line_t irq_lines[16];
+static bool irq_threads_started = false;
+
+static void irq_add_handler(unsigned int irq, irq_handler_t irq_handler, irq_handler_t thread_handler, void *extra) {
+	assert(irq < 16);
 	assert(irq_handler != NULL);
-	// assert(extra != NULL);
 	for (unsigned int i = 0; i < 8; i++) {
 		if (irq_handlers[irq][i].handler == NULL) {
-			irq_handlers[irq][i].handler = irq_handler;
+			// XXX: the irq may already fire, set handler last
+			irq_handlers[irq][i].thread_handler = thread_handler;
 			irq_handlers[irq][i].extra = extra;
+			irq_handlers[irq][i].handler = irq_handler;
 			return;
 		}
 	}
@@ -33,11 +52,92 @@ void irq_set_handler(unsigned int irq, irq_handler_t irq_handler, void *extra) {
 	assert(0);
 }
 
+// FIXME: rename to irq_add_handler ?
+void irq_set_handler(unsigned int irq, irq_handler_t irq_handler, void *extra) {
+//	printf("irq_set_handler(irq: %u, irq_handler: 0x%x, extra: 0x%x)\n", irq, (uintptr_t)irq_handler, (uintptr_t)extra);
+	irq_add_handler(irq, irq_handler, NULL, extra);
+}
+
+__attribute__((noreturn)) static unsigned int ktask_irq(const char *name, void *extra) {
+	(void)name;
+	unsigned int irq = (unsigned int)(uintptr_t)extra;
+	irq_line_t *line = &irq_lines[irq];
+
+	task_set_policy(current_task, TASK_POLICY_PRIORITY);
+	task_set_nice(current_task, IRQ_THREAD_NICE);
+
+	while (1) {
+		wait_event(&line->wait, line->pending);
+		// XXX: nothing sets it again before the line is unmasked
+		line->pending = false;
+
+		irq_entry_t *entries = irq_handlers[irq];
+		for (unsigned int i = 0; (i < 8) && (entries[i].handler != NULL); i++) {
+			if (entries[i].thread_pending) {
+				entries[i].thread_pending = false;
+				entries[i].thread_handler(irq, entries[i].extra);
+			}
+		}
+		irq_unmask(irq);
+	}
+}
+
+static void irq_thread_spawn(unsigned int irq) {
+	char name[] = "[irq00]";
+	name[4] = (char)('0' + irq / 10);
+	name[5] = (char)('0' + irq % 10);
+	ktask_spawn(ktask_irq, name, (void *)(uintptr_t)irq);
+}
+
+void irq_set_threaded_handler(unsigned int irq, irq_handler_t irq_handler, irq_handler_t thread_handler, void *extra) {
+	assert(thread_handler != NULL);
+	irq_add_handler(irq, irq_handler, thread_handler, extra);
+
+	if (!irq_lines[irq].threaded) {
+		irq_lines[irq].threaded = true;
+		if (irq_threads_started) {
+			irq_thread_spawn(irq);
+		}
+	}
+}
+
+void irq_threads_init(void) {
+	irq_threads_started = true;
+	for (unsigned int irq = 0; irq < 16; irq++) {
+		if (irq_lines[irq].threaded) {
+			irq_thread_spawn(irq);
+		}
+	}
+}
+
 void irq_ack(unsigned int irq) {
 	// FIXME: does this handle spurious IRQ7's correctly ?
 	pic_send_eoi(irq);
 }
 
+void irq_mask(unsigned int irq) {
+	pic_mask(irq);
+}
+
+void irq_unmask(unsigned int irq) {
+	pic_unmask(irq);
+}
+
+/* the hard handler of entry asked for its thread, mask the line until that ran */
+static void irq_wake_thread(unsigned int irq, irq_entry_t *entry) {
+	assert(entry->thread_handler != NULL);
+	if (!irq_threads_started) {
+		// too early for ktasks
+		entry->thread_handler(irq, entry->extra);
+		return;
+	}
+
+	irq_mask(irq);
+	entry->thread_pending = true;
+	irq_lines[irq].pending = true;
+	wake_up(&irq_lines[irq].wait);
+}
+
 static void irq_handler(registers_t *regs) {
 	assert((regs->isr_num >= isr_from_irq(0)) && (regs->isr_num <= isr_from_irq(16)));
 	unsigned int irq = regs->err_code;
@@ -47,7 +147,10 @@ static void irq_handler(registers_t *regs) {
 		if (entries[i].handler != NULL) {
 			unsigned int status = entries[i].handler(irq, entries[i].extra);
 			// FIXME: irq_ack after it has been handled instead of every handler ?
-			if (status != IRQ_IGNORED) {
+			if (status == IRQ_WAKE_THREAD) {
+				irq_wake_thread(irq, &entries[i]);
+				return;
+			} else if (status != IRQ_IGNORED) {
 				// handled
 				return;
 			}
@@ -6,6 +6,7 @@
 #include <isr.h>
 #include <isrs.h>
 #include <pic.h>
+#include <task.h>
 
 static isr_handler isr_handlers[256];
 
@@ -71,6 +72,12 @@ void isr_init(void) {
 
 	// syscall
 	idt_set_gate(0x80,_isr128,0x08,0xEE);
+
+	// local apic timer, ipis and spurious interrupts
+	idt_set_gate(240, _isr240, 0x08, 0x8E);
+	idt_set_gate(241, _isr241, 0x08, 0x8E);
+	idt_set_gate(242, _isr242, 0x08, 0x8E);
+	idt_set_gate(255, _isr255, 0x08, 0x8E);
 }
 
 static const char *exception_name[] = {
@@ -110,6 +117,12 @@ static const char *exception_name[] = {
 
 void handle_isr(registers_t *regs) {
 	unsigned int isr_num = regs->isr_num;
+	// everything from here on is kernel time of the interrupted task
+	bool from_user = ((regs->cs & 0x3) == 0x3);
+	if (from_user) {
+		task_trap_enter();
+	}
+
 	if (isr_handlers[isr_num]) {
 		isr_handlers[isr_num](regs);
 	} else if (isr_num < 32) {
@@ -137,4 +150,10 @@ void handle_isr(registers_t *regs) {
 		}
 		assert(0 && "unhandled interrupt!");
 	}
+
+	if (from_user) {
+		// the handler may have enabled interrupts, iret restores them
+		interrupts_disable();
+		task_trap_exit();
+	}
 }
@@ -5,16 +5,21 @@
 #include <pmm.h>
 #include <vmm.h>
 #include <heap.h>
+#include <slab.h>
 #include <console.h>
+#include <cpu.h>
+
+static kmem_cache_t ktask_cache = KMEM_CACHE_INIT("ktask_t", ktask_t, NULL);
 
 __attribute__((noreturn)) static void ktask_enter(ktask_t *ktask) {
+	// XXX: new tasks are started with interrupts disabled
+	interrupts_enable();
 	__ktask_exit(ktask->func(ktask->name, ktask->extra));
 }
 
-void ktask_spawn(ktask_func *func, const char *name, void *extra) {
-	printf("%s(func: 0x%x, name: '%s');\n", __func__, (uintptr_t)func, name);
+ktask_t *ktask_create(ktask_func *func, const char *name, void *extra) {
 
-	ktask_t *ktask = kcalloc(1, sizeof(ktask_t));
+	ktask_t *ktask = kmem_cache_alloc(&ktask_cache);
 	assert(ktask != NULL);
 	ktask->task.type = TASK_TYPE_KTASK;
 	ktask->task.pdir = kernel_directory;
@@ -34,29 +39,36 @@ void ktask_spawn(ktask_func *func, const char *name, void *extra) {
 	esp -= sizeof(uintptr_t);
 	*((uintptr_t *)esp) = (uintptr_t)0;
 
-	ktask->task.esp = (uint32_t)esp;
-	ktask->task.eip = (uint32_t)&ktask_enter;
-	ktask->task.ebp = 0;
+	task_set_entry(&ktask->task, esp, (uintptr_t)&ktask_enter);
+	return ktask;
+}
 
+void ktask_spawn(ktask_func *func, const char *name, void *extra) {
+	printf("%s(func: 0x%x, name: '%s');\n", __func__, (uintptr_t)func, name);
+
+	ktask_t *ktask = ktask_create(func, name, extra);
 	printf("%s: adding ktask %p (name: %p '%s')\n", __func__, ktask, ktask->name, ktask->name);
 	task_add(&ktask->task);
 }
 
-// TODO: implement
+// XXX: called by the scheduler once the ktask terminated and isn't running on its stack anymore
 void ktask_destroy(ktask_t *ktask) {
-	(void)ktask;
-	printf("%s: TODO: implement\n", __func__);
-	assert(0);
+	assert(ktask != NULL);
+	assert(ktask->task.state == TASK_STATE_TERMINATED);
+
+	task_kstack_free(&ktask->task);
+	kfree((char *)ktask->name);
+	ktask->name = NULL;
+	kmem_cache_free(&ktask_cache, ktask);
 }
 
 // FIXME: name gets overwritten for some reason
 __attribute__((noreturn)) void __ktask_exit(unsigned int status) {
-	scheduler_lock();
 	ktask_t *ktask = current_task->obj;
 	assert(ktask != NULL);
 	printf("%s(status: %u, name: %p '%s')\n", __func__, status, ktask->name, ktask->name);
+	scheduler_lock();
 
+	// the scheduler destroys the ktask after switching away
 	task_exit();
-	assert(0);
-	ktask_destroy(ktask);
 }
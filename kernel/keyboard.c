@@ -64,25 +64,33 @@ static ringbuffer_t keyboard_ringbuffer;
 static unsigned char keybuffer[KEYBUFFER_LENGTH];
 
 static unsigned int irq1_handler(unsigned int irq, void *extra) {
-	assert(extra != NULL);
+	(void)extra;
 	uint8_t status = inb(0x64);
 	if (status & 0x01) {
+		// the scancodes are read by irq1_thread, irq 1 stays masked until then
+		irq_ack(irq);
+		return IRQ_WAKE_THREAD;
+	}
+	return IRQ_IGNORED;
+}
+
+static unsigned int irq1_thread(unsigned int irq, void *extra) {
+	(void)irq;
+	assert(extra != NULL);
+	while (inb(0x64) & 0x01) {
 		char keycode = inb(0x60);
 		if (keycode < 0) {
-			irq_ack(irq);
-			return IRQ_HANDLED;
+			continue;
 		}
 		unsigned char c = keyboard_map[(unsigned int)keycode];
 		ringbuffer_write_byte((ringbuffer_t *)extra, c);
-		irq_ack(irq);
-		return IRQ_HANDLED;
 	}
-	return IRQ_IGNORED;
+	return IRQ_HANDLED;
 }
 
 void keyboard_init(void) {
 	ringbuffer_init(&keyboard_ringbuffer, keybuffer, KEYBUFFER_LENGTH);
-	irq_set_handler(1, irq1_handler, &keyboard_ringbuffer);
+	irq_set_threaded_handler(1, irq1_handler, irq1_thread, &keyboard_ringbuffer);
 }
 
 unsigned char keyboard_getc(void) {
@@ -1,3 +1,8 @@
+// run the microbenchmarks after boot
+//#define BENCHMARK
+// track kmalloc/kfree per callsite from boot on (see /heapstat)
+//#define HEAP_PROFILE
+
 /* headers supplied by the c compiler */
 #include <assert.h>
 #include <stddef.h>
@@ -8,12 +13,15 @@
 #include <cpu.h>
 
 /* all other headers */
+#include <acpi.h>
 #include <console.h>
 #include <dev_null.h>
 #include <framebuffer.h>
+#include <fpu.h>
 #include <fs.h>
 #include <gdt.h>
 #include <heap.h>
+#include <heap_profile.h>
 #include <idt.h>
 #include <isr.h>
 #include <irq.h>
@@ -27,12 +35,16 @@
 #include <pmm.h>
 #include <process.h>
 #include <ramdisk.h>
+#include <schedstat.h>
+#include <slab.h>
+#include <smp.h>
 #include <string.h>
 #include <syscall.h>
 #include <tar.h>
 #include <tmpfs.h>
 #include <tty.h>
 #include <vmm.h>
+#include <workqueue.h>
 
 static mutex_t test_mutex;
 static unsigned int test = 0;
@@ -42,7 +54,7 @@ static unsigned int ktask_test1(const char * const name, void *extra) {
 	printf("%s: acquireing mutex %p\n", __func__, &test_mutex);
 	mutex_lock(&test_mutex);
 	printf("%s: sleeping for 1s\n", __func__);
-	task_sleep_until(timer_ticks + 1 * 1000);
+	task_sleep_until(timer_now() + 1 * 1000);
 	printf("%s: unlocking\n", __func__);
 	mutex_unlock(&test_mutex);
 	return 0;
@@ -51,8 +63,8 @@ static unsigned int ktask_test1(const char * const name, void *extra) {
 static unsigned int ktask_test2(const char * const name, void *extra) {
 	printf("%s: name: '%s', extra: %p\n", __func__, name, extra);
 	printf("%s: sleep(500ms)\n", __func__);
-	printf("%s: current time %u, sleeping until %u\n", __func__, (unsigned int) timer_ticks, (unsigned int) (timer_ticks + 200));
-	task_sleep_until(timer_ticks + 200);
+	printf("%s: current time %u, sleeping until %u\n", __func__, (unsigned int) timer_now(), (unsigned int) (timer_now() + 200));
+	task_sleep_until(timer_now() + 200);
 	task_sleep_miliseconds(200);
 	printf("%s: lock mutex\n", __func__);
 	mutex_lock(&test_mutex);
@@ -78,6 +90,86 @@ static unsigned int ktask_test(const char * const name, void *extra) {
 	return r;
 }
 
+#ifdef BENCHMARK
+#define KMALLOC_BENCH_ROUNDS 100000
+#define KMALLOC_BENCH_LIVE 256
+static void *kmalloc_bench_ptrs[KMALLOC_BENCH_LIVE];
+
+static unsigned int ktask_kmalloc_bench(const char * const name, void *extra) {
+	(void)name;
+	(void)extra;
+	static const size_t sizes[] = { 16, 48, 200, 1000, 3000 };
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		const size_t size = sizes[s];
+
+		/* allocate and immediately free */
+		uint64_t start = timer_now();
+		for (unsigned int r = 0; r < KMALLOC_BENCH_ROUNDS; r++) {
+			void *p = kmalloc(size);
+			assert(p != NULL);
+			kfree(p);
+		}
+		unsigned int pairs_ms = (unsigned int)(timer_now() - start);
+
+		/* keep a fragmented set of live allocations around and replace them out of order */
+		start = timer_now();
+		for (unsigned int r = 0; r < KMALLOC_BENCH_ROUNDS; r++) {
+			unsigned int i = (r * 7) % KMALLOC_BENCH_LIVE;
+			if (kmalloc_bench_ptrs[i] != NULL) {
+				kfree(kmalloc_bench_ptrs[i]);
+			}
+			kmalloc_bench_ptrs[i] = kmalloc(size + (r % 5) * 8);
+			assert(kmalloc_bench_ptrs[i] != NULL);
+		}
+		for (unsigned int i = 0; i < KMALLOC_BENCH_LIVE; i++) {
+			if (kmalloc_bench_ptrs[i] != NULL) {
+				kfree(kmalloc_bench_ptrs[i]);
+				kmalloc_bench_ptrs[i] = NULL;
+			}
+		}
+		unsigned int churn_ms = (unsigned int)(timer_now() - start);
+
+		printf("%s: size %u: %u kmalloc/kfree pairs in %u ms, %u fragmented in %u ms\n",
+			__func__, (uintptr_t)size, KMALLOC_BENCH_ROUNDS, pairs_ms, KMALLOC_BENCH_ROUNDS, churn_ms);
+	}
+	kmem_cache_dump();
+	return 0;
+}
+
+/* two tasks handing the cpu back and forth, each round trip is two blocks, two wake ups and two switches */
+#define SWITCH_BENCH_ROUNDS 100000
+static semaphore_t switch_bench_ping;
+static semaphore_t switch_bench_pong;
+
+static unsigned int ktask_switch_bench_pong(const char * const name, void *extra) {
+	(void)name;
+	(void)extra;
+	for (unsigned int r = 0; r < SWITCH_BENCH_ROUNDS; r++) {
+		semaphore_acquire(&switch_bench_ping);
+		semaphore_release(&switch_bench_pong);
+	}
+	return 0;
+}
+
+static unsigned int ktask_switch_bench(const char * const name, void *extra) {
+	(void)name;
+	(void)extra;
+	ktask_spawn(ktask_switch_bench_pong, "switch_bench_pong", NULL);
+
+	uint64_t start = timer_now();
+	for (unsigned int r = 0; r < SWITCH_BENCH_ROUNDS; r++) {
+		semaphore_release(&switch_bench_ping);
+		semaphore_acquire(&switch_bench_pong);
+	}
+	unsigned int ms = (unsigned int)(timer_now() - start);
+
+	// XXX: the two tasks may end up on different cpus, then this includes the reschedule ipis
+	printf("%s: %u round trips in %u ms\n", __func__, SWITCH_BENCH_ROUNDS, ms);
+	return 0;
+}
+#endif
+
 static void kmain_ls(const char *path) {
 	assert(path != NULL);
 	printf("> %s '%s'\n", __func__, path);
@@ -96,7 +188,7 @@ static void kmain_ls(const char *path) {
 		}
 		assert(v->ino == i);
 		printf("%u: %s\n", v->ino, v->name);
-		kfree(v);
+		fs_dirent_free(v);
 		i++;
 	} while(true);
 	printf("\n");
@@ -107,13 +199,16 @@ static void kmain_ls(const char *path) {
 /* main kernel entry point */
 void __attribute__((used)) kmain(struct multiboot_info *mbi, uint32_t eax, uintptr_t esp) {
 	(void)esp;
-	uintptr_t mem_avail = 0;
+	uint64_t mem_avail = 0;
 	uintptr_t real_end = (uintptr_t)&_end;
 	uintptr_t fb_start = 0;
 	uintptr_t fb_size = 0;
 
 	assert(eax == MULTIBOOT_BOOTLOADER_MAGIC);
 
+	// XXX: first, locks (and therefore printf) use the per cpu data
+	gdt_init();
+
 	console_init();
 	printf("early console init!\n");
 
@@ -165,26 +260,28 @@ void __attribute__((used)) kmain(struct multiboot_info *mbi, uint32_t eax, uintp
 
 	multiboot_dump(mbi);
 
-	gdt_init();
 	printf("[%u] [OK] gdt_init\n", (unsigned int)timer_ticks);
 
 	idt_install();
-	printf("[%u] [OK] idt_install\n", (unsigned int)timer_ticks);
+	printf("[%u] [OK] idt_install\n", (unsigned int)timer_now());
 
 	isr_init();
-	printf("[%u] [OK] isr_init\n", (unsigned int)timer_ticks);
+	printf("[%u] [OK] isr_init\n", (unsigned int)timer_now());
+
+	fpu_init_cpu();
+	printf("[%u] [OK] fpu_init_cpu\n", (unsigned int)timer_now());
 
 	pic_init();
-	printf("[%u] [OK] pic_init\n", (unsigned int)timer_ticks);
+	printf("[%u] [OK] pic_init\n", (unsigned int)timer_now());
 
 	irq_init();
-	printf("[%u] [OK] irq_init\n", (unsigned int)timer_ticks);
+	printf("[%u] [OK] irq_init\n", (unsigned int)timer_now());
 
 	pit_init();
-	printf("[%u] [OK] pit_init\n", (unsigned int)timer_ticks);
+	printf("[%u] [OK] pit_init\n", (unsigned int)timer_now());
 
 	if (mbi->flags & MULTIBOOT_INFO_MODS) {
-		printf("[%u] %u modules\n", (unsigned int)timer_ticks, mbi->mods_count);
+		printf("[%u] %u modules\n", (unsigned int)timer_now(), mbi->mods_count);
 		if (mbi->mods_count > 0) {
 			// we have modules
 			multiboot_module_t *mods = (multiboot_module_t *)mbi->mods_addr;
@@ -218,7 +315,7 @@ void __attribute__((used)) kmain(struct multiboot_info *mbi, uint32_t eax, uintp
 	}
 
 	if (mbi->flags & MULTIBOOT_INFO_CMDLINE) {
-		printf("[%u] cmdline: '%s'\n", (unsigned int)timer_ticks, (char *)mbi->cmdline);
+		printf("[%u] cmdline: '%s'\n", (unsigned int)timer_now(), (char *)mbi->cmdline);
 	}
 
 	real_end = (real_end+0xFFF) & 0xFFFFF000;
@@ -227,19 +324,20 @@ void __attribute__((used)) kmain(struct multiboot_info *mbi, uint32_t eax, uintp
 	printf("kernel mem really ends at: 0x%x\n", real_end);
 
 	if (mbi->flags & MULTIBOOT_INFO_MEM_MAP) {
-		uintptr_t mem_avail_old = mem_avail;
+		uint64_t mem_avail_old = mem_avail;
 		for (multiboot_memory_map_t *mmap = (multiboot_memory_map_t *)mbi->mmap_addr;
 			((uint32_t)mmap) < (mbi->mmap_addr + mbi->mmap_length);
 			mmap = (multiboot_memory_map_t *)((uint32_t)mmap + mmap->size + sizeof(mmap->size))) {
 			if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE) {
-				uintptr_t mmap_end = mmap->addr + mmap->len;
+				uint64_t mmap_end = mmap->addr + mmap->len;
 				if (mmap_end > mem_avail) {
-					mem_avail = mmap->addr + mmap->len;
+					mem_avail = mmap_end;
 				}
 			}
 		}
 		if (mem_avail != mem_avail_old) {
-			printf("mem_avail_old: 0x%x; mem_avail: 0x%x\n", mem_avail_old, mem_avail);
+			printf("mem_avail_old: 0x%x; mem_avail: 0x%x%8x\n", (uint32_t)mem_avail_old,
+				(uint32_t)(mem_avail >> 32), (uint32_t)mem_avail);
 		}
 	} else if (mbi->flags & MULTIBOOT_INFO_MEMORY) {
 		printf("Memory map not available, falling back to mem_upper\n");
@@ -250,8 +348,13 @@ void __attribute__((used)) kmain(struct multiboot_info *mbi, uint32_t eax, uintp
 	if (mem_avail == 0) {
 		mem_avail = 0xFFFFFFFF;
 	}
+	if (mem_avail > PMM_MAX_MEMORY) {
+		printf("only using the first 0x%x%8x bytes of memory\n",
+			(uint32_t)(PMM_MAX_MEMORY >> 32), (uint32_t)PMM_MAX_MEMORY);
+		mem_avail = PMM_MAX_MEMORY;
+	}
 	pmm_init((void *)real_end, mem_avail);
-	printf("[%u] [OK] pmm_init\n", (unsigned int)timer_ticks);
+	printf("[%u] [OK] pmm_init\n", (unsigned int)timer_now());
 
 	if (mbi->flags & MULTIBOOT_INFO_MEM_MAP) {
 		for (multiboot_memory_map_t *mmap = (multiboot_memory_map_t *)mbi->mmap_addr;
@@ -265,13 +368,16 @@ void __attribute__((used)) kmain(struct multiboot_info *mbi, uint32_t eax, uintp
 				);
 			if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE) {
 				if ((uint32_t)(mmap->addr >> 32) != 0) {
-					printf("available but out of 32bit range!\n");
-					continue;
+					// only usable through PAE mappings (pmm_alloc_blocks_high)
+					printf("available (above 4GiB)\n");
 				} else {
 					printf("available\n");
 				}
-				for (uintptr_t i = 0; i < mmap->len; i += BLOCK_SIZE) {
-					pmm_unset_block((mmap->addr + i) / BLOCK_SIZE);
+				for (uint64_t i = 0; i < mmap->len; i += BLOCK_SIZE) {
+					if (((mmap->addr + i) >> BLOCK_SHIFT) >= block_map_size) {
+						break;
+					}
+					pmm_unset_block((uint32_t)((mmap->addr + i) >> BLOCK_SHIFT));
 				}
 			} else if (mmap->type == MULTIBOOT_MEMORY_RESERVED) {
 				printf("reserved\n");
@@ -293,7 +399,7 @@ void __attribute__((used)) kmain(struct multiboot_info *mbi, uint32_t eax, uintp
 		halt();
 	}
 
-	printf("free %u kb\n", pmm_count_free_blocks() * BLOCK_SIZE / 1024);
+	printf("free %u kb\n", pmm_count_free_blocks() * (BLOCK_SIZE / 1024));
 
 	// mark the kernel (and modules) as used
 	assert(((uintptr_t)&_start & 0xFFF) == 0);
@@ -301,19 +407,21 @@ void __attribute__((used)) kmain(struct multiboot_info *mbi, uint32_t eax, uintp
 		pmm_set_block((i) / BLOCK_SIZE);
 	}
 
-	printf("free %u kb\n", pmm_count_free_blocks() * BLOCK_SIZE / 1024);
+	printf("free %u kb\n", pmm_count_free_blocks() * (BLOCK_SIZE / 1024));
 
 	printf("pmm block_map: 0x%x - 0x%x\n", (uintptr_t)block_map,
-		((uintptr_t)block_map + block_map_size / 32));
+		((uintptr_t)block_map + pmm_map_size()));
 
-	for (uintptr_t i = 0; i < (block_map_size / 32); i += BLOCK_SIZE) {
+	for (uintptr_t i = 0; i < pmm_map_size(); i += BLOCK_SIZE) {
 		pmm_set_block(((uintptr_t)block_map + i) / BLOCK_SIZE);
 	}
 
 	// special purpose
 	pmm_set_block(0);
+	// application processor trampoline
+	pmm_set_block(SMP_TRAMPOLINE / BLOCK_SIZE);
 
-	printf("free %u kb\n", pmm_count_free_blocks() * BLOCK_SIZE / 1024);
+	printf("free %u kb\n", pmm_count_free_blocks() * (BLOCK_SIZE / 1024));
 
 	// TODO: copy everything of interest out of the multiboot info to a known, safe location
 	// TODO: remember to free information once its no longer needed
@@ -381,11 +489,14 @@ void __attribute__((used)) kmain(struct multiboot_info *mbi, uint32_t eax, uintp
 		// TODO: implement (if needed)
 	}
 
-	printf("free %u kb\n", pmm_count_free_blocks() * BLOCK_SIZE / 1024);
+	printf("free %u kb\n", pmm_count_free_blocks() * (BLOCK_SIZE / 1024));
 	// you can use pmm_alloc_* atfer here
 	vmm_init();
-	printf("[%u] [OK] vmm_init\n", (unsigned int)timer_ticks);
-	printf("free %u kb\n", pmm_count_free_blocks() * BLOCK_SIZE / 1024);
+	printf("[%u] [OK] vmm_init\n", (unsigned int)timer_now());
+	printf("free %u kb\n", pmm_count_free_blocks() * (BLOCK_SIZE / 1024));
+
+	// the trampoline has to be identity mapped when the application processors enable paging
+	map_direct_kernel(SMP_TRAMPOLINE);
 
 	// directly map the multiboot structure
 	map_direct_kernel(((uintptr_t)mbi) & ~0xFFF);
@@ -466,7 +577,7 @@ void __attribute__((used)) kmain(struct multiboot_info *mbi, uint32_t eax, uintp
 		PAGE_PRESENT,                   "mod_info  ");
 
 	/* directly map the pmm block map */
-	map_pages((uintptr_t)block_map, (uintptr_t)block_map + (block_map_size / 32),
+	map_pages((uintptr_t)block_map, (uintptr_t)block_map + pmm_map_size(),
 	    PAGE_PRESENT | PAGE_READWRITE,  "pmm_map   ");
 
 	/* map the framebuffer / textbuffer */
@@ -478,28 +589,37 @@ void __attribute__((used)) kmain(struct multiboot_info *mbi, uint32_t eax, uintp
 
 	/* enable paging */
 	vmm_enable();
-	printf("[%u] [OK] vmm_enable\n", (unsigned int)timer_ticks);
+	printf("[%u] [OK] vmm_enable\n", (unsigned int)timer_now());
 
-	printf("free %u kb\n", pmm_count_free_blocks() * BLOCK_SIZE / 1024);
+	printf("free %u kb\n", pmm_count_free_blocks() * (BLOCK_SIZE / 1024));
 
 	/* initialise the kernel heap */
 	liballoc_init();
-	printf("[%u] [OK] liballoc_init\n", (unsigned int)timer_ticks);
+	printf("[%u] [OK] liballoc_init\n", (unsigned int)timer_now());
+#ifdef HEAP_PROFILE
+	heap_profile_enable(true);
+#endif
 
 	framebuffer_enable_double_buffer();
-	printf("[%u] [OK] tripple framebuffer enabled\n", (unsigned int)timer_ticks);
+	printf("[%u] [OK] tripple framebuffer enabled\n", (unsigned int)timer_now());
 
 	keyboard_init();
-	printf("[%u] [OK] keyboard_init\n", (unsigned int)timer_ticks);
+	printf("[%u] [OK] keyboard_init\n", (unsigned int)timer_now());
 
 	/* enable interrupts */
 	interrupts_enable();
-	printf("[%u] [OK] enable interrupts\n", (unsigned int)timer_ticks);
+	printf("[%u] [OK] enable interrupts\n", (unsigned int)timer_now());
 
 	syscall_init();
-	printf("[%u] [OK] syscall_init\n", (unsigned int)timer_ticks);
+	printf("[%u] [OK] syscall_init\n", (unsigned int)timer_now());
+
+	workqueue_init();
+	printf("[%u] [OK] workqueue_init\n", (unsigned int)timer_now());
 
-	printf("free %u kb\n", pmm_count_free_blocks() * BLOCK_SIZE / 1024);
+	irq_threads_init();
+	printf("[%u] [OK] irq_threads_init\n", (unsigned int)timer_now());
+
+	printf("free %u kb\n", pmm_count_free_blocks() * (BLOCK_SIZE / 1024));
 
 	/* scan for device and initialise them */
 	pci_print_all();
@@ -507,7 +627,7 @@ void __attribute__((used)) kmain(struct multiboot_info *mbi, uint32_t eax, uintp
 	/* initialize all drivers */
 	modules_init();
 
-	printf("free %u kb\n", pmm_count_free_blocks() * BLOCK_SIZE / 1024);
+	printf("free %u kb\n", pmm_count_free_blocks() * (BLOCK_SIZE / 1024));
 	assert(mbi->flags & MULTIBOOT_INFO_MODS);
 	printf("we have modules!\n");
 
@@ -552,15 +672,17 @@ void __attribute__((used)) kmain(struct multiboot_info *mbi, uint32_t eax, uintp
 		}
 	}
 
-	printf("free %u kb\n", pmm_count_free_blocks() * BLOCK_SIZE / 1024);
+	printf("free %u kb\n", pmm_count_free_blocks() * (BLOCK_SIZE / 1024));
 	if (ramdisk == NULL) {
 		printf("no ramdisk found! unable to continue !\n");
 		halt();
 	}
 
 	process_init();
+	// a few ready kernel stacks for the first tasks
+	task_kstack_cache_fill(4);
 
-	printf("free %u kb\n", pmm_count_free_blocks() * BLOCK_SIZE / 1024);
+	printf("free %u kb\n", pmm_count_free_blocks() * (BLOCK_SIZE / 1024));
 
 	/* mount the ramdisk root filesystem */
 	fs_node_t *tar_root = mount_tar(ramdisk);
@@ -616,6 +738,18 @@ void __attribute__((used)) kmain(struct multiboot_info *mbi, uint32_t eax, uintp
 		kmain_ls("/tmp/abc");
 	}
 
+	/* heap profile report, write '1' to it to start profiling */
+	{
+		bool success = kmount("/heapstat", heap_profile_create());
+		printf("%s: %s mounted /heapstat!\n", __func__, success ? "successfully" : "failed to");
+	}
+
+	/* scheduler statistics report */
+	{
+		bool success = kmount("/schedstat", schedstat_create());
+		printf("%s: %s mounted /schedstat!\n", __func__, success ? "successfully" : "failed to");
+	}
+
 	/* run /init */
 	printf("%s: exec('/init')\n", __func__);
 	{
@@ -639,7 +773,18 @@ void __attribute__((used)) kmain(struct multiboot_info *mbi, uint32_t eax, uintp
 	ktask_spawn(ktask_test2, "test2", (void *)0x22222222);
 	ktask_spawn(ktask_test, "test", (void *)0x3333333);
 
-	printf("%u kb free\n", pmm_count_free_blocks() * BLOCK_SIZE / 1024);
+#ifdef BENCHMARK
+	ktask_spawn(ktask_kmalloc_bench, "kmalloc_bench", NULL);
+	ktask_spawn(ktask_switch_bench, "switch_bench", NULL);
+#endif
+
+	acpi_init();
+	printf("[%u] [OK] acpi_init\n", (unsigned int)timer_now());
+
+	smp_init();
+	printf("[%u] [OK] smp_init\n", (unsigned int)timer_now());
+
+	printf("%u kb free\n", pmm_count_free_blocks() * (BLOCK_SIZE / 1024));
 	// TODO: free anything left lying around that won't be needed (eg. multiboot info)
 
 	return tasking_enable();
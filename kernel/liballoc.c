@@ -7,7 +7,10 @@
 #include <console.h>
 #include <cpu.h>
 #include <heap.h>
+#include <heap_profile.h>
 #include <pmm.h>
+#include <slab.h>
+#include <task.h>
 #include <string.h>
 #include <vmm.h>
 #include <atomic.h>
@@ -86,7 +89,22 @@ static struct liballoc_major *l_memRoot = NULL;	// The root memory block acquire
 static struct liballoc_major *l_bestBet = NULL; // The major with the most free memory.
 
 static unsigned int l_pageSize  = 4096;         // The size of an individual page. Set up in liballoc_init.
-static unsigned int l_pageCount = 16;           // The number of pages to request per chunk. Set up in liballoc_init.
+static unsigned int l_pageCount = 4;            // The number of pages to request per chunk. Adapted to demand.
+static struct liballoc_major *l_spare = NULL;   // An empty major kept around for reuse.
+
+/*
+heap trimming:
+- l_pageCount doubles every time we have to get a new major block and halves
+  every time one is released, within LIBALLOC_MIN_PAGES and LIBALLOC_MAX_PAGES
+- free space of at least LIBALLOC_TRIM_PAGES at the end of a major is returned
+- one empty major of at most LIBALLOC_SPARE_PAGES is kept, it's released
+  (together with all empty slabs) when free memory drops below LIBALLOC_LOW_WATERMARK
+*/
+#define LIBALLOC_MIN_PAGES 4
+#define LIBALLOC_MAX_PAGES 64
+#define LIBALLOC_TRIM_PAGES 4
+#define LIBALLOC_SPARE_PAGES 16
+#define LIBALLOC_LOW_WATERMARK 1024 // in blocks
 static unsigned long long l_allocated = 0;      // Running total of allocated memory.
 static unsigned long long l_inuse = 0;          // Running total of used memory.
 
@@ -109,14 +127,14 @@ static int liballoc_unlock(void) {
 static int liballoc_free(void *v, size_t pages);
 static void *liballoc_alloc(size_t pages) {
 	uintptr_t v_start = find_vspace(kernel_directory, pages);
+	if ((v_start == 0) || (v_start == (uintptr_t)-1)) {
+		return NULL;
+	}
 	for (size_t i = 0; i < pages; i++) {
 		uintptr_t real_block = pmm_alloc_blocks(1);
 		if (real_block == 0) {
-			printf("OOM!!\n");
-			if (i > 0) {
-				liballoc_free((void *)v_start, i - 1);
-			}
-			halt();
+			// the pages not mapped yet are still reserved, liballoc_free releases those too
+			liballoc_free((void *)v_start, pages);
 			return NULL;
 		}
 		map_page(get_table_alloc(v_start + i * BLOCK_SIZE, kernel_directory),
@@ -135,8 +153,9 @@ static int liballoc_free(void *v, size_t pages) {
 		if (page == PAGE_VALUE_RESERVED) {
 			map_page(table, vaddr, 0, 0);
 		} else {
-			uintptr_t block = page & ~0xFFF;
+			phys_addr_t block = PAGE_FRAME(page);
 			map_page(table, vaddr, 0, 0);
+			invalidate_page(vaddr);
 			pmm_free_blocks(block, 1);
 		}
 	}
@@ -225,6 +244,52 @@ static bool __attribute__((no_sanitize_undefined)) liballoc_verify_magic(struct
 	}
 }
 
+static void liballoc_release_major( struct liballoc_major *maj ) {
+	l_allocated -= maj->size;
+
+	if ( (l_spare == NULL) && (maj->pages <= LIBALLOC_SPARE_PAGES) ) {
+		l_spare = maj;
+		return;
+	}
+
+	liballoc_free( maj, maj->pages );
+
+	// demand is shrinking, use smaller blocks next time
+	if ( l_pageCount > LIBALLOC_MIN_PAGES ) l_pageCount /= 2;
+}
+
+// returns the pages behind the last minor of maj, if there are enough of them
+static void liballoc_trim_major( struct liballoc_major *maj, struct liballoc_minor *last ) {
+	uintptr_t used_end = (uintptr_t)last + sizeof( struct liballoc_minor ) + last->size;
+	used_end = (used_end + l_pageSize - 1) & ~((uintptr_t)l_pageSize - 1);
+
+	uintptr_t maj_end = (uintptr_t)maj + maj->size;
+	if ( maj_end < used_end + LIBALLOC_TRIM_PAGES * l_pageSize ) {
+		return;
+	}
+
+	unsigned int pages = (maj_end - used_end) / l_pageSize;
+	liballoc_free( (void *)used_end, pages );
+	maj->pages -= pages;
+	maj->size -= pages * l_pageSize;
+	l_allocated -= pages * l_pageSize;
+}
+
+// release the spare major and all empty slabs, with the lock held
+static void __liballoc_trim(void) {
+	if ( l_spare != NULL ) {
+		liballoc_free( l_spare, l_spare->pages );
+		l_spare = NULL;
+	}
+	kmem_cache_reap();
+}
+
+void liballoc_trim(void) {
+	liballoc_lock();
+	__liballoc_trim();
+	liballoc_unlock();
+}
+
 static struct liballoc_major *allocate_new_page( unsigned int size ) {
 	unsigned int st;
 	struct liballoc_major *maj;
@@ -244,8 +309,22 @@ static struct liballoc_major *allocate_new_page( unsigned int size ) {
 	// Make sure it's >= the minimum size.
 	if ( st < l_pageCount ) st = l_pageCount;
 
-	maj = (struct liballoc_major*)liballoc_alloc( st );
-	assert(maj != NULL);
+	// the heap is identity mapped, only the low zone counts
+	if ( pmm_count_free_low_blocks() < LIBALLOC_LOW_WATERMARK ) {
+		// running low, give back everything we don't need
+		__liballoc_trim();
+	}
+
+	if ( (l_spare != NULL) && (l_spare->pages >= st) ) {
+		maj = l_spare;
+		l_spare = NULL;
+		st = maj->pages;
+	} else {
+		maj = (struct liballoc_major*)liballoc_alloc( st );
+
+		// demand is growing, use bigger blocks next time
+		if ( l_pageCount < LIBALLOC_MAX_PAGES ) l_pageCount *= 2;
+	}
 	if ( maj == NULL ) {
 		l_warningCount += 1;
 		#if defined DEBUG || defined INFO
@@ -272,6 +351,8 @@ static struct liballoc_major *allocate_new_page( unsigned int size ) {
 }
 
 
+static void *__kmalloc(size_t size);
+static void __kfree(void *ptr);
 void liballoc_init() {
 	assert(l_memRoot == NULL);
 	#if defined DEBUG || defined INFO
@@ -287,7 +368,7 @@ void liballoc_init() {
 	#endif
 }
 
-void * __attribute__((no_sanitize_undefined)) kmalloc(size_t req_size) {
+static void * __attribute__((no_sanitize_undefined)) l_malloc(size_t req_size) {
 	int startedBet = 0;
 	unsigned long long bestSize = 0;
 	void *p = NULL;
@@ -309,7 +390,14 @@ void * __attribute__((no_sanitize_undefined)) kmalloc(size_t req_size) {
 
 	liballoc_lock();
 
-	assert(l_memRoot != NULL);
+	if ( l_memRoot == NULL ) {
+		// every major block has been released
+		l_memRoot = allocate_new_page( size );
+		if ( l_memRoot == NULL ) {
+			liballoc_unlock();
+			return NULL;
+		}
+	}
 
 	#ifdef DEBUG
 	printf( "liballoc: %x kmalloc( %u ): ",
@@ -565,18 +653,11 @@ void * __attribute__((no_sanitize_undefined)) kmalloc(size_t req_size) {
 	return NULL;
 }
 
-void __attribute__((no_sanitize_undefined)) kfree(void *ptr)
+static void __attribute__((no_sanitize_undefined)) l_free(void *ptr)
 {
 	struct liballoc_minor *min;
 	struct liballoc_major *maj;
 
-	if ( ptr == NULL ) {
-		printf("%s(ptr: NULL) called from %p\n", __func__, __builtin_return_address(0));
-		assert(0);
-		l_warningCount += 1;
-		return;
-	}
-
 	UNALIGN( ptr );
 
 	liballoc_lock();		// lockit
@@ -620,10 +701,14 @@ void __attribute__((no_sanitize_undefined)) kfree(void *ptr)
 		if ( l_bestBet == maj ) l_bestBet = NULL;
 		if ( maj->prev != NULL ) maj->prev->next = maj->next;
 		if ( maj->next != NULL ) maj->next->prev = maj->prev;
-		l_allocated -= maj->size;
 
-		liballoc_free( maj, maj->pages );
+		liballoc_release_major( maj );
 	} else {
+		if ( min->next == NULL ) {
+			// we were the last minor, maybe the end of the block is free now
+			liballoc_trim_major( maj, min->prev );
+		}
+
 		if ( l_bestBet != NULL ) {
 			int bestSize = l_bestBet->size  - l_bestBet->usage;
 			int majSize = maj->size - maj->usage;
@@ -640,37 +725,31 @@ void __attribute__((no_sanitize_undefined)) kfree(void *ptr)
 	liballoc_unlock();		// release the lock
 }
 
-void* kcalloc(size_t nobj, size_t size) {
-       int real_size;
-       void *p;
-
-       real_size = nobj * size;
-
-       p = kmalloc( real_size );
-       assert(p != NULL);
+// bytes usable behind p, including the alignment slack of its minor
+static inline size_t l_usable_size(struct liballoc_minor *min, void *p) {
+	return (uintptr_t)min + sizeof( struct liballoc_minor ) + min->size - (uintptr_t)p;
+}
 
-       if (real_size != 0) {
-              memset( p, 0, real_size );
-       }
+static size_t __attribute__((no_sanitize_undefined)) l_usable(void *p) {
+	void *ptr = p;
+	UNALIGN(ptr);
 
-       return p;
+	liballoc_lock();
+	struct liballoc_minor *min = (struct liballoc_minor*)((uintptr_t)ptr - sizeof( struct liballoc_minor ));
+	if (!liballoc_verify_magic(min, ptr)) {
+		liballoc_unlock();
+		return 0;
+	}
+	size_t usable = l_usable_size(min, p);
+	liballoc_unlock();
+	return usable;
 }
 
-__attribute__((no_sanitize_undefined)) void* krealloc(void *p, size_t size) {
+static __attribute__((no_sanitize_undefined)) void* l_realloc(void *p, size_t size) {
 	void *ptr;
 	struct liballoc_minor *min;
 	unsigned int real_size;
 
-	// Honour the case of size == 0 => free old and return NULL
-	if ( size == 0 )
-	{
-		kfree( p );
-		return NULL;
-	}
-
-	// In the case of a NULL pointer, return a simple malloc.
-	if ( p == NULL ) return kmalloc( size );
-
 	// Unalign the pointer if required.
 	ptr = p;
 	UNALIGN(ptr);
@@ -689,19 +768,193 @@ __attribute__((no_sanitize_undefined)) void* krealloc(void *p, size_t size) {
 
 	real_size = min->req_size;
 
-	if ( real_size >= size ) {
+	// still fits into the slack of the minor (or shrinking)
+	if ( l_usable_size(min, p) >= size ) {
 		min->req_size = size;
 		liballoc_unlock();
 		return p;
 	}
 
+	// grow in place into the free space up to the next minor (or the end of the major)
+	{
+		struct liballoc_major *maj = min->block;
+		uintptr_t limit = (min->next != NULL) ? (uintptr_t)min->next : (uintptr_t)maj + maj->size;
+		if ( limit - (uintptr_t)p >= size ) {
+			unsigned int grow = size - l_usable_size(min, p);
+			min->size += grow;
+			min->req_size = size;
+			maj->usage += grow;
+			l_inuse += grow;
+			liballoc_unlock();
+			return p;
+		}
+	}
+
 	liballoc_unlock();
 
 	// If we got here then we're reallocating to a block bigger than us.
-	ptr = kmalloc( size );	// We need to allocate new memory
-	assert(ptr != NULL);
+	ptr = __kmalloc( size );	// We need to allocate new memory
+	if ( ptr == NULL ) {
+		// out of memory, p stays valid
+		return NULL;
+	}
 	memcpy( ptr, p, real_size );
-	kfree( p );
+	__kfree( p );
+
+	return ptr;
+}
+
+// ***********   SIZE CLASS FRONT-END   *************************
+
+/*
+small requests are served from power of two kmem caches (O(1) freelist pop/push),
+everything larger falls through to the liballoc major blocks above
+*/
+static kmem_cache_t kmalloc_caches[KMALLOC_CLASSES] = {
+	KMEM_CACHE_INIT_SIZE("kmalloc-16",   16,   NULL),
+	KMEM_CACHE_INIT_SIZE("kmalloc-32",   32,   NULL),
+	KMEM_CACHE_INIT_SIZE("kmalloc-64",   64,   NULL),
+	KMEM_CACHE_INIT_SIZE("kmalloc-128",  128,  NULL),
+	KMEM_CACHE_INIT_SIZE("kmalloc-256",  256,  NULL),
+	KMEM_CACHE_INIT_SIZE("kmalloc-512",  512,  NULL),
+	KMEM_CACHE_INIT_SIZE("kmalloc-1024", 1024, NULL),
+};
+
+static inline kmem_cache_t *kmalloc_cache(size_t size) {
+	unsigned int i = 0;
+	while (((size_t)1 << (i + KMALLOC_MIN_SHIFT)) < size) {
+		i++;
+	}
+	assert(i < KMALLOC_CLASSES);
+	return &kmalloc_caches[i];
+}
+
+// returns NULL once both the slabs and the pmm are out of memory
+static void *__kmalloc(size_t size) {
+	if (size <= KMALLOC_MAX_SIZE) {
+		return kmem_cache_alloc(kmalloc_cache(size));
+	}
+	return l_malloc(size);
+}
+
+static void __kfree(void *ptr) {
+	if (kmem_is_slab(ptr)) {
+		kmem_cache_free(kmem_ptr_cache(ptr), ptr);
+	} else {
+		l_free(ptr);
+	}
+}
+
+static void *__krealloc(void *p, size_t size) {
+	if (kmem_is_slab(p)) {
+		kmem_cache_t *cache = kmem_ptr_cache(p);
+		if (size <= cache->size) {
+			return p;
+		}
 
+		void *ptr = __kmalloc(size);
+		if (ptr == NULL) {
+			return NULL;
+		}
+		memcpy(ptr, p, cache->size);
+		kmem_cache_free(cache, p);
+		return ptr;
+	}
+
+	return l_realloc(p, size);
+}
+
+/* the public entry points only add the heap profiling hooks, tagged with their caller */
+
+void * __attribute__((malloc)) kmalloc(size_t size) {
+	void *p = __kmalloc(size);
+	heap_profile_alloc(p, size, __builtin_return_address(0));
+	return p;
+}
+
+void * __attribute__((malloc)) kmalloc_flags(size_t size, unsigned int flags) {
+	void *p = __kmalloc(size);
+
+	if ((p == NULL) && (flags & KMALLOC_MAY_SLEEP)) {
+		// give back the spare major, then wait for exiting tasks to be reaped
+		liballoc_trim();
+		p = __kmalloc(size);
+		for (unsigned int i = 0; (p == NULL) && task_can_block() && (i < KMALLOC_SLEEP_RETRIES); i++) {
+			task_sleep_miliseconds(KMALLOC_SLEEP_MS);
+			liballoc_trim();
+			p = __kmalloc(size);
+		}
+	}
+
+	if ((p != NULL) && (flags & KMALLOC_ZERO)) {
+		memset(p, 0, size);
+	}
+	heap_profile_alloc(p, size, __builtin_return_address(0));
+	return p;
+}
+
+size_t kmalloc_usable_size(void *ptr) {
+	assert(ptr != NULL);
+	if (kmem_is_slab(ptr)) {
+		return kmem_ptr_cache(ptr)->size;
+	} else {
+		return l_usable(ptr);
+	}
+}
+
+void kfree(void *ptr) {
+	if (ptr == NULL) {
+		printf("%s(ptr: NULL) called from %p\n", __func__, __builtin_return_address(0));
+		assert(0);
+		l_warningCount += 1;
+		return;
+	}
+
+	heap_profile_free(ptr);
+	__kfree(ptr);
+}
+
+void* kcalloc(size_t nobj, size_t size) {
+       int real_size;
+       void *p;
+
+       real_size = nobj * size;
+
+       p = __kmalloc( real_size );
+       if (p == NULL) {
+              return NULL;
+       }
+
+       if (real_size != 0) {
+              memset( p, 0, real_size );
+       }
+
+       heap_profile_alloc(p, real_size, __builtin_return_address(0));
+       return p;
+}
+
+void* krealloc(void *p, size_t size) {
+	// Honour the case of size == 0 => free old and return NULL
+	if ( size == 0 )
+	{
+		kfree( p );
+		return NULL;
+	}
+
+	// In the case of a NULL pointer, return a simple malloc.
+	if ( p == NULL ) {
+		p = __kmalloc( size );
+		heap_profile_alloc(p, size, __builtin_return_address(0));
+		return p;
+	}
+
+	heap_profile_free(p);
+	void *ptr = __krealloc(p, size);
+	if (ptr == NULL) {
+		// p is left untouched
+		heap_profile_alloc(p, kmalloc_usable_size(p), __builtin_return_address(0));
+		return NULL;
+	}
+	heap_profile_alloc(ptr, size, __builtin_return_address(0));
 	return ptr;
 }
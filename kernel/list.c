@@ -8,6 +8,9 @@
 #include <process.h>
 #include <heap.h>
 #include <list.h>
+#include <slab.h>
+
+static kmem_cache_t node_cache = KMEM_CACHE_INIT("node_t", node_t, NULL);
 
 list_t *list_init() {
 	list_t *v = kcalloc(1, sizeof(list_t));
@@ -20,7 +23,7 @@ void list_free(list_t *list) {
 	while (v) {
 		node_t *v2 = v->next;
 		assert(v->value == NULL);
-		kfree(v);
+		list_node_free(v);
 		v = v2;
 	}
 }
@@ -47,7 +50,7 @@ void list_append(list_t *list, node_t *node) {
 node_t *list_insert(list_t *list, void *v) {
 	assert(list != NULL);
 	assert(v != NULL); // technically correct but most likely a bug if we call with v=NULL
-	node_t *node = kcalloc(1, sizeof(node_t));
+	node_t *node = kmem_cache_alloc(&node_cache);
 	assert(node != NULL);
 	node->value = v;
 	list_append(list, node);
@@ -58,7 +61,7 @@ void list_remove(list_t *list, void *v) {
 	for (node_t *i = list->head; i != NULL; i = i->next) {
 		if (i->value == v) {
 			list_delete(list, i);
-			kfree(i);
+			list_node_free(i);
 			break;
 		}
 	}
@@ -70,10 +73,16 @@ void *list_dequeue(list_t *list) {
 	assert(out != NULL);
 	list_delete(list, out);
 	void *v = out->value;
-	kfree(out);
+	list_node_free(out);
 	return v;
 }
 
+/* free a node returned by list_insert, after it has been list_delete'd */
+void list_node_free(node_t *node) {
+	assert(node->owner == NULL);
+	kmem_cache_free(&node_cache, node);
+}
+
 void list_delete(list_t *list, node_t *v) {
 	assert(v->owner == list);
 	if (v == list->head) {
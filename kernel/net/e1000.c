@@ -5,6 +5,7 @@
 #include <mmio.h>
 #include <console.h>
 #include <cpu.h>
+#include <dma_pool.h>
 #include <heap.h>
 #include <irq.h>
 #include <list.h>
@@ -16,6 +17,8 @@
 #include <process.h>
 #include <string.h>
 #include <vmm.h>
+#include <wait.h>
+#include <workqueue.h>
 
 // FIXME: way too much magic numbers
 
@@ -44,6 +47,8 @@ enum e1000_reg {
 
 #define E1000_NUM_RX_DESC 32
 #define E1000_NUM_TX_DESC 8
+// rx/tx buffer size, rx frames longer than this are dropped by the card
+#define E1000_BUFFER_SIZE 2048
 
 typedef struct e1000_rx_desc {
 	volatile uint64_t addr __attribute__((packed));
@@ -74,14 +79,19 @@ typedef struct e1000 {
 	uint8_t mac[6];
 	e1000_rx_desc_t *rx;
 	e1000_tx_desc_t *tx;
+	dma_pool_t *buffers;
 
 	list_t *rx_queue;
+	spin_t rx_lock; // rx_queue
 	semaphore_t rx_sem;
+	work_t rx_work;
 
 	list_t *tx_queue;
 	semaphore_t tx_sem;
 } e1000_t;
 
+static void e1000_rx_work(work_t *work);
+
 /* helpers */
 static void e1000_cmd_writel(e1000_t *e1000, volatile enum e1000_reg address, uint32_t value) {
 	mmio_write32(e1000->iobase + address, value);
@@ -139,9 +149,10 @@ static void e1000_init_tx(e1000_t *e1000) {
 	assert((void *)e1000->tx != NULL);
 	assert((((uintptr_t)e1000->tx) & 0xF) == 0);
 
-	for (unsigned int i = 0; i < E1000_NUM_RX_DESC; i++) {
-		uintptr_t buf = (uintptr_t)dma_malloc(4096);
-		assert(buf != 0);
+	for (unsigned int i = 0; i < E1000_NUM_TX_DESC; i++) {
+		uintptr_t buf;
+		void *v = dma_pool_alloc(e1000->buffers, &buf);
+		assert(v != NULL);
 		e1000->tx[i].addr = buf;
 	}
 
@@ -163,6 +174,8 @@ static void e1000_init_tx(e1000_t *e1000) {
 static void e1000_init_rx(e1000_t *e1000) {
 	e1000->rx_queue = list_init();
 	assert(e1000->rx_queue != NULL);
+	spin_init(e1000->rx_lock);
+	work_init(&e1000->rx_work, e1000_rx_work);
 
 	size_t size = E1000_NUM_RX_DESC * sizeof(e1000_rx_desc_t);
 	assert((size % 128) == 0);
@@ -172,8 +185,9 @@ static void e1000_init_rx(e1000_t *e1000) {
 	assert((((uintptr_t)e1000->rx) & 0xF) == 0);
 
 	for (unsigned int i = 0; i < E1000_NUM_RX_DESC; i++) {
-		uintptr_t buf = (uintptr_t)dma_malloc(4096);
-		assert(buf != 0);
+		uintptr_t buf;
+		void *v = dma_pool_alloc(e1000->buffers, &buf);
+		assert(v != NULL);
 		e1000->rx[i].addr = buf;
 		e1000->rx[i].status = 0;
 	}
@@ -185,15 +199,13 @@ static void e1000_init_rx(e1000_t *e1000) {
 	e1000_cmd_writel(e1000, E1000_REG_RX_DESC_TAIL, E1000_NUM_RX_DESC - 1);
 	e1000_cmd_writel(e1000, E1000_REG_RX_CTRL, (
 			(1<<1) | // enable
-			(1<<5) | // long packet
 			(1<<15) | // broadcast accept
-
-			(1<<25) | // size (4096)
-			(1<<16) |
-			(1<<17) |
 			e1000_cmd_readl(e1000, E1000_REG_RX_CTRL)
-		) & ~((1<<7)|(1<<6)) // no loopback
-		);
+		) & ~(
+			(1<<5) | // no long packets, frames have to fit into one buffer
+			(1<<7) | (1<<6) | // no loopback
+			(1<<25) | (1<<17) | (1<<16) // buffer size 2048 (E1000_BUFFER_SIZE)
+		));
 }
 
 static void e1000_send_packet(void *extra, const uint8_t *data, size_t length) {
@@ -201,7 +213,7 @@ static void e1000_send_packet(void *extra, const uint8_t *data, size_t length) {
 	assert(e1000 != NULL);
 	assert(data != NULL);
 	assert(length != 0);
-	assert(length <= 4096);
+	assert(length <= E1000_BUFFER_SIZE);
 	assert(e1000->tx != NULL);
 
 	uint32_t tx_index = e1000_cmd_readl(e1000, E1000_REG_TX_DESC_TAIL);
@@ -218,13 +230,64 @@ static void e1000_send_packet(void *extra, const uint8_t *data, size_t length) {
 	e1000_cmd_writel(e1000, E1000_REG_TX_DESC_TAIL, tx_index);
 }
 
-/* only call with interrupts disabled */
 static packet_t *e1000_receive_packet(void *extra) {
 	e1000_t *e1000 = (e1000_t *)extra;
 	assert(e1000 != NULL);
 	assert(e1000->rx_queue != NULL);
 	semaphore_acquire(&e1000->rx_sem);
-	return (packet_t *)list_dequeue(e1000->rx_queue);
+	spin_lock(e1000->rx_lock);
+	packet_t *packet = (packet_t *)list_dequeue(e1000->rx_queue);
+	spin_unlock(e1000->rx_lock);
+	return packet;
+}
+
+// rx processing of all cards, one at a time keeps the frames in order
+static workqueue_t e1000_workqueue = WORKQUEUE_INIT("e1000", 1);
+
+/* copy the received frames out of the rx ring, queued by e1000_irq */
+static void e1000_rx_work(work_t *work) {
+	e1000_t *e1000 = work_entry(work, e1000_t, rx_work);
+
+	while (1) {
+		uint32_t rx_index = e1000_cmd_readl(e1000, E1000_REG_RX_DESC_TAIL);
+		assert(rx_index != e1000_cmd_readl(e1000, E1000_REG_RX_DESC_HEAD));
+		rx_index = (rx_index + 1) % E1000_NUM_RX_DESC;
+		if (!(e1000->rx[rx_index].status & 0x01)) {
+			break;
+		}
+
+		// insert received packet into receive queue
+		// TODO: instead of this let the network stack give us a function to call
+		uintptr_t rx_addr = e1000->rx[rx_index].addr;
+		uint8_t *data = (uint8_t *)(rx_addr);
+		uint16_t length = e1000->rx[rx_index].length;
+		assert(length <= E1000_BUFFER_SIZE);
+		assert(length != 0);
+		packet_t *packet = net_packet_new();
+		void *packet_data = kmalloc(length);
+		if ((packet == NULL) || (packet_data == NULL)) {
+			// out of memory, drop the frame
+			printf("%s: dropping frame (length: %u)\n", __func__, length);
+			if (packet != NULL) {
+				net_packet_free(packet);
+			}
+			if (packet_data != NULL) {
+				kfree(packet_data);
+			}
+			e1000->rx[rx_index].status = 0;
+			e1000_cmd_writel(e1000, E1000_REG_RX_DESC_TAIL, rx_index);
+			continue;
+		}
+		packet->length = length;
+		packet->data = packet_data;
+		memcpy(packet->data, data, length);
+		e1000->rx[rx_index].status = 0;
+		spin_lock(e1000->rx_lock);
+		list_insert(e1000->rx_queue, packet);
+		spin_unlock(e1000->rx_lock);
+		semaphore_release(&e1000->rx_sem);
+		e1000_cmd_writel(e1000, E1000_REG_RX_DESC_TAIL, rx_index);
+	}
 }
 
 static unsigned int e1000_irq(unsigned int irq, void *extra) {
@@ -257,33 +320,8 @@ static unsigned int e1000_irq(unsigned int irq, void *extra) {
 	}
 
 	if (status & (1<<7)) { // packet received
-		while (1) {
-			uint32_t rx_index = e1000_cmd_readl(e1000, E1000_REG_RX_DESC_TAIL);
-			assert(rx_index != e1000_cmd_readl(e1000, E1000_REG_RX_DESC_HEAD));
-			rx_index = (rx_index + 1) % E1000_NUM_RX_DESC;
-			if (e1000->rx[rx_index].status & 0x01) {
-				// insert received packet into receive queue
-				// TODO: instead of this let the network stack give us a function to call
-				uintptr_t rx_addr = e1000->rx[rx_index].addr;
-				uint8_t *data = (uint8_t *)(rx_addr);
-				uint16_t length = e1000->rx[rx_index].length;
-				assert(length <= 4096);
-				assert(length != 0);
-				packet_t *packet = kcalloc(1, sizeof(packet_t));
-				assert(packet != NULL);
-				packet->length = length;
-				packet->data = kmalloc(length);
-				assert(packet->data != NULL);
-				memcpy(packet->data, data, length);
-				e1000->rx[rx_index].status = 0;
-				// FIXME: race condition
-				list_insert(e1000->rx_queue, packet);
-				semaphore_release(&e1000->rx_sem);
-				e1000_cmd_writel(e1000, E1000_REG_RX_DESC_TAIL, rx_index);
-			} else {
-				break;
-			}
-		}
+		// the copying is done by a worker, the ring is only handed back once it's done
+		queue_work(&e1000_workqueue, &e1000->rx_work);
 		should_return = true;
 	}
 
@@ -340,7 +378,7 @@ static void e1000_device_init(uint32_t device, uint16_t deviceid, void *extra) {
 	e1000_cmd_writel(e1000, E1000_REG_CTRL, (1 << 26));
 	for (unsigned int i = 0; i < 10000; i++) { // FIXME: check for timeout
 		printf(".");
-		_sleep(10);
+		delay_ms(10);
 		uint32_t tmp = e1000_cmd_readl(e1000, E1000_REG_CTRL);
 		if ((tmp & (1 << 26)) == 0) {
 			break;
@@ -363,13 +401,13 @@ static void e1000_device_init(uint32_t device, uint16_t deviceid, void *extra) {
 	e1000_cmd_writel(e1000, 0x0030, 0); // flow control type
 	e1000_cmd_writel(e1000, 0x0170, 0); // flow control transmit timer value
 
-	_sleep(100); // FIXME: not needed ?
+	delay_ms(100); // FIXME: not needed ?
 
 	cmd = e1000_cmd_readl(e1000, E1000_REG_CTRL);
 	cmd &= ~(1<<30);
 	e1000_cmd_writel(e1000, E1000_REG_CTRL, cmd);
 
-	_sleep(100);
+	delay_ms(100);
 
 	unsigned int irq = pci_config_readb(e1000->pcidevice, PCI_IRQ);
 	printf("irq: %u\n", irq);
@@ -395,6 +433,9 @@ static void e1000_device_init(uint32_t device, uint16_t deviceid, void *extra) {
 	// link reset
 	e1000_cmd_writel(e1000, E1000_REG_RX_CTRL, (1<<4));
 
+	// packet buffers, two per page
+	e1000->buffers = dma_pool_create("e1000", E1000_BUFFER_SIZE, 16);
+
 	// FIXME: this is a bit late
 	e1000_init_tx(e1000);
 	e1000_init_rx(e1000);
@@ -412,7 +453,7 @@ static void e1000_device_init(uint32_t device, uint16_t deviceid, void *extra) {
 		0);
 //		(1<<2) | (1<<6) | (1<<7)|(1<<1)|1);
 
-	_sleep(100);
+	delay_ms(100);
 
 	net_register_netif(&e1000_send_packet, &e1000_receive_packet, e1000->mac, e1000);
 }
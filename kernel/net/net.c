@@ -7,12 +7,14 @@
 #include <kernel_task.h>
 #include <list.h>
 #include <module.h>
+#include <slab.h>
 #include <net/checksum.h>
 #include <net/net.h>
 #include <net/e1000.h>
 #include <net/tcp.h>
 #include <net/udp.h>
 #include <string.h>
+#include <task.h>
 
 #ifdef DEBUG
 #define DEBUG_ETHERNET
@@ -48,6 +50,8 @@
 static unsigned int ktask_net(const char *name, void *extra);
 
 list_t *netif_list;
+// taken for writing by net_register_netif, XXX: nothing walks netif_list yet, future readers take it for reading
+static rwlock_t netif_list_lock;
 
 static uint16_t ipv4_calculate_checksum(ipv4_packet_t *packet) {
 	uint16_t old_checksum = packet->checksum;
@@ -92,7 +96,9 @@ void net_register_netif(const send_packet_t send, const receive_packet_t receive
 	netif->arp_cache = list_init();
 	assert(netif->arp_cache != NULL);
 
+	rwlock_write_lock(&netif_list_lock);
 	list_insert(netif_list, netif);
+	rwlock_write_unlock(&netif_list_lock);
 
 	// TODO: add the mac address to the kernel task
 	ktask_spawn(ktask_net, "[net]", netif);
@@ -433,6 +439,17 @@ static void net_handle_arp(netif_t *netif, const ethernet_packet_t *ethernet_pac
 	}
 }
 
+static kmem_cache_t packet_cache = KMEM_CACHE_INIT("packet_t", packet_t, NULL);
+
+/* packet_t helpers, receive_packet implementations return these */
+packet_t *net_packet_new(void) {
+	return kmem_cache_alloc(&packet_cache);
+}
+
+void net_packet_free(packet_t *packet) {
+	kmem_cache_free(&packet_cache, packet);
+}
+
 static unsigned int ktask_net(const char *name, void *extra) {
 	(void)name;
 
@@ -442,6 +459,10 @@ static unsigned int ktask_net(const char *name, void *extra) {
 		return -1;
 	}
 
+	// received packets shouldn't wait behind cpu bound tasks
+	task_set_policy(current_task, TASK_POLICY_PRIORITY);
+	task_set_nice(current_task, -10);
+
 	while (1) {
 		packet_t *recv_packet = netif->receive_packet(netif->extra);
 		assert(recv_packet != NULL);
@@ -449,7 +470,7 @@ static unsigned int ktask_net(const char *name, void *extra) {
 		// just assume it's ethernet
 		ethernet_packet_t *packet = (ethernet_packet_t *)(recv_packet->data);
 		// we don't need it anymore, free it
-		kfree(recv_packet);
+		net_packet_free(recv_packet);
 		debug_ethernet("received ethernet packet length: 0x%x\n", (uintptr_t)length);
 		if (length < sizeof(ethernet_packet_t)) {
 			/* TODO: might want to increment a counter here */
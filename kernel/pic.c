@@ -1,6 +1,10 @@
+#include <atomic.h>
 #include <cpu.h>
 #include <pic.h>
 
+// the mask registers are read, modified and written back
+static spin_t pic_lock;
+
 void pic_init() {
 	outb(PIC1_COMMAND, 0x11);
 	iowait();
@@ -36,3 +40,17 @@ void pic_send_eoi(unsigned int irq) {
 
 	outb(PIC1_COMMAND, PIC_EOI);
 }
+
+void pic_mask(unsigned int irq) {
+	uint16_t port = (irq < 8) ? PIC1_DATA : PIC2_DATA;
+	uint32_t eflags = spin_lock_irqsave(pic_lock);
+	outb(port, (uint8_t)(inb(port) | (1 << (irq % 8))));
+	spin_unlock_irqrestore(pic_lock, eflags);
+}
+
+void pic_unmask(unsigned int irq) {
+	uint16_t port = (irq < 8) ? PIC1_DATA : PIC2_DATA;
+	uint32_t eflags = spin_lock_irqsave(pic_lock);
+	outb(port, (uint8_t)(inb(port) & ~(1 << (irq % 8))));
+	spin_unlock_irqrestore(pic_lock, eflags);
+}
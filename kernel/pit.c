@@ -1,5 +1,7 @@
+#include <stdbool.h>
 #include <stdint.h>
 
+#include <atomic.h>
 #include <console.h>
 #include <cpu.h>
 #include <irq.h>
@@ -10,8 +12,15 @@
 #define PIT_1_DATA 0x41
 #define PIT_2_DATA 0x42
 #define PIT_COMMAND 0x43
+// bit 0 gates channel 2, bit 1 connects it to the speaker, bit 5 is its OUT
+#define PIT_CHANNEL_2_CONTROL 0x61
 #define PIT_CLOCKRATE 1193182
 
+// pit input clock counts per timer tick
+#define PIT_COUNTS_PER_TICK (PIT_CLOCKRATE / FREQUENCY)
+// the counter is 16 bit, a one-shot can't be longer than this (54ms at 1000Hz)
+#define PIT_ONESHOT_MAX_TICKS (0xFFFF / PIT_COUNTS_PER_TICK)
+
 static void timer_phase(unsigned int frequency) {
 	unsigned int divisor = PIT_CLOCKRATE / frequency;
 	outb(PIT_COMMAND, 0x36);
@@ -21,17 +30,148 @@ static void timer_phase(unsigned int frequency) {
 
 uint64_t timer_ticks = 0;
 
+/*
+tickless operation: instead of the periodic tick, channel 0 runs a single countdown (mode 0)
+until the next timer event, timer_ticks is advanced by the elapsed time when it fires or
+when the periodic tick is resumed early
+*/
+static bool pit_oneshot = false;
+static uint64_t pit_oneshot_target;
+static uint16_t pit_oneshot_count;
+// the one-shot already expired when it was cancelled, its irq is still pending
+static bool pit_skip_tick = false;
+// the irq and timer_now may run on different cpus
+static spin_t pit_lock;
+
+// pit counts that passed on top of timer_ticks when a one-shot was cancelled, less than a tick
+static uint32_t pit_count_remainder;
+
+/* elapsed pit counts of the running one-shot, call with interrupts disabled */
+static uint32_t pit_oneshot_elapsed(bool *expired) {
+	// read-back: latch status and count of channel 0
+	outb(PIT_COMMAND, 0xC2);
+	uint8_t status = inb(PIT_0_DATA);
+	uint16_t count = inb(PIT_0_DATA);
+	count |= (uint16_t)inb(PIT_0_DATA) << 8;
+
+	// OUT is high once the countdown is over (and the counter wrapped around)
+	*expired = status & 0x80;
+	if (*expired) {
+		return pit_oneshot_count;
+	}
+	return (uint16_t)(pit_oneshot_count - count);
+}
+
+/* with pit_lock held */
+static void pit_periodic(void) {
+	if (!pit_oneshot) {
+		return;
+	}
+
+	bool expired;
+	// the fraction of a tick is carried over, early cancels (every irq waking up an idle cpu) would add up
+	uint32_t counts = pit_oneshot_elapsed(&expired) + pit_count_remainder;
+	timer_ticks += counts / PIT_COUNTS_PER_TICK;
+	pit_count_remainder = counts % PIT_COUNTS_PER_TICK;
+	pit_oneshot = false;
+	pit_skip_tick = expired;
+	timer_phase(FREQUENCY);
+}
+
+/* go back to the periodic tick, call with interrupts disabled */
+void timer_periodic(void) {
+	uint32_t eflags = spin_lock_irqsave(pit_lock);
+	pit_periodic();
+	spin_unlock_irqrestore(pit_lock, eflags);
+}
+
+/*
+stop the periodic tick and get the next timer irq at target (or after PIT_ONESHOT_MAX_TICKS)
+an already running one-shot is only replaced by an earlier one, call with interrupts disabled
+*/
+void timer_oneshot(uint64_t target) {
+	uint32_t eflags = spin_lock_irqsave(pit_lock);
+	if (pit_oneshot) {
+		if (target >= pit_oneshot_target) {
+			spin_unlock_irqrestore(pit_lock, eflags);
+			return;
+		}
+		pit_periodic();
+	}
+
+	if (target <= timer_ticks) {
+		// due already, the periodic tick takes care of it
+		spin_unlock_irqrestore(pit_lock, eflags);
+		return;
+	}
+
+	uint64_t delta = target - timer_ticks;
+	if (delta > PIT_ONESHOT_MAX_TICKS) {
+		delta = PIT_ONESHOT_MAX_TICKS;
+	}
+
+	pit_oneshot = true;
+	pit_oneshot_target = timer_ticks + delta;
+	pit_oneshot_count = (uint16_t)(delta * PIT_COUNTS_PER_TICK);
+	outb(PIT_COMMAND, 0x30);
+	outb(PIT_0_DATA, pit_oneshot_count & 0xFF);
+	outb(PIT_0_DATA, pit_oneshot_count >> 8);
+	spin_unlock_irqrestore(pit_lock, eflags);
+}
+
+/* timer_ticks including the elapsed part of a running one-shot */
+uint64_t timer_now(void) {
+	uint32_t eflags = spin_lock_irqsave(pit_lock);
+	uint64_t now = timer_ticks;
+	if (pit_oneshot) {
+		bool expired;
+		now += (pit_oneshot_elapsed(&expired) + pit_count_remainder) / PIT_COUNTS_PER_TICK;
+	}
+	spin_unlock_irqrestore(pit_lock, eflags);
+	return now;
+}
+
 static unsigned int irq0_handler(unsigned int irq, void *extra) {
 	(void)extra;
 	// XXX: we don't check if the IRQ was meant for us
 
-	timer_ticks++;
+	uint32_t eflags = spin_lock_irqsave(pit_lock);
+	if (pit_oneshot) {
+		timer_ticks = pit_oneshot_target;
+		pit_oneshot = false;
+		timer_phase(FREQUENCY);
+	} else if (pit_skip_tick) {
+		// already accounted for by timer_periodic
+		pit_skip_tick = false;
+	} else {
+		timer_ticks++;
+	}
+	spin_unlock_irqrestore(pit_lock, eflags);
 	irq_ack(irq);
 	scheduler_wakeup();
 
 	return IRQ_HANDLED;
 }
 
+/* channel 2 is only used here */
+static spin_t pit_busy_lock;
+
+/* busy-wait on channel 2, doesn't need interrupts or channel 0 */
+void timer_busy_wait(uint32_t ticks) {
+	for (uint32_t i = 0; i < ticks; i++) {
+		uint32_t eflags = spin_lock_irqsave(pit_busy_lock);
+		outb(PIT_CHANNEL_2_CONTROL, (inb(PIT_CHANNEL_2_CONTROL) & ~0x02) | 0x01);
+		// mode 0: OUT goes low now and high once the count reaches 0
+		outb(PIT_COMMAND, 0xB0);
+		outb(PIT_2_DATA, PIT_COUNTS_PER_TICK & 0xFF);
+		outb(PIT_2_DATA, PIT_COUNTS_PER_TICK >> 8);
+		while (!(inb(PIT_CHANNEL_2_CONTROL) & 0x20)) {
+			cpu_relax();
+		}
+		spin_unlock_irqrestore(pit_busy_lock, eflags);
+	}
+}
+
 void pit_init(void) {
 	irq_set_handler(0, irq0_handler, NULL);
 	timer_phase(FREQUENCY);
@@ -4,23 +4,53 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <atomic.h>
 #include <console.h>
 #include <pmm.h>
 #include <string.h>
 
 uint32_t *block_map;
-uint32_t block_map_size; // number of block_map entries / 32
+uint32_t block_map_size; // number of blocks (block_map entries * 32)
 static uint32_t block_map_last;
+static uint32_t block_free_count;
+static uint32_t block_free_low_count; // below PMM_LOW_BLOCKS
+// protects block_map, taken with interrupts disabled, memory may be freed from irq handlers
+static spin_t pmm_spinlock;
+
+uint32_t pmm_lock(void) {
+	return spin_lock_irqsave(pmm_spinlock);
+}
+
+void pmm_unlock(uint32_t eflags) {
+	spin_unlock_irqrestore(pmm_spinlock, eflags);
+}
+
+/* size of block_map in bytes */
+size_t pmm_map_size(void) {
+	return ((block_map_size + 31) / 32) * sizeof(uint32_t);
+}
 
 /* mark block block as used */
 inline void pmm_set_block(uintptr_t block) {
 	assert(block < block_map_size);
+	if (!(block_map[block / 32] & ((uint32_t)1 << (block % 32)))) {
+		block_free_count--;
+		if (block < PMM_LOW_BLOCKS) {
+			block_free_low_count--;
+		}
+	}
 	block_map[block / 32] |= ((uint32_t)1 << (block % 32));
 }
 
 /* mark block as available  */
 inline void pmm_unset_block(uintptr_t block) {
 	assert(block < block_map_size);
+	if (block_map[block / 32] & ((uint32_t)1 << (block % 32))) {
+		block_free_count++;
+		if (block < PMM_LOW_BLOCKS) {
+			block_free_low_count++;
+		}
+	}
 	block_map[block / 32] &= ~((uint32_t)1 << (block % 32));
 }
 
@@ -30,10 +60,22 @@ inline bool pmm_test_block(uintptr_t block) {
 	return (block_map[block / 32] & ((uint32_t)1 << (block % 32)));
 }
 
+/* block_map word range [first, last) of a zone */
+static inline uint32_t pmm_zone_first(bool high) {
+	return high ? PMM_LOW_BLOCKS / 32 : 0;
+}
+
+static inline uint32_t pmm_zone_last(bool high) {
+	if (high || block_map_size < PMM_LOW_BLOCKS) {
+		return block_map_size / 32;
+	}
+	return PMM_LOW_BLOCKS / 32;
+}
+
 /* find the first free block */
 // FIXME: fix corner cases
-static uint32_t pmm_find_first_free() {
-	for (uintptr_t i = 0; i < block_map_size / 32; i++) {
+static uint32_t pmm_find_first_free(bool high) {
+	for (uintptr_t i = pmm_zone_first(high); i < pmm_zone_last(high); i++) {
 		if (block_map[i] == 0xFFFFFFFF) {
 			// all blocks used, skip
 			continue;
@@ -53,14 +95,14 @@ static uint32_t pmm_find_first_free() {
 
 // TODO: optimise
 // FIXME: fix corner cases
-inline uint32_t pmm_find_region(size_t size) {
+static uint32_t pmm_find_region_zone(size_t size, bool high) {
 	assert(size != 0);
 
 	if (size == 1) {
-		return pmm_find_first_free();
+		return pmm_find_first_free(high);
 	}
 
-	for (uintptr_t i = 0; i < block_map_size / 32; i++) {
+	for (uintptr_t i = pmm_zone_first(high); i < pmm_zone_last(high); i++) {
 		if (block_map[i] == 0xFFFFFFFF) {
 			// all blocks used, skip
 			continue;
@@ -99,28 +141,55 @@ inline uint32_t pmm_find_region(size_t size) {
 	return 0;
 }
 
-uintptr_t pmm_alloc_blocks(size_t size) {
-	assert(size != 0);
-	uint32_t block = pmm_find_region(size);
-	if (block == 0) {
-		return 0;
-	}
+inline uint32_t pmm_find_region(size_t size) {
+	return pmm_find_region_zone(size, false);
+}
 
+static void pmm_mark_region(uint32_t block, size_t size) {
 	for (size_t i = 0; i < size; i++) {
 		pmm_set_block(block + i);
 	}
+}
 
+uintptr_t pmm_alloc_blocks(size_t size) {
+	assert(size != 0);
+	uint32_t eflags = pmm_lock();
+	uint32_t block = pmm_find_region(size);
+	if (block != 0) {
+		pmm_mark_region(block, size);
+	}
+	pmm_unlock(eflags);
 	return block * BLOCK_SIZE;
 }
 
-void pmm_free_blocks(uintptr_t p, size_t size) {
+phys_addr_t pmm_alloc_blocks_high(size_t size) {
+	assert(size != 0);
+	uint32_t eflags = pmm_lock();
+	uint32_t block = 0;
+	if (block_map_size > PMM_LOW_BLOCKS) {
+		block = pmm_find_region_zone(size, true);
+	}
+	if (block == 0) {
+		// no (more) memory above 4GiB, use the low zone
+		block = pmm_find_region(size);
+	}
+	if (block != 0) {
+		pmm_mark_region(block, size);
+	}
+	pmm_unlock(eflags);
+	return (phys_addr_t)block << BLOCK_SHIFT;
+}
+
+void pmm_free_blocks(phys_addr_t p, size_t size) {
 	assert(size != 0);
 
-	uint32_t block = ((uint32_t)p) / BLOCK_SIZE;
+	uint32_t block = (uint32_t)(p >> BLOCK_SHIFT);
 
+	uint32_t eflags = pmm_lock();
 	for (size_t i = 0; i < size; i++) {
 		pmm_unset_block(block + i);
 	}
+	pmm_unlock(eflags);
 }
 
 uintptr_t pmm_alloc_blocks_safe(size_t size) {
@@ -133,22 +202,32 @@ uintptr_t pmm_alloc_blocks_safe(size_t size) {
 	return v;
 }
 
-uint32_t pmm_count_free_blocks() {
-	uint32_t count = 0;
-	for (uint32_t i = 0; i < block_map_size; i++) {
-		if (! pmm_test_block(i)) {
-			count++;
-		}
+phys_addr_t pmm_alloc_blocks_high_safe(size_t size) {
+	phys_addr_t v = pmm_alloc_blocks_high(size);
+	if (v == 0) {
+		printf("%s(size: %u): OUT OF MEMORY!\n", __func__, (uintptr_t)size);
+		assert(0);
 	}
 
-	return count;
+	return v;
+}
+
+uint32_t pmm_count_free_blocks() {
+	return block_free_count;
+}
+
+uint32_t pmm_count_free_low_blocks(void) {
+	return block_free_low_count;
 }
 
-void pmm_init(void *mem_map, size_t mem_size) {
-	printf("%s(mem_map: %p; mem_size: 0x%8x)\n", __func__, mem_map, (uintptr_t)mem_size);
-	block_map_size = mem_size / BLOCK_SIZE;
+void pmm_init(void *mem_map, uint64_t mem_size) {
+	printf("%s(mem_map: %p; mem_size: 0x%x%8x)\n", __func__, mem_map, (uint32_t)(mem_size >> 32), (uint32_t)mem_size);
+	block_map_size = (uint32_t)(mem_size >> BLOCK_SHIFT);
 	block_map = (uint32_t *)mem_map;
 	block_map_last = 0;
+	block_free_count = 0;
+	block_free_low_count = 0;
+	spin_init(pmm_spinlock);
 
-	memset(block_map, 0xFF, block_map_size);
+	memset(block_map, 0xFF, pmm_map_size());
 }
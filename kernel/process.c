@@ -5,8 +5,10 @@
 #include <stddef.h>
 
 #include <boot.h>
+#include <arena.h>
 #include <bitmap.h>
 #include <console.h>
+#include <fpu.h>
 #include <fs.h>
 #include <gdt.h>
 #include <heap.h>
@@ -14,6 +16,7 @@
 #include <list.h>
 #include <pmm.h>
 #include <process.h>
+#include <slab.h>
 #include <string.h>
 #include <task.h>
 #include <tree.h>
@@ -22,6 +25,8 @@
 
 bitmap_t *pid_bitmap;
 
+static kmem_cache_t process_cache = KMEM_CACHE_INIT("process_t", process_t, NULL);
+
 static pid_t last_pid = 1;
 pid_t get_pid(void) {
 	if (last_pid > PROCESS_MAX_PID) {
@@ -35,6 +40,8 @@ pid_t get_pid(void) {
 }
 
 tree_t *ptree;
+// fork and process_destroy change the tree, lookups (waitpid, priority, ...) only read it
+static rwlock_t ptree_lock;
 tree_node_t *ptree_get_init_node(void) {
 	return ptree->root;
 }
@@ -43,7 +50,9 @@ tree_node_t *ptree_new_node(tree_node_t *parent, process_t *process) {
 	tree_node_t *v = tree_node_new();
 	assert(v != NULL);
 	v->value = process;
+	rwlock_write_lock(&ptree_lock);
 	tree_node_insert_child(ptree, ((process_t *)parent->value)->ptree_node, v);
+	rwlock_write_unlock(&ptree_lock);
 	return v;
 }
 
@@ -81,17 +90,23 @@ void fd_free(fd_entry_t *fd) {
 }
 
 /* fd_table_t helpers */
-static void fd_table_realloc(fd_table_t *table) {
+// grow the table to hold at least capacity entries, new entries are NULL
+static void fd_table_grow(fd_table_t *table, size_t capacity) {
 	assert(table != NULL);
-	if (table->entries == NULL) {
-		table->entries = kcalloc(table->capacity, sizeof(fd_entry_t *));
-	} else {
-		fd_entry_t **new_entries = kcalloc(table->capacity, sizeof(fd_entry_t *));
-		memcpy(new_entries, table->entries, table->length * sizeof(fd_entry_t *));
-		kfree(table->entries);
-		table->entries = new_entries;
+	if (capacity <= table->capacity) {
+		return;
 	}
-	assert(table->entries != NULL);
+	if (capacity < 2 * table->capacity) {
+		capacity = 2 * table->capacity;
+	}
+
+	fd_entry_t **entries = krealloc(table->entries, capacity * sizeof(fd_entry_t *));
+	assert(entries != NULL);
+	// use whatever slack the allocator handed out
+	capacity = kmalloc_usable_size(entries) / sizeof(fd_entry_t *);
+	memset(&entries[table->capacity], 0, (capacity - table->capacity) * sizeof(fd_entry_t *));
+	table->entries = entries;
+	table->capacity = capacity;
 }
 
 fd_table_t *fd_table_reference(fd_table_t *fd_table) {
@@ -105,9 +120,9 @@ fd_table_t *fd_table_reference(fd_table_t *fd_table) {
 fd_table_t *fd_table_new() {
 	fd_table_t *fd_table = kcalloc(1, sizeof(fd_table_t));
 	assert(fd_table != NULL);
-	fd_table->capacity = 16;
+	fd_table->capacity = 0;
 	fd_table->length = 0;
-	fd_table_realloc(fd_table);
+	fd_table_grow(fd_table, 16);
 	return fd_table_reference(fd_table);
 }
 
@@ -142,6 +157,7 @@ void fd_table_free(fd_table_t *fd_table) {
 				fd_free(fd_table->entries[i]);
 			}
 		}
+		kfree(fd_table->entries);
 		kfree(fd_table);
 	}
 }
@@ -162,12 +178,11 @@ int fd_table_set(fd_table_t *fd_table, unsigned int i, fd_entry_t *entry) {
 				fd_free(fd_table->entries[i]);
 			}
 		} else {
-			fd_table->capacity = i;
-			fd_table_realloc(fd_table);
+			fd_table_grow(fd_table, i + 1);
 		}
 		fd_table->entries[i] = entry;
-		if (fd_table->length < i) {
-			fd_table->length = i;
+		if (fd_table->length <= i) {
+			fd_table->length = i + 1;
 		}
 	}
 	return i;
@@ -186,8 +201,7 @@ int fd_table_append(fd_table_t *fd_table, fd_entry_t *entry) {
 
 	// no gaps found, is the table full ?
 	if (fd_table->length == fd_table->capacity) {
-		fd_table->capacity = fd_table->capacity + 8;
-		fd_table_realloc(fd_table);
+		fd_table_grow(fd_table, fd_table->length + 1);
 	}
 	// if not then entries[fd_table->length] is free
 
@@ -222,8 +236,8 @@ static void process_unmap_shared_region(page_directory_t *pdir, uintptr_t start,
 
 	for (uintptr_t i = 0; i < (end - start); i += BLOCK_SIZE) {
 		uintptr_t addr = start + i;
-		uintptr_t p = get_page(get_table_alloc(addr, pdir), addr);
-		assert(addr == (p & ~0xFFF));
+		page_t p = get_page(get_table_alloc(addr, pdir), addr);
+		assert(addr == PAGE_FRAME(p));
 		map_page(get_table_alloc(addr, pdir), addr, 0, 0);
 	}
 }
@@ -257,7 +271,7 @@ static void process_unmap_kstack(process_t *process) {
 		page_t kpage = get_page(get_table(vkaddr, kernel_directory), vkaddr);
 		page_t upage = get_page(get_table_alloc(vkaddr, process->task.pdir), vkaddr);
 		// FIXME: doesn't cover all cases
-		assert((kpage & ~0xFFF) == (upage & ~0xFFF));
+		assert(PAGE_FRAME(kpage) == PAGE_FRAME(upage));
 		map_page(get_table_alloc(vkaddr, process->task.pdir), vkaddr, 0, 0);
 	}
 }
@@ -292,25 +306,24 @@ static void process_page_directory_free(page_directory_t *pdir) {
 	process_unmap_shared_region(pdir, (uintptr_t)&__start_shared_text, (uintptr_t)&__stop_shared_text);
 
 	// XXX: and free all allocated blocks
-	for (uintptr_t i = 0; i < 1024; i++) {
-		uintptr_t phys_table = pdir->physical_tables[i];
+	for (uintptr_t i = 0; i < PAGE_DIRECTORY_ENTRIES; i++) {
+		page_t phys_table = pdir->physical_tables[i];
 		if (phys_table & PAGE_PRESENT) {
 			page_table_t *table = pdir->tables[i];
 			assert(table != NULL);
 
-			for (uintptr_t j = 0; j < 1024; j++) {
+			for (uintptr_t j = 0; j < PAGE_TABLE_ENTRIES; j++) {
 				page_t page = table->pages[j];
-				uintptr_t virtaddr = (i << 22) | (j << 12);
+				uintptr_t virtaddr = (i << PAGE_TABLE_SHIFT) | (j << 12);
 				if (page == 0) {
 					continue;
 				} else if (page & (PAGE_PRESENT | PAGE_USER)) {
 					// XXX: free page, depends on this being allocated to only this page directory
-					uintptr_t phys = page & ~0xFFF;
-					pmm_free_blocks(phys, 1);
+					pmm_free_blocks(PAGE_FRAME(page), 1);
 					table->pages[j] = 0;
 				} else {
 					/* XXX: this is bad, all kernel pages should have been unmapped already, we don't know how to handle it */
-					printf("%8x => 0x%8x this should not be here!\n", virtaddr, page);
+					printf("%8x => 0x%8x this should not be here!\n", virtaddr, (uint32_t)page);
 					dump_directory(pdir);
 					assert(0);
 				}
@@ -322,8 +335,8 @@ static void process_page_directory_free(page_directory_t *pdir) {
 }
 
 // process_execve helper
-static uintptr_t *process_exec_copy_array(process_t *process, uintptr_t *region_ptr, uintptr_t region_end, char * const * const array, size_t array_length) {
-	uintptr_t *ptrs = kcalloc(array_length, sizeof(uintptr_t));
+static uintptr_t *process_exec_copy_array(arena_t *arena, process_t *process, uintptr_t *region_ptr, uintptr_t region_end, char * const * const array, size_t array_length) {
+	uintptr_t *ptrs = arena_calloc(arena, array_length, sizeof(uintptr_t));
 	assert(ptrs != NULL);
 
 	if (array == NULL) {
@@ -380,7 +393,7 @@ void process_execve(process_t *process, fs_node_t *f, size_t argc, char * const
 	for (unsigned int i = 0; i < 256; i++) {
 		// allocate non-continous space
 		uintptr_t virtaddr = virt_heap_start + i*BLOCK_SIZE;
-		uintptr_t block = (uintptr_t)pmm_alloc_blocks_safe(1);
+		phys_addr_t block = pmm_alloc_blocks_high_safe(1);
 		map_page(get_table(k_tmp, kernel_directory), k_tmp, block,
 			PAGE_PRESENT | PAGE_READWRITE);
 		invalidate_page(k_tmp);
@@ -388,13 +401,13 @@ void process_execve(process_t *process, fs_node_t *f, size_t argc, char * const
 		memset((void *)k_tmp, 0, BLOCK_SIZE);
 		map_page(get_table_alloc(virtaddr, process->task.pdir), virtaddr,
 			block,
-			PAGE_PRESENT | PAGE_READWRITE | PAGE_USER);
+			PAGE_PRESENT | PAGE_READWRITE | PAGE_USER | PAGE_NO_EXECUTE);
 	}
 
 	// map the .text section
 	// TODO: check for f->length overflow
 	for (uintptr_t i = 0; i < f->length; i+=BLOCK_SIZE) {
-		uintptr_t block = pmm_alloc_blocks_safe(1);
+		phys_addr_t block = pmm_alloc_blocks_high_safe(1);
 		uintptr_t virtaddr = virt_text_start + i;
 		map_page(get_table(k_tmp, kernel_directory),
 			k_tmp,
@@ -413,7 +426,7 @@ void process_execve(process_t *process, fs_node_t *f, size_t argc, char * const
 	for (unsigned int i = 0; i < 256; i++) {
 		// allocate non-continous space
 		uintptr_t virtaddr = virt_stack_start + i*BLOCK_SIZE;
-		uintptr_t block = (uintptr_t)pmm_alloc_blocks_safe(1);
+		phys_addr_t block = pmm_alloc_blocks_high_safe(1);
 		map_page(get_table(k_tmp, kernel_directory), k_tmp, block,
 			PAGE_PRESENT | PAGE_READWRITE);
 		invalidate_page(k_tmp);
@@ -421,14 +434,14 @@ void process_execve(process_t *process, fs_node_t *f, size_t argc, char * const
 		memset((void *)k_tmp, 0, BLOCK_SIZE);
 		map_page(get_table_alloc(virtaddr, process->task.pdir), virtaddr,
 			block,
-			PAGE_PRESENT | PAGE_READWRITE | PAGE_USER);
+			PAGE_PRESENT | PAGE_READWRITE | PAGE_USER | PAGE_NO_EXECUTE);
 	}
 
 	// allocate misc region (cmdline, *argv, environment)
 	for (unsigned int i = 0; i < 1; i++) {
 		// allocate non-continous space
 		uintptr_t virtaddr = virt_misc_start + i*BLOCK_SIZE;
-		uintptr_t block = (uintptr_t)pmm_alloc_blocks_safe(1);
+		phys_addr_t block = pmm_alloc_blocks_high_safe(1);
 		map_page(get_table(k_tmp, kernel_directory), k_tmp, block,
 			PAGE_PRESENT | PAGE_READWRITE);
 
@@ -437,7 +450,7 @@ void process_execve(process_t *process, fs_node_t *f, size_t argc, char * const
 		memset((void *)k_tmp, 0, BLOCK_SIZE);
 		map_page(get_table_alloc(virtaddr, process->task.pdir), virtaddr,
 			block,
-			PAGE_PRESENT | PAGE_READWRITE | PAGE_USER);
+			PAGE_PRESENT | PAGE_READWRITE | PAGE_USER | PAGE_NO_EXECUTE);
 	}
 
 	map_page(get_table(k_tmp, kernel_directory), k_tmp, 0, 0);
@@ -452,11 +465,14 @@ void process_execve(process_t *process, fs_node_t *f, size_t argc, char * const
 	uintptr_t misc_ptr = virt_misc_start;
 	uintptr_t misc_region_end = virt_misc_start + 1 * PAGE_SIZE;
 
-	uintptr_t *argv_ptrs = process_exec_copy_array(process, &misc_ptr, misc_region_end, argv, argc);
-	uintptr_t *envp_ptrs = process_exec_copy_array(process, &misc_ptr, misc_region_end, envp, envc);
+	// pointer tables and the initial user stack image, gone once they are copied out
+	ARENA_ON_STACK(arena, 512);
+
+	uintptr_t *argv_ptrs = process_exec_copy_array(&arena, process, &misc_ptr, misc_region_end, argv, argc);
+	uintptr_t *envp_ptrs = process_exec_copy_array(&arena, process, &misc_ptr, misc_region_end, envp, envc);
 
 	size_t user_stack_size = argc + 2 + envc + 1;
-	uint32_t * const user_stack = kmalloc(sizeof(uint32_t) * user_stack_size);
+	uint32_t * const user_stack = arena_alloc(&arena, sizeof(uint32_t) * user_stack_size);
 	assert(user_stack != NULL);
 	uint32_t *user_stack_ptr = user_stack;
 
@@ -476,9 +492,10 @@ void process_execve(process_t *process, fs_node_t *f, size_t argc, char * const
 	uintptr_t virt_stack_top = virt_heap_start + 256 * BLOCK_SIZE - user_stack_size * sizeof(uint32_t);
 	intptr_t r = copy_to_userspace(process->task.pdir, virt_stack_top, user_stack_size * sizeof(uint32_t), user_stack);
 	assert(r > 0);
-	kfree(user_stack);
-	kfree(argv_ptrs);
-	kfree(envp_ptrs);
+	arena_release(&arena);
+
+	// the new program starts with a clean fpu
+	fpu_task_reset(&process->task);
 
 	registers_t *regs = (registers_t *)(process->task.kstack - sizeof(registers_t));
 	regs->old_directory = (uintptr_t)process->task.pdir->physical_address;
@@ -502,16 +519,16 @@ void process_execve(process_t *process, fs_node_t *f, size_t argc, char * const
 	regs->ss = regs->ds;
 
 	process->task.registers = regs;
-	process->task.esp = (uint32_t)regs;
-	process->task.ebp = process->task.esp;
-	process->task.eip = (uintptr_t)return_to_regs;
+	// return_to_regs doesn't go through handle_isr, charge the time to userspace from the start
+	process->task.user_mode = true;
+	task_set_entry(&process->task, (uintptr_t)regs, (uintptr_t)return_to_regs);
 }
 
 process_t *process_spawn_init(fs_node_t *f, size_t argc, char * const * const argv) {
 	assert(f != NULL);
 	assert(f->length != 0);
 
-	process_t *process = kcalloc(1, sizeof(process_t));
+	process_t *process = kmem_cache_alloc(&process_cache);
 	assert(process != NULL);
 	process->task.type = TASK_TYPE_USER_PROCESS;
 	process->task.obj = process;
@@ -544,7 +561,7 @@ static void page_directory_clone_table(page_table_t *newtable, page_table_t *old
 	uintptr_t newkvtmp = find_vspace(kernel_directory, 1);
 	assert(newkvtmp != 0);
 
-	for (uintptr_t i = 0; i < 1024; i++) {
+	for (uintptr_t i = 0; i < PAGE_TABLE_ENTRIES; i++) {
 		page_t page = oldtable->pages[i];
 		if (page == 0) {
 			continue;
@@ -560,8 +577,8 @@ static void page_directory_clone_table(page_table_t *newtable, page_table_t *old
 			if (newtable->pages[i] != 0) {
 				assert(0);
 			}
-			uintptr_t oldphys = page & ~0x3FF;
-			uintptr_t newphys = pmm_alloc_blocks_safe(1);
+			phys_addr_t oldphys = PAGE_FRAME(page);
+			phys_addr_t newphys = pmm_alloc_blocks_high_safe(1);
 			map_page(get_table(oldkvtmp, kernel_directory), oldkvtmp,
 				oldphys, PAGE_PRESENT | PAGE_READWRITE);
 			invalidate_page(oldkvtmp);
@@ -570,7 +587,7 @@ static void page_directory_clone_table(page_table_t *newtable, page_table_t *old
 			invalidate_page(newkvtmp);
 			memcpy((void *)newkvtmp, (void *)oldkvtmp, BLOCK_SIZE);
 			// XXX: we might be copying more than we want
-			newtable->pages[i] = newphys | (page & 0x3FF);
+			newtable->pages[i] = newphys | (page & (0x3FF | PAGE_NO_EXECUTE));
 		} else {
 			// XXX: this should never happen
 			assert(0);
@@ -588,9 +605,9 @@ void page_directory_clone(page_directory_t *newpdir, page_directory_t *old) {
 	assert(old != NULL);
 	assert(newpdir != NULL);
 
-	for (uintptr_t i = 0; i < 1024; i++) {
+	for (uintptr_t i = 0; i < PAGE_DIRECTORY_ENTRIES; i++) {
 		page_table_t *table = old->tables[i];
-		uintptr_t table_phys = old->physical_tables[i];
+		page_t table_phys = old->physical_tables[i];
 		if (!(table_phys & PAGE_TABLE_PRESENT)) {
 			if (table_phys == 0) {
 				continue;
@@ -600,13 +617,13 @@ void page_directory_clone(page_directory_t *newpdir, page_directory_t *old) {
 		}
 
 		// FIXME: write a new helper for this
-		page_table_t *newtable = get_table_alloc(i << 22, newpdir);
+		page_table_t *newtable = get_table_alloc(i << PAGE_TABLE_SHIFT, newpdir);
 		page_directory_clone_table(newtable, table);
 	}
 }
 
 process_t *process_clone(process_t *oldproc, enum syscall_clone_flags flags, uintptr_t child_stack) {
-	process_t *child = kcalloc(1, sizeof(process_t));
+	process_t *child = kmem_cache_alloc(&process_cache);
 	if (child == NULL) {
 		return NULL;
 	}
@@ -641,6 +658,8 @@ process_t *process_clone(process_t *oldproc, enum syscall_clone_flags flags, uin
 
 	child->task.type = current_process->task.type;
 	child->task.state = TASK_STATE_READY;
+	child->task.nice = oldproc->task.nice;
+	fpu_task_copy(&child->task, &oldproc->task);
 	child->task.registers = (registers_t *)(child->task.kstack - sizeof(registers_t));
 	memcpy(child->task.registers, current_process->task.registers, sizeof(registers_t));
 	registers_t *child_registers = child->task.registers;
@@ -651,9 +670,8 @@ process_t *process_clone(process_t *oldproc, enum syscall_clone_flags flags, uin
 		child_registers->esp = (uint32_t)child_stack;
 	}
 
-	child->task.esp = (uint32_t)child_registers;
-	child->task.ebp = child->task.esp;
-	child->task.eip = (uintptr_t)return_to_regs;
+	child->task.user_mode = true;
+	task_set_entry(&child->task, (uintptr_t)child_registers, (uintptr_t)return_to_regs);
 	child->task.obj = child;
 	return child;
 }
@@ -668,14 +686,17 @@ void process_destroy(process_t *process) {
 	assert(process->pid != 0);
 
 	bitmap_unset(pid_bitmap, process->pid);
+	rwlock_write_lock(&ptree_lock);
 	tree_node_delete_child(ptree, process->ptree_node->parent, process->ptree_node);
+	rwlock_write_unlock(&ptree_lock);
 
-	process_unmap_kstack(process);
-	task_kstack_free(&process->task);
+	// task_reap frees the kstack, process_waitpid only hands out reaped processes
+	assert(process->task.kstack == 0);
+	assert(!process->task.on_cpu);
 	fd_table_free(process->fd_table);
 	process_page_directory_free(process->task.pdir);
 	kfree(process->name);
-	kfree(process);
+	kmem_cache_free(&process_cache, process);
 }
 
 void __attribute__((noreturn)) process_exit(unsigned int status) {
@@ -694,6 +715,19 @@ void __attribute__((noreturn)) process_exit(unsigned int status) {
 	printf("%s: page directory free\n", __func__);
 	process_page_directory_free(p->task.pdir);
 
+	// XXX: the times go to the parent now, not once it waited for us
+	task_cputime_update();
+	rwlock_read_lock(&ptree_lock);
+	tree_node_t *parent_node = p->ptree_node->parent;
+	process_t *parent = (parent_node != NULL) ? parent_node->value : NULL;
+	if (parent != NULL) {
+		scheduler_lock();
+		parent->cutime += p->task.utime + p->cutime;
+		parent->cstime += p->task.stime + p->cstime;
+		scheduler_unlock();
+	}
+	rwlock_read_unlock(&ptree_lock);
+
 	printf("%s: scheduler_lock()\n", __func__);
 	scheduler_lock();
 	printf("%s: task_unblock_next()\n", __func__);
@@ -728,6 +762,75 @@ void process_init(void) {
 	ptree->root->value = NULL;
 }
 
+static process_t *process_find_node(tree_node_t *tree_node, pid_t pid) {
+	process_t *process = tree_node->value;
+	if ((process != NULL) && (process->pid == pid)) {
+		return process;
+	}
+
+	for (node_t *node = tree_node->children->head; node != NULL; node = node->next) {
+		process = process_find_node(node->value, pid);
+		if (process != NULL) {
+			return process;
+		}
+	}
+	return NULL;
+}
+
+/* pid 0 is the calling process, called with ptree_lock held */
+static process_t *process_priority_target(pid_t pid) {
+	return (pid == 0) ? current_process : process_find_node(ptree->root, pid);
+}
+
+int process_getpriority(pid_t pid, int *nice) {
+	rwlock_read_lock(&ptree_lock);
+	process_t *process = process_priority_target(pid);
+	if (process != NULL) {
+		*nice = process->task.nice;
+	}
+	rwlock_read_unlock(&ptree_lock);
+	return (process != NULL) ? 0 : -1;
+}
+
+int process_setpriority(pid_t pid, int nice) {
+	int r = -1;
+	rwlock_read_lock(&ptree_lock);
+	process_t *process = process_priority_target(pid);
+	if (process == NULL) {
+		goto out;
+	}
+	if ((process != current_process) && (process->ptree_node->parent != current_process->ptree_node)) {
+		printf("%s: pid %u may not change pid %u\n", __func__, current_process->pid, process->pid);
+		goto out;
+	}
+	if (nice < process->task.nice) {
+		// XXX: there are no users yet, nobody counts as root
+		goto out;
+	}
+	task_set_nice(&process->task, nice);
+	r = 0;
+out:
+	rwlock_read_unlock(&ptree_lock);
+	return r;
+}
+
+static void process_foreach_node(tree_node_t *tree_node, void (*fn)(process_t *process, void *extra), void *extra) {
+	if (tree_node->value != NULL) {
+		fn(tree_node->value, extra);
+	}
+	for (node_t *node = tree_node->children->head; node != NULL; node = node->next) {
+		process_foreach_node(node->value, fn, extra);
+	}
+}
+
+void process_foreach(void (*fn)(process_t *process, void *extra), void *extra) {
+	assert(fn != NULL);
+	rwlock_read_lock(&ptree_lock);
+	process_foreach_node(ptree->root, fn, extra);
+	rwlock_read_unlock(&ptree_lock);
+}
+
+/* called with ptree_lock held */
 process_t *process_waitpid_find(tree_node_t *parent_node, pid_t pid, uint32_t options) {
 	(void)options;
 
@@ -746,18 +849,35 @@ uint32_t process_waitpid(pid_t pid, uint32_t status, uint32_t options) {
 	printf("%s(pid: %u, status: %u, options: %u)\n", __func__, pid, status, options);
 
 	do { // TODO: implement for other than pid > 0
+		rwlock_read_lock(&ptree_lock);
 		process_t *p = process_waitpid_find(current_process->ptree_node, pid, options);
 		if (p == NULL) {
+			rwlock_read_unlock(&ptree_lock);
 			printf("%s: no process found, returning\n", __func__);
 			return -1;
 		}
 
-		if (p->task.state == TASK_STATE_TERMINATED) {
+		// XXX: check and block with the scheduler locked, process_exit wakes us up under it
+		scheduler_lock();
+		if ((p->task.state == TASK_STATE_TERMINATED) && (p->task.kstack == 0) && !p->task.on_cpu) {
+			scheduler_unlock();
+			rwlock_read_unlock(&ptree_lock);
 			printf("%s: done\n", __func__);
 			return p->pid;
+		} else if (p->task.state == TASK_STATE_TERMINATED) {
+			/*
+			still on its stack (on another cpu) or not reaped yet, that happens as soon as its cpu
+			switched to another task, nothing wakes us up for it
+			*/
+			scheduler_unlock();
+			rwlock_read_unlock(&ptree_lock);
+			task_sleep_miliseconds(1);
 		} else {
 			printf("%s: blocking\n", __func__);
 			task_block(&p->wait_queue, TASK_STATE_BLOCKED);
+			// the block only happens at the last scheduler_unlock, drop the tree first
+			rwlock_read_unlock(&ptree_lock);
+			scheduler_unlock();
 			printf("%s: after block\n", __func__);
 		}
 	} while (1);
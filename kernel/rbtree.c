@@ -0,0 +1,234 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <rbtree.h>
+
+static inline bool is_red(rbtree_node_t *node) {
+	return (node != NULL) && node->red;
+}
+
+/* make v take the place of u in the parent of u */
+static void rbtree_transplant(rbtree_t *tree, rbtree_node_t *u, rbtree_node_t *v) {
+	if (u->parent == NULL) {
+		tree->root = v;
+	} else if (u == u->parent->left) {
+		u->parent->left = v;
+	} else {
+		u->parent->right = v;
+	}
+	if (v != NULL) {
+		v->parent = u->parent;
+	}
+}
+
+static void rbtree_rotate_left(rbtree_t *tree, rbtree_node_t *x) {
+	rbtree_node_t *y = x->right;
+	x->right = y->left;
+	if (y->left != NULL) {
+		y->left->parent = x;
+	}
+	rbtree_transplant(tree, x, y);
+	y->left = x;
+	x->parent = y;
+}
+
+static void rbtree_rotate_right(rbtree_t *tree, rbtree_node_t *x) {
+	rbtree_node_t *y = x->left;
+	x->left = y->right;
+	if (y->right != NULL) {
+		y->right->parent = x;
+	}
+	rbtree_transplant(tree, x, y);
+	y->right = x;
+	x->parent = y;
+}
+
+void rbtree_insert(rbtree_t *tree, rbtree_node_t *node, rbtree_less_func *less) {
+	assert(tree != NULL);
+	assert(node != NULL);
+
+	rbtree_node_t *parent = NULL;
+	rbtree_node_t **link = &tree->root;
+	bool leftmost = true;
+	while (*link != NULL) {
+		parent = *link;
+		if (less(node, parent)) {
+			link = &parent->left;
+		} else {
+			link = &parent->right;
+			leftmost = false;
+		}
+	}
+
+	node->parent = parent;
+	node->left = NULL;
+	node->right = NULL;
+	node->red = true;
+	*link = node;
+	if (leftmost) {
+		tree->leftmost = node;
+	}
+
+	/* restore the red-black properties, only a red node with a red parent can be wrong */
+	while (is_red(parent = node->parent)) {
+		rbtree_node_t *grandparent = parent->parent;
+		if (parent == grandparent->left) {
+			rbtree_node_t *uncle = grandparent->right;
+			if (is_red(uncle)) {
+				parent->red = false;
+				uncle->red = false;
+				grandparent->red = true;
+				node = grandparent;
+				continue;
+			}
+			if (node == parent->right) {
+				rbtree_rotate_left(tree, parent);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->red = false;
+			grandparent->red = true;
+			rbtree_rotate_right(tree, grandparent);
+		} else {
+			rbtree_node_t *uncle = grandparent->left;
+			if (is_red(uncle)) {
+				parent->red = false;
+				uncle->red = false;
+				grandparent->red = true;
+				node = grandparent;
+				continue;
+			}
+			if (node == parent->left) {
+				rbtree_rotate_right(tree, parent);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->red = false;
+			grandparent->red = true;
+			rbtree_rotate_left(tree, grandparent);
+		}
+	}
+	tree->root->red = false;
+}
+
+/* x took the place of a removed black node, it's missing one black, x may be NULL */
+static void rbtree_remove_fixup(rbtree_t *tree, rbtree_node_t *x, rbtree_node_t *parent) {
+	while ((x != tree->root) && !is_red(x)) {
+		if (x == parent->left) {
+			rbtree_node_t *w = parent->right;
+			if (w->red) {
+				w->red = false;
+				parent->red = true;
+				rbtree_rotate_left(tree, parent);
+				w = parent->right;
+			}
+			if (!is_red(w->left) && !is_red(w->right)) {
+				w->red = true;
+				x = parent;
+				parent = x->parent;
+			} else {
+				if (!is_red(w->right)) {
+					w->left->red = false;
+					w->red = true;
+					rbtree_rotate_right(tree, w);
+					w = parent->right;
+				}
+				w->red = parent->red;
+				parent->red = false;
+				w->right->red = false;
+				rbtree_rotate_left(tree, parent);
+				x = tree->root;
+			}
+		} else {
+			rbtree_node_t *w = parent->left;
+			if (w->red) {
+				w->red = false;
+				parent->red = true;
+				rbtree_rotate_right(tree, parent);
+				w = parent->left;
+			}
+			if (!is_red(w->left) && !is_red(w->right)) {
+				w->red = true;
+				x = parent;
+				parent = x->parent;
+			} else {
+				if (!is_red(w->left)) {
+					w->right->red = false;
+					w->red = true;
+					rbtree_rotate_left(tree, w);
+					w = parent->left;
+				}
+				w->red = parent->red;
+				parent->red = false;
+				w->left->red = false;
+				rbtree_rotate_right(tree, parent);
+				x = tree->root;
+			}
+		}
+	}
+	if (x != NULL) {
+		x->red = false;
+	}
+}
+
+void rbtree_remove(rbtree_t *tree, rbtree_node_t *node) {
+	assert(tree != NULL);
+	assert(node != NULL);
+
+	if (tree->leftmost == node) {
+		tree->leftmost = rbtree_next(node);
+	}
+
+	rbtree_node_t *x;
+	rbtree_node_t *x_parent;
+	bool removed_red;
+	if ((node->left == NULL) || (node->right == NULL)) {
+		x = (node->left != NULL) ? node->left : node->right;
+		x_parent = node->parent;
+		removed_red = node->red;
+		rbtree_transplant(tree, node, x);
+	} else {
+		// the successor takes the place of node
+		rbtree_node_t *y = node->right;
+		while (y->left != NULL) {
+			y = y->left;
+		}
+		removed_red = y->red;
+		x = y->right;
+		if (y->parent == node) {
+			x_parent = y;
+		} else {
+			x_parent = y->parent;
+			rbtree_transplant(tree, y, x);
+			y->right = node->right;
+			y->right->parent = y;
+		}
+		rbtree_transplant(tree, node, y);
+		y->left = node->left;
+		y->left->parent = y;
+		y->red = node->red;
+	}
+
+	if (!removed_red) {
+		rbtree_remove_fixup(tree, x, x_parent);
+	}
+	node->parent = NULL;
+	node->left = NULL;
+	node->right = NULL;
+}
+
+rbtree_node_t *rbtree_next(rbtree_node_t *node) {
+	if (node->right != NULL) {
+		node = node->right;
+		while (node->left != NULL) {
+			node = node->left;
+		}
+		return node;
+	}
+
+	while ((node->parent != NULL) && (node == node->parent->right)) {
+		node = node->parent;
+	}
+	return node->parent;
+}
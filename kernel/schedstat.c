@@ -0,0 +1,109 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <fs.h>
+#include <heap.h>
+#include <itoa.h>
+#include <process.h>
+#include <schedstat.h>
+#include <smp.h>
+#include <string.h>
+
+// cpu lines plus one line per process, whatever doesn't fit is cut off
+#define SCHEDSTAT_LINE 96
+#define SCHEDSTAT_REPORT_SIZE 8192
+
+typedef struct {
+	char *buf;
+	size_t len;
+	size_t size;
+} schedstat_report_t;
+
+static void report_str(schedstat_report_t *r, const char *s) {
+	while ((*s != '\0') && (r->len + 1 < r->size)) {
+		r->buf[r->len++] = *s++;
+	}
+	r->buf[r->len] = '\0';
+}
+
+/* right aligned in a field of width characters */
+static void report_uint(schedstat_report_t *r, uint32_t value, size_t width) {
+	char num[33];
+	utoa(value, num, 10, 0);
+	for (size_t n = strlen(num); n < width; n++) {
+		report_str(r, " ");
+	}
+	report_str(r, num);
+}
+
+/*
+XXX: the counters are read without the scheduler lock, a running task's are only charged at the next
+switch (and an idle cpu's once it wakes up), so they can lag a bit
+*/
+static void schedstat_report_process(process_t *process, void *extra) {
+	schedstat_report_t *r = extra;
+	if (r->len + SCHEDSTAT_LINE >= r->size) {
+		return;
+	}
+
+	task_t *task = &process->task;
+	report_uint(r, (uint32_t)process->pid, 6);
+	report_uint(r, (uint32_t)task->utime, 10);
+	report_uint(r, (uint32_t)task->stime, 10);
+	report_uint(r, (uint32_t)task->wait_time, 10);
+	report_uint(r, task->nvcsw, 8);
+	report_uint(r, task->nivcsw, 8);
+	report_str(r, "  ");
+	report_str(r, (process->name != NULL) ? process->name : "?");
+	report_str(r, "\n");
+}
+
+static size_t schedstat_report(char *buf, size_t size) {
+	schedstat_report_t r = {.buf = buf, .len = 0, .size = size};
+
+	// ticks are ms at FREQUENCY 1000
+	report_str(&r, "   cpu   idle ms\n");
+	for (unsigned int i = 0; i < smp_num_cpus; i++) {
+		if (!cpus[i].online) {
+			continue;
+		}
+		report_uint(&r, i, 6);
+		report_uint(&r, (uint32_t)cpus[i].idle_time, 10);
+		report_str(&r, "\n");
+	}
+
+	report_str(&r, "   pid  utime ms  stime ms   wait ms   nvcsw  nivcsw  name\n");
+	process_foreach(schedstat_report_process, &r);
+	return r.len;
+}
+
+static uint32_t schedstat_read(fs_node_t *node, uint32_t offset, uint32_t size, void *buffer) {
+	(void)node;
+	char *buf = kmalloc_flags(SCHEDSTAT_REPORT_SIZE, KMALLOC_MAY_SLEEP);
+	if (buf == NULL) {
+		return 0;
+	}
+
+	size_t len = schedstat_report(buf, SCHEDSTAT_REPORT_SIZE);
+	if (offset >= len) {
+		kfree(buf);
+		return 0;
+	}
+	if (size > len - offset) {
+		size = len - offset;
+	}
+	memcpy(buffer, buf + offset, size);
+	kfree(buf);
+	return size;
+}
+
+fs_node_t *schedstat_create(void) {
+	fs_node_t *f = fs_node_new();
+	assert(f != NULL);
+	strncpy(f->name, "schedstat", 255);
+	f->flags = FS_NODE_CHARDEVICE;
+	f->read = schedstat_read;
+	return f;
+}
@@ -17,20 +17,29 @@ static ringbuffer_t serial_ringbuffer;
 static unsigned char serialbuffer[SERIALBUFFER_LENGTH];
 
 static unsigned int irq4_handler(unsigned int irq, void *extra) {
-	assert(extra != NULL);
+	(void)extra;
 	if (inb(PORT + 5) & 1) { // byte received ?
-		char c = inb(PORT);
-		ringbuffer_write_byte((ringbuffer_t *)extra, c);
+		// irq4_thread empties the receive buffer, irq 4 stays masked until then
 		irq_ack(irq);
-		return IRQ_HANDLED;
+		return IRQ_WAKE_THREAD;
 	}
 
 	return IRQ_IGNORED;
 }
 
+static unsigned int irq4_thread(unsigned int irq, void *extra) {
+	(void)irq;
+	assert(extra != NULL);
+	while (inb(PORT + 5) & 1) {
+		char c = inb(PORT);
+		ringbuffer_write_byte((ringbuffer_t *)extra, c);
+	}
+	return IRQ_HANDLED;
+}
+
 void serial_init() {
 	ringbuffer_init(&serial_ringbuffer, serialbuffer, SERIALBUFFER_LENGTH);
-	irq_set_handler(4, irq4_handler, &serial_ringbuffer);
+	irq_set_threaded_handler(4, irq4_handler, irq4_thread, &serial_ringbuffer);
 
 	// init serial COM0
 	outb(PORT + 1, 0x00); // Disable all interrupts
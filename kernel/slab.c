@@ -0,0 +1,253 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic.h>
+#include <console.h>
+#include <pmm.h>
+#include <slab.h>
+#include <string.h>
+#include <vmm.h>
+
+#define KMEM_SLAB_MAGIC 0x51ab51ab
+// number of empty slabs a cache keeps around before returning them
+#define KMEM_CACHE_MAX_EMPTY 1
+
+typedef struct kmem_slab {
+	struct kmem_slab *prev;
+	struct kmem_slab *next;
+	kmem_cache_t *cache;
+	void *free;
+	size_t inuse;
+	uint32_t magic;
+} kmem_slab_t;
+
+// every cache that has been used at least once
+static kmem_cache_t *kmem_caches = NULL;
+
+/* slab pages are marked with PAGE_SLAB, so kmem_is_slab doesn't have to trust the page contents */
+static void *kmem_page_alloc(void) {
+	uintptr_t v = find_vspace(kernel_directory, 1);
+	if ((v == 0) || (v == (uintptr_t)-1)) {
+		return NULL;
+	}
+
+	uintptr_t phys = pmm_alloc_blocks(1);
+	if (phys == 0) {
+		map_page(get_table(v, kernel_directory), v, 0, 0);
+		return NULL;
+	}
+
+	map_page(get_table(v, kernel_directory), v, phys,
+		PAGE_PRESENT | PAGE_READWRITE | PAGE_SLAB | PAGE_NO_EXECUTE);
+	invalidate_pages_local(v, 1);
+	return (void *)v;
+}
+
+static void kmem_page_free(void *p) {
+	uintptr_t v = (uintptr_t)p;
+	page_table_t *table = get_table(v, kernel_directory);
+	phys_addr_t phys = PAGE_FRAME(get_page(table, v));
+	map_page(table, v, 0, 0);
+	invalidate_page(v);
+	pmm_free_blocks(phys, 1);
+}
+
+bool kmem_is_slab(const void *ptr) {
+	uintptr_t v = (uintptr_t)ptr & ~(PAGE_SIZE - 1);
+	page_table_t *table = get_table(v, kernel_directory);
+	if (table == NULL) {
+		return false;
+	}
+
+	page_t page = get_page(table, v);
+	return (page & (PAGE_PRESENT | PAGE_SLAB)) == (PAGE_PRESENT | PAGE_SLAB);
+}
+
+/* returns the cache owning the slab object ptr */
+kmem_cache_t *kmem_ptr_cache(const void *ptr) {
+	assert(kmem_is_slab(ptr));
+	kmem_slab_t *slab = (kmem_slab_t *)((uintptr_t)ptr & ~(PAGE_SIZE - 1));
+	assert(slab->magic == KMEM_SLAB_MAGIC);
+	return slab->cache;
+}
+
+/* slab list helpers */
+static void kmem_slab_link(kmem_slab_t **list, kmem_slab_t *slab) {
+	slab->prev = NULL;
+	slab->next = *list;
+	if (*list != NULL) {
+		(*list)->prev = slab;
+	}
+	*list = slab;
+}
+
+static void kmem_slab_unlink(kmem_slab_t **list, kmem_slab_t *slab) {
+	if (slab->prev != NULL) {
+		slab->prev->next = slab->next;
+	} else {
+		assert(*list == slab);
+		*list = slab->next;
+	}
+	if (slab->next != NULL) {
+		slab->next->prev = slab->prev;
+	}
+	slab->prev = NULL;
+	slab->next = NULL;
+}
+
+static void kmem_cache_setup(kmem_cache_t *cache) {
+	assert(cache->size != 0);
+	size_t align = (cache->size >= 16) ? 16 : sizeof(void *);
+	size_t size = (cache->size < sizeof(void *)) ? sizeof(void *) : cache->size;
+
+	cache->object_size = (size + align - 1) & ~(align - 1);
+	cache->offset = (sizeof(kmem_slab_t) + align - 1) & ~(align - 1);
+	cache->objects_per_slab = (PAGE_SIZE - cache->offset) / cache->object_size;
+	assert(cache->objects_per_slab > 0);
+
+	cache->next = kmem_caches;
+	kmem_caches = cache;
+}
+
+static kmem_slab_t *kmem_slab_new(kmem_cache_t *cache) {
+	kmem_slab_t *slab = kmem_page_alloc();
+	if (slab == NULL) {
+		return NULL;
+	}
+
+	slab->prev = NULL;
+	slab->next = NULL;
+	slab->cache = cache;
+	slab->inuse = 0;
+	slab->magic = KMEM_SLAB_MAGIC;
+
+	// build the freelist back to front, so objects are handed out in address order
+	slab->free = NULL;
+	for (size_t i = cache->objects_per_slab; i > 0; i--) {
+		void **obj = (void **)((uintptr_t)slab + cache->offset + (i - 1) * cache->object_size);
+		*obj = slab->free;
+		slab->free = obj;
+	}
+
+	cache->n_slabs++;
+	return slab;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+	assert(cache != NULL);
+	uint32_t eflags = spin_lock_irqsave(cache->lock);
+
+	if (cache->objects_per_slab == 0) {
+		kmem_cache_setup(cache);
+	}
+
+	kmem_slab_t *slab = cache->partial;
+	if (slab == NULL) {
+		if (cache->empty != NULL) {
+			slab = cache->empty;
+			kmem_slab_unlink(&cache->empty, slab);
+			cache->n_empty--;
+		} else {
+			slab = kmem_slab_new(cache);
+			if (slab == NULL) {
+				spin_unlock_irqrestore(cache->lock, eflags);
+				printf("%s(%s): out of memory\n", __func__, cache->name);
+				return NULL;
+			}
+		}
+		kmem_slab_link(&cache->partial, slab);
+	}
+
+	void **obj = slab->free;
+	assert(obj != NULL);
+	slab->free = *obj;
+	slab->inuse++;
+	if (slab->inuse == cache->objects_per_slab) {
+		// full slabs aren't on any list, kmem_cache_free puts them back
+		kmem_slab_unlink(&cache->partial, slab);
+	}
+
+	cache->n_allocs++;
+	cache->n_active++;
+	if (cache->n_active > cache->n_peak) {
+		cache->n_peak = cache->n_active;
+	}
+	spin_unlock_irqrestore(cache->lock, eflags);
+
+	memset(obj, 0, cache->size);
+	if (cache->ctor != NULL) {
+		cache->ctor(obj);
+	}
+	return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+	assert(cache != NULL);
+	assert(obj != NULL);
+	assert(kmem_is_slab(obj));
+
+	kmem_slab_t *slab = (kmem_slab_t *)((uintptr_t)obj & ~(PAGE_SIZE - 1));
+	assert(slab->magic == KMEM_SLAB_MAGIC);
+	assert(slab->cache == cache);
+	assert((((uintptr_t)obj - (uintptr_t)slab - cache->offset) % cache->object_size) == 0);
+
+	uint32_t eflags = spin_lock_irqsave(cache->lock);
+	assert(slab->inuse != 0);
+	if (slab->inuse == cache->objects_per_slab) {
+		kmem_slab_link(&cache->partial, slab);
+	}
+
+	*(void **)obj = slab->free;
+	slab->free = obj;
+	slab->inuse--;
+
+	if (slab->inuse == 0) {
+		kmem_slab_unlink(&cache->partial, slab);
+		if (cache->n_empty < KMEM_CACHE_MAX_EMPTY) {
+			kmem_slab_link(&cache->empty, slab);
+			cache->n_empty++;
+		} else {
+			slab->magic = 0;
+			kmem_page_free(slab);
+			cache->n_slabs--;
+		}
+	}
+
+	cache->n_frees++;
+	cache->n_active--;
+	spin_unlock_irqrestore(cache->lock, eflags);
+}
+
+/* release all empty slabs of cache */
+void kmem_cache_shrink(kmem_cache_t *cache) {
+	assert(cache != NULL);
+	uint32_t eflags = spin_lock_irqsave(cache->lock);
+	while (cache->empty != NULL) {
+		kmem_slab_t *slab = cache->empty;
+		kmem_slab_unlink(&cache->empty, slab);
+		slab->magic = 0;
+		kmem_page_free(slab);
+		cache->n_slabs--;
+		cache->n_empty--;
+	}
+	spin_unlock_irqrestore(cache->lock, eflags);
+}
+
+/* release the empty slabs of every cache */
+void kmem_cache_reap(void) {
+	for (kmem_cache_t *cache = kmem_caches; cache != NULL; cache = cache->next) {
+		kmem_cache_shrink(cache);
+	}
+}
+
+void kmem_cache_dump(void) {
+	printf("kmem_cache: name size objs/slab slabs (empty) active (peak) allocs frees\n");
+	for (kmem_cache_t *cache = kmem_caches; cache != NULL; cache = cache->next) {
+		printf("kmem_cache: %s %u %u %u (%u) %u (%u) %u %u\n",
+			cache->name, (uintptr_t)cache->object_size, (uintptr_t)cache->objects_per_slab,
+			cache->n_slabs, (uintptr_t)cache->n_empty, cache->n_active, cache->n_peak,
+			cache->n_allocs, cache->n_frees);
+	}
+}
@@ -0,0 +1,323 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <acpi.h>
+#include <apic.h>
+#include <console.h>
+#include <cpu.h>
+#include <fpu.h>
+#include <gdt.h>
+#include <idt.h>
+#include <isr.h>
+#include <pit.h>
+#include <pmm.h>
+#include <smp.h>
+#include <string.h>
+#include <task.h>
+#include <vmm.h>
+
+cpu_t cpus[SMP_MAX_CPUS];
+unsigned int smp_num_cpus = 1;
+
+/* handed to smp_trampoline.s */
+uint32_t smp_ap_cr3;
+uintptr_t smp_ap_stack;
+uint8_t smp_ap_nx;
+extern char smp_trampoline_start[];
+extern char smp_trampoline_end[];
+
+// the cpu currently going through the trampoline, they're started one by one
+static cpu_t *smp_booting_cpu;
+// set once the first application processor runs, until then a local flush is enough
+static volatile bool smp_aps_online;
+
+/* MP specification 1.4, only used without an MADT */
+typedef struct {
+	char signature[4]; // "_MP_"
+	uint32_t config_table;
+	uint8_t length; // in 16 byte units
+	uint8_t revision;
+	uint8_t checksum;
+	uint8_t features[5];
+} __attribute__((packed)) mp_floating_pointer_t;
+
+typedef struct {
+	char signature[4]; // "PCMP"
+	uint16_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem_id[8];
+	char product_id[12];
+	uint32_t oem_table;
+	uint16_t oem_table_size;
+	uint16_t entry_count;
+	uint32_t lapic_address;
+	uint16_t extended_length;
+	uint8_t extended_checksum;
+	uint8_t reserved;
+} __attribute__((packed)) mp_config_table_t;
+
+#define MP_ENTRY_PROCESSOR 0
+// all other entries are 8 bytes long
+#define MP_ENTRY_SIZE 8
+
+#define MP_PROCESSOR_ENABLED (1 << 0)
+
+typedef struct {
+	uint8_t type;
+	uint8_t apic_id;
+	uint8_t apic_version;
+	uint8_t flags;
+	uint32_t signature;
+	uint32_t features;
+	uint32_t reserved[2];
+} __attribute__((packed)) mp_processor_t;
+
+static void smp_add_cpu(uint8_t apic_id) {
+	if (apic_id == cpus[0].apic_id) {
+		// the bootstrap processor
+		return;
+	} else if (smp_num_cpus == SMP_MAX_CPUS) {
+		printf("%s: ignoring cpu with apic id %u, SMP_MAX_CPUS reached\n", __func__, apic_id);
+		return;
+	}
+
+	cpu_t *cpu = &cpus[smp_num_cpus];
+	cpu->id = smp_num_cpus;
+	cpu->apic_id = apic_id;
+	smp_num_cpus++;
+}
+
+static bool smp_parse_madt(void) {
+	acpi_madt_t *madt = (acpi_madt_t *)acpi_find_table("APIC");
+	if (madt == NULL) {
+		return false;
+	}
+
+	uintptr_t p = (uintptr_t)madt + sizeof(acpi_madt_t);
+	uintptr_t end = (uintptr_t)madt + madt->header.length;
+	while (p + sizeof(acpi_madt_entry_t) <= end) {
+		acpi_madt_entry_t *entry = (acpi_madt_entry_t *)p;
+		if (entry->length < sizeof(acpi_madt_entry_t)) {
+			printf("%s: broken entry, stopping\n", __func__);
+			break;
+		}
+
+		if (entry->type == ACPI_MADT_LAPIC) {
+			acpi_madt_lapic_t *lapic = (acpi_madt_lapic_t *)entry;
+			if (lapic->flags & ACPI_MADT_LAPIC_ENABLED) {
+				smp_add_cpu(lapic->apic_id);
+			}
+		}
+		// XXX: io apics and interrupt source overrides are skipped, the irqs stay with the pic
+		// the local apic address is taken from the APIC_BASE msr of the cpu
+		p += entry->length;
+	}
+	return true;
+}
+
+static bool smp_parse_mp(void) {
+	uintptr_t fp_phys = acpi_scan_bios("_MP_", 4, sizeof(mp_floating_pointer_t));
+	if (fp_phys == 0) {
+		return false;
+	}
+
+	mp_floating_pointer_t *fp = map_physical(fp_phys, sizeof(mp_floating_pointer_t), PAGE_PRESENT);
+	assert(fp != NULL);
+	uintptr_t config_phys = fp->config_table;
+	unmap_physical(fp, sizeof(mp_floating_pointer_t));
+	if (config_phys == 0) {
+		// XXX: one of the default configurations, two cpus from before there were configuration tables
+		printf("%s: default configurations are not supported\n", __func__);
+		return false;
+	}
+
+	mp_config_table_t *config = map_physical(config_phys, sizeof(mp_config_table_t), PAGE_PRESENT);
+	assert(config != NULL);
+	size_t length = config->length;
+	unmap_physical(config, sizeof(mp_config_table_t));
+
+	config = map_physical(config_phys, length, PAGE_PRESENT);
+	assert(config != NULL);
+	if (memcmp(config->signature, "PCMP", 4) != 0) {
+		unmap_physical(config, length);
+		return false;
+	}
+
+	uint8_t *p = (uint8_t *)config + sizeof(mp_config_table_t);
+	uint8_t *end = (uint8_t *)config + length;
+	for (unsigned int i = 0; (i < config->entry_count) && (p < end); i++) {
+		if (*p == MP_ENTRY_PROCESSOR) {
+			mp_processor_t *processor = (mp_processor_t *)p;
+			if (processor->flags & MP_PROCESSOR_ENABLED) {
+				smp_add_cpu(processor->apic_id);
+			}
+			p += sizeof(mp_processor_t);
+		} else {
+			p += MP_ENTRY_SIZE;
+		}
+	}
+	unmap_physical(config, length);
+	return true;
+}
+
+void smp_send_reschedule(cpu_t *cpu) {
+	lapic_send_ipi(cpu->apic_id, APIC_VECTOR_RESCHEDULE);
+}
+
+static void smp_reschedule_handler(registers_t *regs) {
+	(void)regs;
+	lapic_eoi();
+	if (this_cpu()->id == 0) {
+		// there is a new task or sleeper, the pit might be in one-shot mode
+		timer_periodic();
+	}
+
+	scheduler_lock();
+	schedule();
+	scheduler_unlock();
+}
+
+/*
+tlb shootdowns: the kernel directory is shared, a page unmapped (or remapped) on one cpu may still be
+cached by the others, they have to drop it before the frame or the address is handed out again
+one shootdown at a time under tlb_lock, the other cpus flush in the ipi handler or, with interrupts
+disabled, while spinning in cpu_relax, a cpu waiting for a lock the sender holds can't deadlock it
+XXX: a cpu busy with interrupts disabled (and not spinning) holds up the sender until it's done
+*/
+static spin_t tlb_lock;
+static volatile uintptr_t tlb_start;
+static volatile size_t tlb_pages;
+static volatile bool tlb_active;
+
+void smp_tlb_poll(void) {
+	// checked first, this_cpu() needs %gs which isn't set up during early boot
+	if (!tlb_active) {
+		return;
+	}
+
+	cpu_t *cpu = this_cpu();
+	if (cpu->tlb_flush_pending) {
+		invalidate_pages_local(tlb_start, tlb_pages);
+		cpu->tlb_flush_pending = false;
+	}
+}
+
+static void smp_tlb_handler(registers_t *regs) {
+	(void)regs;
+	lapic_eoi();
+	smp_tlb_poll();
+}
+
+void smp_tlb_shootdown(uintptr_t virtaddr, size_t n) {
+	invalidate_pages_local(virtaddr, n);
+	if (!smp_aps_online) {
+		return;
+	}
+
+	uint32_t eflags = spin_lock_irqsave(tlb_lock);
+	cpu_t *self = this_cpu();
+	tlb_start = virtaddr;
+	tlb_pages = n;
+	for (unsigned int i = 0; i < smp_num_cpus; i++) {
+		cpus[i].tlb_flush_pending = (&cpus[i] != self) && cpus[i].online;
+	}
+	tlb_active = true;
+
+	for (unsigned int i = 0; i < smp_num_cpus; i++) {
+		if (cpus[i].tlb_flush_pending) {
+			lapic_send_ipi(cpus[i].apic_id, APIC_VECTOR_TLB);
+		}
+	}
+	for (unsigned int i = 0; i < smp_num_cpus; i++) {
+		while (cpus[i].tlb_flush_pending) {
+			cpu_relax();
+		}
+	}
+
+	tlb_active = false;
+	spin_unlock_irqrestore(tlb_lock, eflags);
+}
+
+/* entered from smp_trampoline.s, paging is on and we're on the stack of the idle task */
+__attribute__((used)) __attribute__((noreturn)) void smp_ap_main(void) {
+	cpu_t *cpu = smp_booting_cpu;
+	gdt_init_cpu(cpu);
+	idt_install_ap();
+	lapic_init(false);
+	assert(lapic_id() == cpu->apic_id);
+	fpu_init_cpu();
+
+	cpu->online = true;
+	smp_aps_online = true;
+	tasking_enable_ap();
+}
+
+/* wait with interrupts enabled, timer_ticks only advances while they are */
+static void smp_delay(unsigned int ms) {
+	uint64_t target = *(volatile uint64_t *)&timer_ticks + ms * FREQUENCY / 1000 + 1;
+	while (*(volatile uint64_t *)&timer_ticks < target) {
+		hlt();
+	}
+}
+
+/* INIT, then the startup ipi twice (the second one is ignored once the cpu runs) */
+static bool smp_boot_cpu(cpu_t *cpu) {
+	task_idle_init(cpu);
+	smp_booting_cpu = cpu;
+	// XXX: the idle task isn't running yet, its stack is free below the initial frame
+	smp_ap_stack = cpu->idle_task->esp;
+
+	lapic_send_init(cpu->apic_id);
+	smp_delay(10);
+	for (unsigned int i = 0; (i < 2) && !cpu->online; i++) {
+		lapic_send_startup(cpu->apic_id, SMP_TRAMPOLINE / BLOCK_SIZE);
+		smp_delay(1);
+	}
+
+	for (unsigned int i = 0; (i < 100) && !cpu->online; i++) {
+		smp_delay(1);
+	}
+	return cpu->online;
+}
+
+void smp_init(void) {
+	cpus[0].online = true;
+	if (!lapic_present()) {
+		printf("%s: no local apic, single processor\n", __func__);
+		return;
+	}
+
+	lapic_map();
+	lapic_init(true);
+	cpus[0].apic_id = lapic_id();
+
+	if (!smp_parse_madt() && !smp_parse_mp()) {
+		printf("%s: neither MADT nor MP table found, single processor\n", __func__);
+		return;
+	}
+	printf("%s: %u cpus, bootstrap processor apic id %u\n", __func__, smp_num_cpus, cpus[0].apic_id);
+	if (smp_num_cpus == 1) {
+		return;
+	}
+
+	isr_set_handler(APIC_VECTOR_RESCHEDULE, smp_reschedule_handler);
+	isr_set_handler(APIC_VECTOR_TLB, smp_tlb_handler);
+	spin_init(tlb_lock);
+	lapic_timer_calibrate();
+
+	memcpy((void *)SMP_TRAMPOLINE, smp_trampoline_start, (size_t)(smp_trampoline_end - smp_trampoline_start));
+	smp_ap_cr3 = kernel_directory->physical_address;
+	smp_ap_nx = vmm_nx_enabled;
+
+	for (unsigned int i = 1; i < smp_num_cpus; i++) {
+		cpu_t *cpu = &cpus[i];
+		if (smp_boot_cpu(cpu)) {
+			printf("%s: cpu %u (apic id %u) online\n", __func__, cpu->id, cpu->apic_id);
+		} else {
+			printf("%s: cpu %u (apic id %u) didn't come up\n", __func__, cpu->id, cpu->apic_id);
+		}
+	}
+}
@@ -1,8 +1,10 @@
 #include <assert.h>
 #include <stddef.h>
 
+#include <arena.h>
 #include <console.h>
 #include <cpu.h>
+#include <futex.h>
 #include <isr.h>
 #include <pit.h>
 #include <pmm.h>
@@ -204,24 +206,22 @@ intptr_t copy_from_userspace_ptr_array(page_directory_t *pdir, uintptr_t ptr, si
 }
 
 // TODO: limit maximum number of array elements / element size
-char **copy_from_userspace_array(page_directory_t *pdir, uintptr_t ptr, size_t size) {
-	char **array = kcalloc(size, sizeof(char *));
+/* the array and its strings are allocated from arena, they live until it is released */
+char **copy_from_userspace_array(arena_t *arena, page_directory_t *pdir, uintptr_t ptr, size_t size) {
+	char **array = arena_calloc(arena, size, sizeof(char *));
 	if (array == NULL) {
 		printf("%s: array allocation out of memory\n", __func__);
 		return NULL;
 	}
 
-	uintptr_t *user_array = kcalloc(size, sizeof(uintptr_t));
+	uintptr_t *user_array = arena_calloc(arena, size, sizeof(uintptr_t));
 	if (user_array == NULL) {
 		printf("%s: out of memory\n", __func__);
-		kfree(array);
 		return NULL;
 	}
 	{
 		intptr_t r = copy_from_userspace_ptr_array(pdir, ptr, size, user_array);
 		if (r < 0) {
-			kfree(array);
-			kfree(user_array);
 			printf("%s: copy_from_userspace_ptr_array returned %d\n", __func__, r);
 			return NULL;
 		}
@@ -233,21 +233,22 @@ char **copy_from_userspace_array(page_directory_t *pdir, uintptr_t ptr, size_t s
 			array[i] = NULL;
 			return array;
 		} else {
-			const size_t element_size = 256;
-			char *element = kmalloc(element_size);
+			char element[256];
+			const size_t element_size = sizeof(element);
 			intptr_t r = copy_from_userspace_string(pdir, user_array[i], element_size, element);
 			if (r < 0) {
 				printf("%s: copy failure! (r=%d)\n", __func__, r);
-				kfree(array);
-				kfree(user_array);
 				return NULL;
 			}
-			array[i] = element;
+			array[i] = arena_strndup(arena, element, element_size - 1);
+			if (array[i] == NULL) {
+				printf("%s: out of memory\n", __func__);
+				return NULL;
+			}
 		}
 	}
 
 	array[size - 1] = NULL;
-	kfree(user_array);
 	return array;
 }
 
@@ -290,15 +291,18 @@ static uint32_t syscall_execve(registers_t *regs) {
 	path[255] = 0;
 	printf(" path='%s'\n", path);
 
+	// argv/envp only live until process_execve copied them to the new address space
+	ARENA_ON_STACK(arena, 1024);
+
 	char **argv = NULL;
 	size_t argc = 0;
 	if (user_argv == 0) {
-		argv = kmalloc(sizeof(char *) * 2);
+		argv = arena_alloc(&arena, sizeof(char *) * 2);
 		argv[0] = &path[0];
 		argv[1] = NULL;
 		argc = 1;
 	} else {
-		argv = copy_from_userspace_array(current_process->task.pdir, user_argv, 20);
+		argv = copy_from_userspace_array(&arena, current_process->task.pdir, user_argv, 20);
 		if (argv != NULL) {
 			for (argc = 0; argv[argc] != NULL; argc++) {;}
 			for (size_t i = 0; i < argc; i++) {
@@ -309,7 +313,7 @@ static uint32_t syscall_execve(registers_t *regs) {
 	char **envp = NULL;
 	size_t envc = 0;
 	if (user_envp != 0) {
-		envp = copy_from_userspace_array(current_process->task.pdir, user_envp, 20);
+		envp = copy_from_userspace_array(&arena, current_process->task.pdir, user_envp, 20);
 		if (envp != NULL) {
 			for (envc = 0; envp[envc] != NULL; envc++) {;}
 			for (size_t i = 0; i < envc; i++) {
@@ -321,35 +325,13 @@ static uint32_t syscall_execve(registers_t *regs) {
 	fs_node_t *f = kopen(path, 0);
 	if (f == NULL) {
 		printf(" '%s' not found\n", path);
-		if (argv != NULL) {
-			for (char **v = argv; *v != NULL; v++) {
-				kfree(*v);
-			}
-			kfree(argv);
-		}
-		if (envp != NULL) {
-			for (char **v = envp; *v != NULL; v++) {
-				kfree(*v);
-			}
-			kfree(envp);
-		}
+		arena_release(&arena);
 		return 2;
 	} else {
 		// TODO: validate that this is actually a file and not a directory
 		process_execve(current_process, f, argc, argv, envc, envp);
 		fs_close(&f);
-		if (argv != NULL) {
-			for (char **v = argv; *v != NULL; v++) {
-				kfree(*v);
-			}
-			kfree(argv);
-		}
-		if (envp != NULL) {
-			for (char **v = envp; *v != NULL; v++) {
-				kfree(*v);
-			}
-			kfree(envp);
-		}
+		arena_release(&arena);
 		printf("%s: kstack: %p\n", __func__, current_task->kstack);
 		current_task->state = TASK_STATE_RUNNING;
 		tss_set_kstack(current_process->task.kstack);
@@ -392,11 +374,111 @@ static uint32_t syscall_lseek(registers_t *regs) {
 	}
 }
 
-// TODO: implement syscall_times
+// clock_t ticks per second, what musl assumes for _SC_CLK_TCK
+#define SYSCALL_CLK_TCK 100
+
+/* XXX: 32 bit only, the time wraps after ~49 days (of cpu time), clock_t does soon after anyway */
+static int32_t syscall_clock_t(uint64_t ticks) {
+	return (int32_t)((uint32_t)ticks / (FREQUENCY / SYSCALL_CLK_TCK));
+}
+
+struct syscall_tms {
+	int32_t tms_utime;
+	int32_t tms_stime;
+	int32_t tms_cutime;
+	int32_t tms_cstime;
+};
+
 static uint32_t syscall_times(registers_t *regs) {
-	(void)regs;
-//	printf("%s()\n", __func__);
-	return -1;
+	uintptr_t user_tms = regs->ebx;
+	process_t *process = current_process;
+
+	if (user_tms != 0) {
+		struct syscall_tms tms;
+		task_cputime_update();
+		scheduler_lock();
+		tms.tms_utime = syscall_clock_t(process->task.utime);
+		tms.tms_stime = syscall_clock_t(process->task.stime);
+		tms.tms_cutime = syscall_clock_t(process->cutime);
+		tms.tms_cstime = syscall_clock_t(process->cstime);
+		scheduler_unlock();
+		if (copy_to_userspace(process->task.pdir, user_tms, sizeof(struct syscall_tms), &tms) < 0) {
+			return -1;
+		}
+	}
+
+	return (uint32_t)syscall_clock_t(timer_now());
+}
+
+struct syscall_timeval {
+	int32_t tv_sec;
+	int32_t tv_usec;
+};
+
+struct syscall_rusage {
+	struct syscall_timeval ru_utime;
+	struct syscall_timeval ru_stime;
+	int32_t ru_maxrss;
+	int32_t ru_ixrss;
+	int32_t ru_idrss;
+	int32_t ru_isrss;
+	int32_t ru_minflt;
+	int32_t ru_majflt;
+	int32_t ru_nswap;
+	int32_t ru_inblock;
+	int32_t ru_oublock;
+	int32_t ru_msgsnd;
+	int32_t ru_msgrcv;
+	int32_t ru_nsignals;
+	int32_t ru_nvcsw;
+	int32_t ru_nivcsw;
+};
+
+enum syscall_rusage_who {
+	SYSCALL_RUSAGE_SELF     = 0,
+	SYSCALL_RUSAGE_CHILDREN = -1,
+	SYSCALL_RUSAGE_THREAD   = 1,
+};
+
+/* XXX: same 32 bit limit as syscall_clock_t */
+static void syscall_timeval_from_ticks(struct syscall_timeval *tv, uint64_t ticks) {
+	uint32_t ms = (uint32_t)ticks * (1000 / FREQUENCY);
+	tv->tv_sec = (int32_t)(ms / 1000);
+	tv->tv_usec = (int32_t)((ms % 1000) * 1000);
+}
+
+// only the times and context switches are counted, everything else is 0
+static uint32_t syscall_getrusage(registers_t *regs) {
+	int32_t who = (int32_t)regs->ebx;
+	uintptr_t user_rusage = regs->ecx;
+	process_t *process = current_process;
+
+	struct syscall_rusage rusage;
+	memset(&rusage, 0, sizeof(struct syscall_rusage));
+	task_cputime_update();
+	scheduler_lock();
+	switch (who) {
+		case SYSCALL_RUSAGE_SELF:
+		case SYSCALL_RUSAGE_THREAD: // XXX: threads are processes of their own
+			syscall_timeval_from_ticks(&rusage.ru_utime, process->task.utime);
+			syscall_timeval_from_ticks(&rusage.ru_stime, process->task.stime);
+			rusage.ru_nvcsw = (int32_t)process->task.nvcsw;
+			rusage.ru_nivcsw = (int32_t)process->task.nivcsw;
+			break;
+		case SYSCALL_RUSAGE_CHILDREN:
+			syscall_timeval_from_ticks(&rusage.ru_utime, process->cutime);
+			syscall_timeval_from_ticks(&rusage.ru_stime, process->cstime);
+			break;
+		default:
+			scheduler_unlock();
+			return -1;
+	}
+	scheduler_unlock();
+
+	if (copy_to_userspace(process->task.pdir, user_rusage, sizeof(struct syscall_rusage), &rusage) < 0) {
+		return -1;
+	}
+	return 0;
 }
 
 // TODO: implement syscall_mkdir properly
@@ -671,13 +753,13 @@ static uint32_t syscall_mmap_anon(registers_t *regs) {
 		addr = find_vspace(current_process->task.pdir, len);
 	}
 
-	uint32_t prot;
+	page_t prot;
 	switch (regs->edx) {
 		case (1):
-			prot = PAGE_PRESENT | PAGE_USER;
+			prot = PAGE_PRESENT | PAGE_USER | PAGE_NO_EXECUTE;
 			break;;
 		case (3):
-			prot = PAGE_PRESENT | PAGE_USER | PAGE_READWRITE;
+			prot = PAGE_PRESENT | PAGE_USER | PAGE_READWRITE | PAGE_NO_EXECUTE;
 			break;;
 		default:
 			// TODO: free vspace and return error
@@ -690,7 +772,7 @@ static uint32_t syscall_mmap_anon(registers_t *regs) {
 	assert(kptr != 0);
 	for (size_t i = 0; i < len; i++) {
 		uintptr_t virtaddr = addr + i * BLOCK_SIZE;
-		uintptr_t block = pmm_alloc_blocks_safe(1);
+		phys_addr_t block = pmm_alloc_blocks_high_safe(1);
 		// TODO: free already mapped pages
 		assert(get_page(get_table(virtaddr, current_process->task.pdir), virtaddr) == PAGE_VALUE_RESERVED);
 
@@ -732,11 +814,11 @@ static uint32_t syscall_munmap(registers_t *regs) {
 		}
 
 		if (p & PAGE_USER) {
-			pmm_free_blocks(p & ~0xFFF, 1);
+			pmm_free_blocks(PAGE_FRAME(p), 1);
 			map_page(get_table(i, current_process->task.pdir), i, 0, 0);
 			continue;
 		} else {
-			printf("refusing to munmap address %p (not user address)\n", (uintptr_t)p);
+			printf("refusing to munmap address %p (not user address)\n", i);
 		}
 
 		// something worth debugging went wrong
@@ -747,13 +829,51 @@ static uint32_t syscall_munmap(registers_t *regs) {
 }
 
 static uint32_t syscall_nano_sleep(registers_t *regs) {
-//	unsigned long target = ticks + regs->ebx;
 	uint32_t delay = regs->ebx;
-	uint64_t target = timer_ticks + delay;
-	task_sleep_until(target);
+	// timer_ticks lags behind while tickless, the sleep has to start from timer_now
+	task_sleep_miliseconds(delay);
 	return 0;
 }
 
+struct syscall_timespec {
+	int32_t tv_sec;
+	int32_t tv_nsec;
+};
+
+/* futex(uaddr, op, val, timeout or val2, uaddr2) */
+static uint32_t syscall_futex(registers_t *regs) {
+	uintptr_t uaddr = regs->ebx;
+	// XXX: all futexes are looked up by physical address, private ones just as well
+	uint32_t op = regs->ecx & ~FUTEX_PRIVATE_FLAG;
+	uint32_t val = regs->edx;
+	page_directory_t *pdir = current_process->task.pdir;
+
+	switch (op) {
+		case FUTEX_WAIT: {
+			uint64_t timeout = 0;
+			if (regs->esi != 0) {
+				struct syscall_timespec ts;
+				if (copy_from_userspace(pdir, regs->esi, sizeof(ts), &ts) < 0) {
+					return -FUTEX_EFAULT;
+				}
+				if ((ts.tv_sec < 0) || (ts.tv_nsec < 0) || (ts.tv_nsec >= 1000000000)) {
+					return -FUTEX_EINVAL;
+				}
+				// round up, plus a tick as the current one is partly over already (0 would wait forever)
+				timeout = (uint64_t)ts.tv_sec * FREQUENCY + ((uint32_t)ts.tv_nsec + 999999) / 1000000 + 1;
+			}
+			return futex_wait(pdir, uaddr, val, timeout);
+		}
+		case FUTEX_WAKE:
+			return futex_wake(pdir, uaddr, val);
+		case FUTEX_REQUEUE:
+			return futex_requeue(pdir, uaddr, val, regs->edi, regs->esi);
+		default:
+			printf("%s: TODO: implement op %u\n", __func__, op);
+			return -FUTEX_ENOSYS;
+	}
+}
+
 struct utsname {
 	char sysname[256];
 	char nodename[256];
@@ -809,6 +929,7 @@ static uint32_t syscall_readdir(registers_t *regs) {
 		strncpy(dirent_u.d_name, dirent_k->name, sizeof(dirent_u.d_name));
 		dirent_u.d_ino = dirent_k->ino;
 		dirent_u.d_type = dirent_k->type;
+		fs_dirent_free(dirent_k);
 		int32_t r = copy_to_userspace(current_process->task.pdir, dirent_user, sizeof(struct dirent_user), &dirent_u);
 		if (r < 0) {
 			printf("%s: copy_to_userspace\n", __func__);
@@ -825,6 +946,38 @@ static uint32_t syscall_sched_yield(registers_t *regs) {
 	return 0;
 }
 
+static uint32_t syscall_nice(registers_t *regs) {
+	int increment = (int)regs->ebx;
+	return (uint32_t)process_setpriority(0, current_task->nice + increment);
+}
+
+#define PRIO_PROCESS 0
+
+/* only PRIO_PROCESS is supported, who = 0 is the calling process */
+static bool syscall_priority_which(uint32_t which) {
+	if (which != PRIO_PROCESS) {
+		printf("%s: TODO: implement which = %u\n", __func__, which);
+		return false;
+	}
+	return true;
+}
+
+static uint32_t syscall_getpriority(registers_t *regs) {
+	int nice;
+	if (!syscall_priority_which(regs->ebx) || (process_getpriority((pid_t)regs->ecx, &nice) < 0)) {
+		return -1;
+	}
+	// XXX: like linux, return 20 - nice (1 to 40) so valid values can't look like an error
+	return (uint32_t)(20 - nice);
+}
+
+static uint32_t syscall_setpriority(registers_t *regs) {
+	if (!syscall_priority_which(regs->ebx)) {
+		return -1;
+	}
+	return (uint32_t)process_setpriority((pid_t)regs->ecx, (int)regs->edx);
+}
+
 static uint32_t syscall_getuid(registers_t *regs) {
 	(void)regs;
 	// TODO: implement
@@ -917,6 +1070,9 @@ static void syscall_handler(registers_t *regs) {
 		case 0x14:
 			regs->eax = syscall_getpid(regs);
 			break;
+		case 0x22:
+			regs->eax = syscall_nice(regs);
+			break;
 		case 0x27:
 			regs->eax = syscall_mkdir(regs);
 			break;
@@ -932,6 +1088,9 @@ static void syscall_handler(registers_t *regs) {
 		case 0x3f:
 			regs->eax = syscall_dup2(regs);
 			break;
+		case 0x4d:
+			regs->eax = syscall_getrusage(regs);
+			break;
 		case 0x4e:
 			regs->eax = syscall_gettimeofday(regs);
 			break;
@@ -941,6 +1100,12 @@ static void syscall_handler(registers_t *regs) {
 		case 0xFF:
 			regs->eax = syscall_dumpregs(regs);
 			break;
+		case 0x60:
+			regs->eax = syscall_getpriority(regs);
+			break;
+		case 0x61:
+			regs->eax = syscall_setpriority(regs);
+			break;
 		case 0x78:
 			regs->eax = syscall_clone(regs);
 			break;
@@ -974,6 +1139,9 @@ static void syscall_handler(registers_t *regs) {
 		case 0xd6:
 			regs->eax = syscall_setgid(regs);
 			break;
+		case 0xf0:
+			regs->eax = syscall_futex(regs);
+			break;
 		case 0x14a:
 			regs->eax = syscall_dup3(regs);
 			break;
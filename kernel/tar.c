@@ -182,7 +182,7 @@ static struct dirent *tar_readdir(struct fs_node *node, uint32_t i) {
 	assert(device != NULL);
 
 	if (i == 0) {
-		struct dirent *v = kcalloc(1, sizeof(struct dirent));
+		struct dirent *v = fs_dirent_new();
 		assert(v != NULL);
 		v->ino = 0;
 		strncpy(v->name, ".", 255);
@@ -190,7 +190,7 @@ static struct dirent *tar_readdir(struct fs_node *node, uint32_t i) {
 	}
 
 	if (i == 1) {
-		struct dirent *v = kcalloc(1, sizeof(struct dirent));
+		struct dirent *v = fs_dirent_new();
 		assert(v != NULL);
 		v->ino = 1;
 		strncpy(v->name, "..", 255);
@@ -240,7 +240,7 @@ static struct dirent *tar_readdir(struct fs_node *node, uint32_t i) {
 
 			// check if we have found the entry we need
 			if (j == i) {
-				struct dirent *v = kcalloc(1, sizeof(struct dirent));
+				struct dirent *v = fs_dirent_new();
 				assert(v != NULL);
 				v->ino = i;
 				strncpy(v->name, subname, 100);
@@ -1,19 +1,31 @@
 #include <assert.h>
 #include <stdbool.h>
 
+#include <apic.h>
 #include <pit.h>
 #include <console.h>
+#include <fpu.h>
 #include <gdt.h>
+#include <kernel_task.h>
 #include <pmm.h>
 #include <process.h>
+#include <smp.h>
 #include <string.h>
 #include <task.h>
 #include <vmm.h>
 
-/* kstack helpers */
-void task_kstack_alloc(task_t *task) {
-	assert(task != NULL);
+/*
+kstack helpers
+building a kernel stack is expensive (vspace search, KSTACK_SIZE - 2 frames, guard pages),
+so stacks of dead tasks are kept fully mapped in a small cache and handed out again
+*/
+#define KSTACK_CACHE_SIZE 16
 
+static uintptr_t kstack_cache[KSTACK_CACHE_SIZE];
+static unsigned int kstack_cache_count = 0;
+static spin_t kstack_cache_lock;
+
+static uintptr_t task_kstack_build(void) {
 	uintptr_t kstack = find_vspace(kernel_directory, KSTACK_SIZE);
 	assert(kstack != 0);
 
@@ -27,20 +39,18 @@ void task_kstack_alloc(task_t *task) {
 		uintptr_t phys = pmm_alloc_blocks_safe(1);
 		map_page(get_table(vkaddr, kernel_directory), vkaddr, phys,
 			PAGE_PRESENT | PAGE_READWRITE);
-		invalidate_page(vkaddr);
+		// a fresh address, no other cpu can have it cached
+		invalidate_pages_local(vkaddr, 1);
 		memset((void *)vkaddr, 0, BLOCK_SIZE);
 	}
 
 	kstack += (KSTACK_SIZE - 2) * BLOCK_SIZE;
-	task->kstack = kstack;
-
 	map_page(get_table(kstack, kernel_directory), kstack, PAGE_VALUE_GUARD, 0);
 	invalidate_page(kstack);
+	return kstack;
 }
 
-void task_kstack_free(task_t *task) {
-	assert(task != NULL);
-	uintptr_t kstack = task->kstack;
+static void task_kstack_destroy(uintptr_t kstack) {
 	assert(kstack != 0);
 
 	assert(get_page(get_table_alloc(kstack, kernel_directory), kstack) == PAGE_VALUE_GUARD);
@@ -50,11 +60,11 @@ void task_kstack_free(task_t *task) {
 
 	for (size_t i = 0; i < (KSTACK_SIZE - 2); i++) {
 		uintptr_t vkaddr = kstack - i * BLOCK_SIZE;
-		uintptr_t kpage = get_page(get_table_alloc(vkaddr, kernel_directory), vkaddr);
+		page_t kpage = get_page(get_table_alloc(vkaddr, kernel_directory), vkaddr);
 		assert(kpage & PAGE_PRESENT);
 		map_page(get_table_alloc(vkaddr, kernel_directory), vkaddr, 0, 0);
 		invalidate_page(vkaddr);
-		pmm_free_blocks(kpage & ~0xFFF, 1);
+		pmm_free_blocks(PAGE_FRAME(kpage), 1);
 	}
 
 	kstack -= (KSTACK_SIZE - 2) * BLOCK_SIZE;
@@ -62,83 +72,667 @@ void task_kstack_free(task_t *task) {
 	assert(get_page(get_table_alloc(kstack, kernel_directory), kstack) == PAGE_VALUE_GUARD);
 	map_page(get_table_alloc(kstack, kernel_directory), kstack, 0, 0);
 	invalidate_page(kstack);
+}
 
+void task_kstack_alloc(task_t *task) {
+	assert(task != NULL);
+
+	uintptr_t kstack = 0;
+	uint32_t eflags = spin_lock_irqsave(kstack_cache_lock);
+	if (kstack_cache_count > 0) {
+		kstack = kstack_cache[--kstack_cache_count];
+	}
+	spin_unlock_irqrestore(kstack_cache_lock, eflags);
+
+	if (kstack == 0) {
+		kstack = task_kstack_build();
+	}
+	task->kstack = kstack;
+}
+
+void task_kstack_free(task_t *task) {
+	assert(task != NULL);
+	uintptr_t kstack = task->kstack;
+	assert(kstack != 0);
 	task->kstack = 0;
+
+	uint32_t eflags = spin_lock_irqsave(kstack_cache_lock);
+	if (kstack_cache_count < KSTACK_CACHE_SIZE) {
+		kstack_cache[kstack_cache_count++] = kstack;
+		kstack = 0;
+	}
+	spin_unlock_irqrestore(kstack_cache_lock, eflags);
+
+	if (kstack != 0) {
+		task_kstack_destroy(kstack);
+	}
+}
+
+// pre-build n stacks so the first tasks don't have to
+void task_kstack_cache_fill(unsigned int n) {
+	for (unsigned int i = 0; (i < n) && (kstack_cache_count < KSTACK_CACHE_SIZE); i++) {
+		task_t tmp = { .kstack = task_kstack_build() };
+		task_kstack_free(&tmp);
+	}
+}
+
+/*
+the first switch_context to task "returns" to entry with esp as the stack pointer
+entry gets no arguments, it finds what it needs on the stack below esp
+*/
+void task_set_entry(task_t *task, uintptr_t esp, uintptr_t entry) {
+	assert(task != NULL);
+	uint32_t *stack = (uint32_t *)esp;
+	*--stack = entry;
+	// ebp, ebx, esi, edi
+	for (unsigned int i = 0; i < 4; i++) {
+		*--stack = 0;
+	}
+	task->esp = (uint32_t)stack;
 }
 
-/* actual scheduler logic */
-task_t *current_task;
-task_queue_t ready_queue;
-task_queue_t wait_queue;
-task_queue_t terminated_queue;
-list_t blocked_list;
+/*
+actual scheduler logic
+every cpu has its own run queues (cpu_rq_t), the wait queue of sleeping tasks is shared,
+all of them are protected by sched_spinlock, taken by the outermost scheduler_lock() on a cpu
+*/
+static task_t *wait_queue; // first task with a timeout, see wait_queue_insert
 bool scheduler_ready = false;
-volatile unsigned int scheduler_lock_count = 0;
-bool postponed_schedule = false;
-bool enable_ints = false;
+static spin_t sched_spinlock;
 
 /* debug helpers */
 #define assert_panic(exp) if (!(exp)) { interrupts_disable(); __asm__ __volatile__("hlt");}
 #define assert_interrupts_disabled() do {uint32_t f;__asm__ __volatile__("pushf\npop %0":"=r"(f)); assert_panic(!(f & 1<<9)); }while(0)
 
-/* task_queue_t helpers */
+/* task_queue_t helpers, the links live in task_t so none of them allocate */
 static void task_queue(task_queue_t *queue, task_t *task) {
 	assert_interrupts_disabled();
 	assert(queue != NULL);
 	assert(task != NULL);
+	assert(task->queue == NULL);
 	assert(task->next_task == NULL);
+	assert(task->prev_task == NULL);
 
+	task->queue = queue;
 	if (queue->first == NULL) {
 		assert(queue->last == NULL);
 		queue->first = task;
 		queue->last = task;
 	} else {
 		assert(queue->last != NULL);
+		task->prev_task = queue->last;
 		queue->last->next_task = task;
 		queue->last = task;
 	}
 }
 
+/* unlink task from whatever queue it is on */
+static void task_queue_remove(task_t *task) {
+	assert_interrupts_disabled();
+	assert(task != NULL);
+	task_queue_t *queue = task->queue;
+	assert(queue != NULL);
+
+	if (task->prev_task == NULL) {
+		assert(queue->first == task);
+		queue->first = task->next_task;
+	} else {
+		task->prev_task->next_task = task->next_task;
+	}
+	if (task->next_task == NULL) {
+		assert(queue->last == task);
+		queue->last = task->prev_task;
+	} else {
+		task->next_task->prev_task = task->prev_task;
+	}
+
+	task->next_task = NULL;
+	task->prev_task = NULL;
+	task->queue = NULL;
+}
+
 static task_t *task_dequeue(task_queue_t *queue) {
 	assert_interrupts_disabled();
 	assert(queue != NULL);
 
 	task_t *task = queue->first;
+	if (task != NULL) {
+		task_queue_remove(task);
+	}
+	return task;
+}
+
+/*
+priority class (TASK_POLICY_PRIORITY)
+runqueue_t: one fifo per priority plus a bitmap of the non-empty ones, so picking the next
+task is a bit scan no matter how many tasks are ready
+tasks that used up their time slice go to the expired array, once the active one runs
+empty both are swapped, this way low priorities still get their turn
+*/
+#define RUNQUEUE_BITMAP_WORDS ((TASK_PRIORITIES + 31) / 32)
+
+typedef struct {
+	unsigned int nr_tasks;
+	uint32_t bitmap[RUNQUEUE_BITMAP_WORDS];
+	task_queue_t queues[TASK_PRIORITIES];
+} runqueue_t;
+
+/* time slices in ms, from 200 ms at nice -20 down to 5 ms at nice 19 */
+#define TASK_TIMESLICE_MIN 5
+#define TASK_TIMESLICE_STEP 5
+/* interactivity, a task that slept most of the last TASK_MAX_SLEEP_AVG ticks gets up to
+TASK_MAX_BONUS / 2 priorities better, a cpu hog as many worse */
+#define TASK_MAX_BONUS 10
+#define TASK_MAX_SLEEP_AVG FREQUENCY
+#define TASK_INTERACTIVE_BONUS 3
+// interactive tasks stop skipping the expired array once it waited this long
+#define TASK_STARVATION_LIMIT FREQUENCY
+
+static inline unsigned int bit_scan_forward(uint32_t v) {
+	unsigned int r;
+	__asm__ ("bsf %1, %0" : "=r"(r) : "rm"(v));
+	return r;
+}
+
+static void runqueue_add(runqueue_t *rq, task_t *task) {
+	assert(task->priority < TASK_PRIORITIES);
+	task_queue(&rq->queues[task->priority], task);
+	rq->bitmap[task->priority / 32] |= 1u << (task->priority % 32);
+	rq->nr_tasks++;
+}
+
+/* highest priority with a ready task, TASK_PRIORITIES if empty */
+static unsigned int runqueue_first(runqueue_t *rq) {
+	for (unsigned int i = 0; i < RUNQUEUE_BITMAP_WORDS; i++) {
+		if (rq->bitmap[i] != 0) {
+			return i * 32 + bit_scan_forward(rq->bitmap[i]);
+		}
+	}
+	return TASK_PRIORITIES;
+}
+
+static task_t *runqueue_pop(runqueue_t *rq) {
+	unsigned int priority = runqueue_first(rq);
+	if (priority == TASK_PRIORITIES) {
+		return NULL;
+	}
+
+	task_t *task = task_dequeue(&rq->queues[priority]);
+	assert(task != NULL);
+	if (rq->queues[priority].first == NULL) {
+		rq->bitmap[priority / 32] &= ~(1u << (priority % 32));
+	}
+	rq->nr_tasks--;
+	return task;
+}
+
+/*
+rank of a task for priority inheritance, lower is more urgent: the priority class first,
+then the fair class, both by nice
+a task runs with the better one of its own rank and the one it inherited (pi_rank)
+*/
+#define TASK_PI_NONE (2 * TASK_PRIORITIES)
+
+static inline unsigned int task_rank(task_t *task) {
+	unsigned int rank = (unsigned int)(task->nice - TASK_NICE_MIN);
+	if (task->policy == TASK_POLICY_FAIR) {
+		rank += TASK_PRIORITIES;
+	}
+	return (task->pi_rank < rank) ? task->pi_rank : rank;
+}
+
+/* the class it's scheduled in, a boosted fair task runs in the priority class */
+static inline enum task_policy task_policy(task_t *task) {
+	return (task_rank(task) < TASK_PRIORITIES) ? TASK_POLICY_PRIORITY : TASK_POLICY_FAIR;
+}
+
+/* nice (or the inherited one) as 0 .. TASK_PRIORITIES - 1 */
+static inline unsigned int task_static_priority(task_t *task) {
+	return task_rank(task) % TASK_PRIORITIES;
+}
+
+/*
+fair class: ready tasks are kept in a tree ordered by vruntime, the cpu time they got so far
+scaled by their weight, the one that got the least runs next
+the running task is not in the tree, vruntime units are weighted microseconds
+*/
+#define FAIR_NICE_0_WEIGHT 1024
+#define FAIR_US_PER_TICK (1000000 / FREQUENCY)
+// every ready task runs once within this many ticks, unless that gets below FAIR_MIN_GRANULARITY each
+#define FAIR_LATENCY (20 * FREQUENCY / 1000)
+#define FAIR_MIN_GRANULARITY (4 * FREQUENCY / 1000)
+// a woken up task only preempts if it's behind the running one by more than this (us)
+#define FAIR_WAKEUP_GRANULARITY 1000
+// sleepers come back at most this far (us) behind min_vruntime, waking up doesn't bank cpu time
+#define FAIR_SLEEPER_CREDIT (FAIR_LATENCY * FAIR_US_PER_TICK / 2)
+
+/* each nice level is ~10% cpu time, same as linux */
+static const unsigned int fair_weights[TASK_PRIORITIES] = {
+	/* -20 */ 88761, 71755, 56483, 46273, 36291,
+	/* -15 */ 29154, 23254, 18705, 14949, 11916,
+	/* -10 */  9548,  7620,  6100,  4904,  3906,
+	/*  -5 */  3121,  2501,  1991,  1586,  1277,
+	/*   0 */  1024,   820,   655,   526,   423,
+	/*   5 */   335,   272,   215,   172,   137,
+	/*  10 */   110,    87,    70,    56,    45,
+	/*  15 */    36,    29,    23,    18,    15,
+};
+
+typedef struct {
+	rbtree_t tree;
+	unsigned int nr_tasks;
+	uint32_t load; // sum of the weights of the queued tasks
+	uint64_t min_vruntime; // never goes backwards
+} fair_queue_t;
+
+/*
+per cpu run queues, a task goes back to the cpu it last ran on (task->cpu),
+idle cpus pull queued tasks over from the busiest one
+*/
+typedef struct {
+	runqueue_t runqueues[2];
+	unsigned int active; // index of the active array, the other one is the expired one
+	// when the first task entered the expired array, see task_expire
+	uint64_t expired_since;
+	fair_queue_t fair;
+	// tasks that exited on this cpu, see task_reap
+	task_queue_t terminated;
+} cpu_rq_t;
+
+static cpu_rq_t cpu_rqs[SMP_MAX_CPUS];
+
+#define rq_active(rq) (&(rq)->runqueues[(rq)->active])
+#define rq_expired(rq) (&(rq)->runqueues[!(rq)->active])
+
+static inline cpu_rq_t *this_rq(void) {
+	return &cpu_rqs[this_cpu()->id];
+}
+
+static inline cpu_t *rq_cpu(cpu_rq_t *rq) {
+	return &cpus[rq - cpu_rqs];
+}
+
+static inline unsigned int rq_nr_ready(cpu_rq_t *rq) {
+	return rq->runqueues[0].nr_tasks + rq->runqueues[1].nr_tasks + rq->fair.nr_tasks;
+}
+
+static inline task_t *fair_task(rbtree_node_t *node) {
+	return (node != NULL) ? rbtree_entry(node, task_t, run_node) : NULL;
+}
+
+static bool fair_less(const rbtree_node_t *a, const rbtree_node_t *b) {
+	return rbtree_entry(a, task_t, run_node)->vruntime < rbtree_entry(b, task_t, run_node)->vruntime;
+}
+
+static inline unsigned int fair_weight(task_t *task) {
+	return fair_weights[task_static_priority(task)];
+}
+
+static void fair_update_min_vruntime(cpu_rq_t *rq) {
+	task_t *first = fair_task(rbtree_first(&rq->fair.tree));
+	task_t *curr = rq_cpu(rq)->current;
+	bool running = (curr != NULL) && (task_policy(curr) == TASK_POLICY_FAIR) &&
+		(curr->state == TASK_STATE_RUNNING);
+
+	uint64_t vruntime;
+	if (running && (first != NULL)) {
+		vruntime = (curr->vruntime < first->vruntime) ? curr->vruntime : first->vruntime;
+	} else if (running) {
+		vruntime = curr->vruntime;
+	} else if (first != NULL) {
+		vruntime = first->vruntime;
+	} else {
+		return;
+	}
+
+	if (vruntime > rq->fair.min_vruntime) {
+		rq->fair.min_vruntime = vruntime;
+	}
+}
+
+static void fair_enqueue(cpu_rq_t *rq, task_t *task) {
+	task->weight = fair_weight(task);
+	rbtree_insert(&rq->fair.tree, &task->run_node, fair_less);
+	rq->fair.nr_tasks++;
+	rq->fair.load += task->weight;
+}
+
+static task_t *fair_dequeue(cpu_rq_t *rq) {
+	task_t *task = fair_task(rbtree_first(&rq->fair.tree));
 	if (task == NULL) {
 		return NULL;
 	}
 
-	queue->first = task->next_task;
-	if (queue->first == NULL) {
-		assert(task->next_task == NULL);
-		assert(queue->last == task);
-		queue->last = NULL;
+	rbtree_remove(&rq->fair.tree, &task->run_node);
+	rq->fair.nr_tasks--;
+	rq->fair.load -= task->weight;
+	fair_update_min_vruntime(rq);
+	return task;
+}
+
+/* share of FAIR_LATENCY (in ticks) task gets next to the queued tasks, by weight */
+static unsigned int fair_slice(cpu_rq_t *rq, task_t *task) {
+	unsigned int nr = rq->fair.nr_tasks + 1;
+	unsigned int period = FAIR_LATENCY;
+	if (nr * FAIR_MIN_GRANULARITY > period) {
+		period = nr * FAIR_MIN_GRANULARITY;
+	}
+
+	unsigned int slice = period * task->weight / (rq->fair.load + task->weight);
+	return (slice > 0) ? slice : 1;
+}
+
+/*
+charge the time since cputime_start to utime or stime, depending on where the task runs
+XXX: the trap hooks use the cheap timer_ticks, that lags behind timer_now while cpu 0 is tickless,
+going backwards is ignored, the time is charged at the next call instead
+*/
+static void task_cputime(task_t *task, uint32_t now) {
+	int32_t delta = (int32_t)(now - task->cputime_start);
+	if (delta <= 0) {
+		return;
+	}
+	task->cputime_start = now;
+	if (task->user_mode) {
+		task->utime += (uint32_t)delta;
+	} else {
+		task->stime += (uint32_t)delta;
+	}
+}
+
+void task_trap_enter(void) {
+	assert_interrupts_disabled();
+	task_t *task = current_task;
+	if (task != NULL) {
+		task_cputime(task, (uint32_t)timer_ticks);
+		task->user_mode = false;
+	}
+}
+
+void task_trap_exit(void) {
+	assert_interrupts_disabled();
+	task_t *task = current_task;
+	if (task != NULL) {
+		task_cputime(task, (uint32_t)timer_ticks);
+		task->user_mode = true;
+	}
+}
+
+void task_cputime_update(void) {
+	scheduler_lock();
+	task_cputime(current_task, (uint32_t)timer_now());
+	scheduler_unlock();
+}
+
+/*
+charge the time since the last call to task, task is (or just was) running on rq
+XXX: timer_now, timer_ticks lags behind while the pit of the bootstrap processor is in one-shot mode
+*/
+static void task_account(cpu_rq_t *rq, task_t *task) {
+	uint64_t now = timer_now();
+	uint64_t delta = now - task->exec_start;
+	task->exec_start = now;
+	task->sum_exec_runtime += delta;
+	task_cputime(task, (uint32_t)now);
+
+	if (task_policy(task) == TASK_POLICY_FAIR) {
+		// XXX: clamp, keeps the weighting below in 32 bit
+		uint32_t ticks = (delta > FREQUENCY) ? FREQUENCY : (uint32_t)delta;
+		task->vruntime += ticks * FAIR_US_PER_TICK * FAIR_NICE_0_WEIGHT / task->weight;
+		fair_update_min_vruntime(rq);
+	}
+}
+
+/* priority tasks first, the fair class only gets the cpu when none of them is ready */
+static task_t *rq_dequeue(cpu_rq_t *rq) {
+	assert_interrupts_disabled();
+	if (rq_active(rq)->nr_tasks == 0) {
+		rq->active = !rq->active;
+	}
+
+	task_t *task = runqueue_pop(rq_active(rq));
+	if (task == NULL) {
+		task = fair_dequeue(rq);
+		if (task != NULL) {
+			task->timeslice = fair_slice(rq, task);
+		}
 	}
-	task->next_task = NULL;
 	return task;
 }
 
+static inline int task_bonus(task_t *task) {
+	return (int)(task->sleep_avg * TASK_MAX_BONUS / TASK_MAX_SLEEP_AVG) - TASK_MAX_BONUS / 2;
+}
+
+static unsigned int task_effective_priority(task_t *task) {
+	int priority = (int)task_static_priority(task) - task_bonus(task);
+	if ((task->pi_rank < TASK_PRIORITIES) && (priority > (int)task->pi_rank)) {
+		// a cpu hog penalty doesn't take back what it inherited
+		priority = (int)task->pi_rank;
+	}
+	if (priority < 0) {
+		return 0;
+	} else if (priority >= TASK_PRIORITIES) {
+		return TASK_PRIORITIES - 1;
+	}
+	return (unsigned int)priority;
+}
+
+static inline unsigned int task_timeslice(task_t *task) {
+	unsigned int ms = TASK_TIMESLICE_MIN + (TASK_PRIORITIES - 1 - task_static_priority(task)) * TASK_TIMESLICE_STEP;
+	return ms * FREQUENCY / 1000;
+}
+
+/* a new, woken up or preempted task, it still has (part of) its time slice */
+static void rq_enqueue(cpu_rq_t *rq, task_t *task) {
+	task->state = TASK_STATE_READY;
+	if (task_policy(task) == TASK_POLICY_FAIR) {
+		fair_enqueue(rq, task);
+	} else {
+		runqueue_add(rq_active(rq), task);
+	}
+}
+
+/* queue task on its cpu and get that cpu to look at it */
+static void task_ready(task_t *task) {
+	cpu_t *cpu = &cpus[task->cpu];
+	task->ready_start = (uint32_t)timer_now();
+	rq_enqueue(&cpu_rqs[task->cpu], task);
+
+	if (cpu != this_cpu()) {
+		smp_send_reschedule(cpu);
+	} else if (cpu->id == 0) {
+		// XXX: there is something to share the cpu with now, get the periodic tick back
+		timer_periodic();
+	}
+}
 
-// TODO: rewrite partially in assembly
-__attribute__((noreturn)) static void __restore_task(task_t *task) {
+/*
+the time slice of task is used up, hand out a new one
+fair tasks just go back into the tree, they get their slice once picked again
+interactive priority tasks go right back into the active array unless that starves the expired one
+*/
+static void task_expire(cpu_rq_t *rq, task_t *task) {
+	task->state = TASK_STATE_READY;
+	task->priority = task_effective_priority(task);
+	if (task_policy(task) == TASK_POLICY_FAIR) {
+		fair_enqueue(rq, task);
+		return;
+	}
+
+	task->timeslice = task_timeslice(task);
+
+	bool starving = (rq_expired(rq)->nr_tasks > 0) && (timer_ticks - rq->expired_since >= TASK_STARVATION_LIMIT);
+	if ((task_bonus(task) >= TASK_INTERACTIVE_BONUS) && !starving) {
+		runqueue_add(rq_active(rq), task);
+	} else {
+		if (rq_expired(rq)->nr_tasks == 0) {
+			rq->expired_since = timer_ticks;
+		}
+		runqueue_add(rq_expired(rq), task);
+	}
+}
+
+/* true if the running task should give up the cpu */
+static bool task_preempt_check(cpu_rq_t *rq, task_t *task) {
+	if (task == rq_cpu(rq)->idle_task) {
+		return rq_nr_ready(rq) > 0;
+	} else if (task->timeslice == 0) {
+		return true;
+	} else if (task_policy(task) == TASK_POLICY_PRIORITY) {
+		return runqueue_first(rq_active(rq)) < task->priority;
+	} else if ((rq->runqueues[0].nr_tasks > 0) || (rq->runqueues[1].nr_tasks > 0)) {
+		return true;
+	}
+
+	task_t *first = fair_task(rbtree_first(&rq->fair.tree));
+	return (first != NULL) && (first->vruntime + FAIR_WAKEUP_GRANULARITY < task->vruntime);
+}
+
+/* cpu for a new task, the one with the fewest runnable tasks */
+static unsigned int task_select_cpu(void) {
+	unsigned int best = this_cpu()->id;
+	unsigned int best_load = rq_nr_ready(&cpu_rqs[best]) + 1;
+	for (unsigned int i = 0; i < smp_num_cpus; i++) {
+		if ((i == best) || !cpus[i].online) {
+			continue;
+		}
+
+		unsigned int load = rq_nr_ready(&cpu_rqs[i]) + (cpus[i].current != cpus[i].idle_task);
+		if (load < best_load) {
+			best = i;
+			best_load = load;
+		}
+	}
+	return best;
+}
+
+/* called on an idle cpu, pull one queued task over from the busiest other cpu */
+static void task_steal(cpu_rq_t *rq) {
+	cpu_rq_t *busiest = NULL;
+	unsigned int max = 0;
+	for (unsigned int i = 0; i < smp_num_cpus; i++) {
+		cpu_rq_t *other = &cpu_rqs[i];
+		if ((other != rq) && cpus[i].online && (rq_nr_ready(other) > max)) {
+			busiest = other;
+			max = rq_nr_ready(other);
+		}
+	}
+	if (busiest == NULL) {
+		return;
+	}
+
+	task_t *task = rq_dequeue(busiest);
+	assert(task != NULL);
+	if (task->on_cpu) {
+		/*
+		woken up before it got off its cpu, that one still has to take the scheduler lock to switch away,
+		__schedule would spin on it with the lock held, leave it there
+		*/
+		rq_enqueue(busiest, task);
+		return;
+	}
+	if (task_policy(task) == TASK_POLICY_FAIR) {
+		// vruntimes of different cpus aren't comparable, keep the lag behind the old queue
+		uint64_t lag = (task->vruntime > busiest->fair.min_vruntime) ? task->vruntime - busiest->fair.min_vruntime : 0;
+		task->vruntime = rq->fair.min_vruntime + lag;
+	}
+	task->cpu = rq_cpu(rq)->id;
+	rq_enqueue(rq, task);
+}
+
+/* take a ready task off rq, from the tree or whichever priority array it's in */
+static void rq_remove(cpu_rq_t *rq, task_t *task) {
+	assert(task->state == TASK_STATE_READY);
+	if (task->queue == NULL) {
+		rbtree_remove(&rq->fair.tree, &task->run_node);
+		rq->fair.nr_tasks--;
+		rq->fair.load -= task->weight;
+		return;
+	}
+
+	for (unsigned int i = 0; i < 2; i++) {
+		runqueue_t *runqueue = &rq->runqueues[i];
+		if ((task->queue >= &runqueue->queues[0]) && (task->queue < &runqueue->queues[TASK_PRIORITIES])) {
+			unsigned int priority = (unsigned int)(task->queue - &runqueue->queues[0]);
+			task_queue_remove(task);
+			if (runqueue->queues[priority].first == NULL) {
+				runqueue->bitmap[priority / 32] &= ~(1u << (priority % 32));
+			}
+			runqueue->nr_tasks--;
+			return;
+		}
+	}
+	assert_panic(0 && "ready task not on its run queue");
+}
+
+/*
+set the rank task inherited and reschedule it accordingly, with the scheduler locked
+a boost only makes a running task more urgent, another cpu doesn't need to be interrupted for it
+*/
+static void task_pi_set(task_t *task, unsigned int rank) {
+	if (task->pi_rank == rank) {
+		return;
+	}
+
+	cpu_rq_t *rq = &cpu_rqs[task->cpu];
+	enum task_policy old_policy = task_policy(task);
+	bool queued = (task->state == TASK_STATE_READY);
+	if (queued) {
+		rq_remove(rq, task);
+	} else if (task == current_task) {
+		task_account(rq, task);
+	}
+
+	task->pi_rank = rank;
+	task->priority = task_effective_priority(task);
+	task->weight = fair_weight(task);
+	if (task_policy(task) != old_policy) {
+		if (task_policy(task) == TASK_POLICY_FAIR) {
+			task->vruntime = rq->fair.min_vruntime;
+		} else {
+			task->timeslice = task_timeslice(task);
+		}
+	}
+
+	if (queued) {
+		rq_enqueue(rq, task);
+	} else if (task == current_task) {
+		schedule();
+	}
+}
+
+/* where __restore_task saves the esp of a task that's never coming back */
+static uint32_t restore_no_prev_esp;
+static volatile bool restore_no_prev;
+
+/*
+the tss only matters for interrupts coming from ring 3,
+kernel tasks and switches back to the same process don't need to update it
+*/
+static inline void task_load_kstack(cpu_t *cpu, task_t *task) {
+	if ((task->type != TASK_TYPE_KTASK) && (cpu->tss->esp0 != task->kstack)) {
+		tss_set_kstack(task->kstack);
+	}
+}
+
+/*
+switch to task for good, prev (if any) is terminated or was never a task
+the kernel always runs on kernel_directory, the page directory is switched on the way back to ring 3 (see return_to_regs)
+*/
+__attribute__((noreturn)) static void __restore_task(task_t *task, task_t *prev) {
 	assert_interrupts_disabled();
-	assert_panic(scheduler_lock_count == 0);
-
-	tss_set_kstack(task->kstack);
-
-	uint32_t esp = task->esp;
-	uint32_t ebp = task->ebp;
-	uint32_t eip = task->eip;
-
-	__asm__ __volatile__ (
-		"mov %0, %%ebx\n"
-		"mov %1, %%esp\n"
-		"mov %2, %%ebp\n"
-		"mov $0, %%eax\n"
-		"jmp *%%ebx"
-		:
-		: "r" (eip), "r" (esp), "r" (ebp)
-		: "ebx", "esp", "eax");
+	cpu_t *cpu = this_cpu();
+	assert_panic(cpu->preempt_count == 0);
+
+	task_load_kstack(cpu, task);
+	if (prev != NULL) {
+		fpu_switch(cpu, prev);
+		switch_context(&prev->esp, task->esp, &prev->on_cpu);
+	} else {
+		switch_context(&restore_no_prev_esp, task->esp, &restore_no_prev);
+	}
+	assert_panic(0);
 #ifndef __TINYC__
 	__builtin_unreachable();
 #endif
@@ -147,201 +741,354 @@ __attribute__((noreturn)) static void __restore_task(task_t *task) {
 /* switch task and return when scheduled again
  * XXX: does not add the task to the ready queue
  * XXX: only call with interrupts off
- * XXX: don't call directly, use call_switch_task(void *);
- * TODO: rewrite partially in assembly
  */
-__attribute__((used)) void switch_task(task_t *new_task) {
+static void switch_task(task_t *new_task) {
 	assert_interrupts_disabled();
-	assert_panic(current_task != NULL);
+	cpu_t *cpu = this_cpu();
+	task_t *prev = cpu->current;
+	assert_panic(prev != NULL);
 	assert_panic(new_task != NULL);
-	assert_panic(scheduler_lock_count == 0);
+	assert_panic(cpu->preempt_count == 0);
+	assert_panic(new_task->state == TASK_STATE_RUNNING);
 
-	uint32_t esp, ebp;
-	__asm__ __volatile__("mov %%esp, %0\n"
-	                     "mov %%ebp, %1\n" : "=r"(esp), "=r"(ebp));
-	uint32_t eip = read_eip();
-	if (eip == 0) {
-		return;
+	fpu_switch(cpu, prev);
+	cpu->current = new_task;
+	task_load_kstack(cpu, new_task);
+	switch_context(&prev->esp, new_task->esp, &prev->on_cpu);
+}
+
+/*
+free what terminated tasks left behind, their stacks go back to the kstack cache
+XXX: only call with interrupts disabled and never on the stack of a terminated task
+*/
+static void task_reap(cpu_rq_t *rq) {
+	assert_interrupts_disabled();
+
+	task_t *task;
+	while ((task = task_dequeue(&rq->terminated)) != NULL) {
+		assert(task->state == TASK_STATE_TERMINATED);
+		fpu_task_free(task);
+		if (task->type == TASK_TYPE_KTASK) {
+			ktask_destroy(task->obj);
+		} else {
+			// the process_t stays around until its parent collects the exit status
+			task_kstack_free(task);
+		}
 	}
-	current_task->esp = esp;
-	current_task->ebp = ebp;
-	current_task->eip = eip;
+}
 
-	assert_panic(new_task->state == TASK_STATE_RUNNING);
-	current_task = new_task;
-	__restore_task(new_task);
+/*
+stop the periodic tick until the first sleeper is due, timer_periodic() brings it back
+as soon as there is a second task to share the cpu with
+XXX: the pit only interrupts the bootstrap processor, only call there
+*/
+static void scheduler_tickless(void) {
+	assert_interrupts_disabled();
+	assert(this_cpu()->id == 0);
+	timer_oneshot((wait_queue != NULL) ? wait_queue->wait_target : UINT64_MAX);
 }
 
 static void __schedule(void) {
 	assert_interrupts_disabled();
-	assert_panic(scheduler_lock_count == 0);
-	assert(current_task != NULL);
+	cpu_t *cpu = this_cpu();
+	assert_panic(cpu->preempt_count == 0);
 
-	if (current_task == NULL) {
-		/*
-		 * Worst Case: we are already idleing somewhere, __schedule() shouldn't have been called, this is a serious bug
-		 * Solution: just panic
-		 */
-		assert_panic(0);
-	}
+	arch_spin_lock(sched_spinlock);
+	cpu_rq_t *rq = &cpu_rqs[cpu->id];
+	task_t *prev = cpu->current;
+	assert_panic(prev != NULL);
 
-	task_t *next_task = task_dequeue(&ready_queue);
-	if (next_task == NULL) { /* no task waiting for cpu time */
-		if (current_task->state == TASK_STATE_RUNNING) {
-			/*
-			 * 1. Case: we're the only task running, keep running
-			 */
-			next_task = current_task;
-		} else {
+	task_account(rq, prev);
+
+	bool preempted = (prev->state == TASK_STATE_RUNNING);
+	if (preempted) {
+		if (!task_preempt_check(rq, prev)) {
 			/*
-			 * 2. Case: Current task blocked and we have nothing else to do, idle and wait for a task to wakeup
+			 * 1. Case: time slice left and nothing more important to run, keep running
 			 */
+			arch_spin_unlock(sched_spinlock);
+			task_reap(rq);
+			return;
+		}
 
-			/* XXX: idleing is marked by current_task = NULL */
-			task_t *task = current_task;
-			current_task = NULL;
-			/* XXX: scheduler_lock_count > 0 to prevent __schedule from being called while idleing */
-			scheduler_lock_count++;
-
-			do {
-				interrupts_enable();
-				__asm__ __volatile__("hlt");
-				interrupts_disable(); //XXX: need to be disabled for while check below
-			} while (ready_queue.first == NULL);
-
-			if (postponed_schedule) {
-				/* XXX: if a task tried to schedule while we were idleing, ensure we don't immidieatly try to schedule again */
-				postponed_schedule = false;
-			}
-
-			current_task = task;
-			scheduler_lock_count--;
-			assert_panic(scheduler_lock_count == 0); // sanity check
+		/* preempted, by a higher priority task or because its time slice is over, the idle task is never queued */
+		if (prev == cpu->idle_task) {
+			// XXX: stays TASK_STATE_RUNNING
+		} else if (prev->timeslice == 0) {
+			prev->ready_start = (uint32_t)prev->exec_start;
+			task_expire(rq, prev);
+		} else {
+			prev->ready_start = (uint32_t)prev->exec_start;
+			rq_enqueue(rq, prev);
+		}
+	}
 
-			next_task = task_dequeue(&ready_queue);
-			assert_panic(next_task != NULL);
+	/*
+	 * 2. Case: nothing else to do, the idle task runs until something is queued on this cpu
+	 */
+	task_t *next = rq_dequeue(rq);
+	if (next == NULL) {
+		next = cpu->idle_task;
+	}
+	assert((next == cpu->idle_task) || (next->state == TASK_STATE_READY)); // sanity check
+
+	/*
+	XXX: a task pulled over from another cpu might still be on its way out there, past the scheduler lock
+	(task_steal leaves tasks alone that still need it)
+	*/
+	while ((next != prev) && next->on_cpu) {
+		cpu_relax();
+	}
 
-			if (current_task == next_task) {
-				/*
-				 * XXX: we're already in the current task so we don't need to change context, so we only fake it
-				 * this keeps the sanity checks a few lines down happy
-				 */
-				assert(current_task->state == TASK_STATE_READY);
-				current_task->state = TASK_STATE_RUNNING;
-			}
+	next->state = TASK_STATE_RUNNING;
+	next->exec_start = timer_now();
+	next->cputime_start = (uint32_t)next->exec_start;
+	next->cpu = cpu->id;
+	if (next != cpu->idle_task) {
+		int32_t waited = (int32_t)(next->cputime_start - next->ready_start);
+		if (waited > 0) {
+			next->wait_time += (uint32_t)waited;
 		}
 	}
 
-	if (current_task != next_task) {
-		/* we need to switch context */
-		assert(next_task->state == TASK_STATE_READY); // sanity check
+	if (next == prev) {
+		arch_spin_unlock(sched_spinlock);
+		task_reap(rq);
+		return;
+	}
 
-		if (current_task->state == TASK_STATE_RUNNING) {
-			/* Case 1: current task got preempted */
-			current_task->state = TASK_STATE_READY;
-			task_queue(&ready_queue, current_task);
-		} else if (current_task->state == TASK_STATE_TERMINATED) {
-			/* Case 2: current task is terminating */
-			printf("%s: terminating task %p\n", __func__, current_task);
-			next_task->state = TASK_STATE_RUNNING;
-			current_task = next_task;
-			__restore_task(current_task);
-			/* __restore_task should not return */
-			assert_panic(0);
-		} else {
-			/* Case 3: current task blocked voluntarily, no need to do anything */
-		}
+	if (preempted) {
+		prev->nivcsw++;
+	} else {
+		prev->nvcsw++;
+	}
 
-		/* perform the actual context switch */
-		next_task->state = TASK_STATE_RUNNING;
-		call_switch_task(next_task);
+	next->on_cpu = true;
+	if (prev->state == TASK_STATE_TERMINATED) {
+		/* prev is terminating, we're still on its stack, task_reap frees it once another task runs */
+		task_queue(&rq->terminated, prev);
+		cpu->current = next;
+		arch_spin_unlock(sched_spinlock);
+		__restore_task(next, prev);
+		/* __restore_task should not return */
+		assert_panic(0);
 	}
+	arch_spin_unlock(sched_spinlock);
 
+	/* perform the actual context switch, prev is either queued again or blocked */
+	switch_task(next);
+
+	/* scheduled again, possibly on another cpu */
 	assert(current_task->state == TASK_STATE_RUNNING); // sanity check
+	task_reap(this_rq());
 }
 
-void scheduler_lock(void) {
+void preempt_disable(void) {
 	uint32_t eflags; (void)eflags;
 	__asm__ __volatile__ ("pushf\n"
 	                      "pop %0\n"
 	                      : "=r"(eflags));
 	interrupts_disable();
-	if (scheduler_lock_count == 0) {
-		if (postponed_schedule) {
+	cpu_t *cpu = this_cpu();
+	if (cpu->preempt_count == 0) {
+		if (cpu->postponed_schedule) {
 			assert_panic(0);
 		}
 
 		if (eflags & (1<<9)) {
 			// XXX: interrupts where enabled when called, enable them on exit too
-			enable_ints = true;
+			cpu->enable_ints = true;
 		}
 	}
-	scheduler_lock_count++;
+	cpu->preempt_count++;
 }
 
-void scheduler_unlock(void) {
+void preempt_enable(void) {
 	assert_interrupts_disabled();
-	assert_panic(scheduler_lock_count != 0);
-	scheduler_lock_count--;
-	if (scheduler_lock_count == 0) {
-		if ((scheduler_ready) && postponed_schedule) {
-			postponed_schedule = false;
+	cpu_t *cpu = this_cpu();
+	assert_panic(cpu->preempt_count != 0);
+	cpu->preempt_count--;
+	if (cpu->preempt_count == 0) {
+		// XXX: __schedule may return on another cpu, keep the flag with the task
+		bool enable_ints = cpu->enable_ints;
+		cpu->enable_ints = false;
+		if ((scheduler_ready) && cpu->postponed_schedule) {
+			cpu->postponed_schedule = false;
 			__schedule();
 		}
 		if (enable_ints) {
-			enable_ints = false;
 			interrupts_enable();
 		}
 	}
 }
 
+void scheduler_lock(void) {
+	preempt_disable();
+	cpu_t *cpu = this_cpu();
+	if (cpu->sched_lock_depth++ == 0) {
+		arch_spin_lock(sched_spinlock);
+	}
+}
+
+void scheduler_unlock(void) {
+	cpu_t *cpu = this_cpu();
+	assert_panic(cpu->sched_lock_depth != 0);
+	if (--cpu->sched_lock_depth == 0) {
+		arch_spin_unlock(sched_spinlock);
+	}
+	preempt_enable();
+}
+
 /*
  * XXX: only call with schedule_lock()
  * TODO: remove, it's kinda useless
  */
 void schedule(void) {
 	assert_interrupts_disabled();
-	assert(scheduler_lock_count != 0);
+	assert(this_cpu()->preempt_count != 0);
 	assert(scheduler_ready);
 
-	postponed_schedule = true;
+	this_cpu()->postponed_schedule = true;
 }
 
 void yield(void) {
 	scheduler_lock();
+	// give up the rest of the time slice too, equal priorities take turns
+	current_task->timeslice = 0;
 	schedule();
 	scheduler_unlock();
 }
 
+bool preemptible(void) {
+	uint32_t eflags;
+	__asm__ __volatile__ ("pushf\n"
+	                      "pop %0\n"
+	                      : "=r"(eflags));
+	return (eflags & (1<<9)) && (this_cpu()->preempt_count == 0);
+}
+
+/*
+task sleep helpers
+wait_queue is kept sorted by wait_target, so the timer only ever looks at the tasks that are due
+(plus the first one that isn't) instead of walking every sleeping task on each tick
+the O(n) insert happens once per sleep in the context of the sleeping task
+it has its own links, a task blocked with a timeout is on its blocking queue at the same time
+*/
+static void wait_queue_insert(task_t *task) {
+	assert_interrupts_disabled();
+	assert(!task->timer_pending);
+
+	task_t *prev = NULL;
+	task_t *next = wait_queue;
+	// equal targets keep fifo order
+	while ((next != NULL) && (next->wait_target <= task->wait_target)) {
+		prev = next;
+		next = next->timer_next;
+	}
+
+	task->timer_pending = true;
+	task->timer_prev = prev;
+	task->timer_next = next;
+	if (prev == NULL) {
+		wait_queue = task;
+		if (this_cpu()->id != 0) {
+			// the new first sleeper, the pit of the bootstrap processor might be in one-shot mode for a later one
+			smp_send_reschedule(&cpus[0]);
+		}
+	} else {
+		prev->timer_next = task;
+	}
+	if (next != NULL) {
+		next->timer_prev = task;
+	}
+}
+
+static void wait_queue_remove(task_t *task) {
+	assert_interrupts_disabled();
+	assert(task->timer_pending);
+
+	if (task->timer_prev == NULL) {
+		assert(wait_queue == task);
+		wait_queue = task->timer_next;
+	} else {
+		task->timer_prev->timer_next = task->timer_next;
+	}
+	if (task->timer_next != NULL) {
+		task->timer_next->timer_prev = task->timer_prev;
+	}
+
+	task->timer_next = NULL;
+	task->timer_prev = NULL;
+	task->timer_pending = false;
+}
+
 /* task blocking helpers */
 static void __task_block(task_queue_t *queue, task_t *task, unsigned int reason) {
-	assert_panic(scheduler_lock_count != 0);
+	assert_panic(this_cpu()->sched_lock_depth != 0);
 	assert_interrupts_disabled();
 	assert_panic(task != NULL);
 	assert_panic(queue != NULL);
 
 	task->state = reason;
+	task->sleep_start = timer_ticks;
+	task->timed_out = false;
 	task_queue(queue, task);
-	list_insert(&blocked_list, task);
 }
 
+/* XXX: with the scheduler already locked by the caller the task only blocks once that is unlocked */
 void task_block(task_queue_t *queue, unsigned int reason) {
 	assert(queue != NULL);
 	scheduler_lock();
-	assert_panic(scheduler_lock_count == 1);
 	__task_block(queue, current_task, reason);
 	schedule();
 	scheduler_unlock();
 }
 
+/* XXX: same as task_block, check current_task->timed_out once the scheduler is unlocked */
+void task_block_timeout(task_queue_t *queue, unsigned int reason, uint64_t target) {
+	assert(queue != NULL);
+	scheduler_lock();
+	task_t *task = current_task;
+	__task_block(queue, task, reason);
+	task->wait_target = target;
+	wait_queue_insert(task);
+	schedule();
+	scheduler_unlock();
+}
+
+/* credit the time task spent blocked or sleeping to its interactivity */
+static void task_wakeup(task_t *task) {
+	uint64_t slept = timer_ticks - task->sleep_start;
+	if (slept >= TASK_MAX_SLEEP_AVG - task->sleep_avg) {
+		task->sleep_avg = TASK_MAX_SLEEP_AVG;
+	} else {
+		task->sleep_avg += (unsigned int)slept;
+	}
+	task->priority = task_effective_priority(task);
+
+	if (task_policy(task) == TASK_POLICY_FAIR) {
+		// sleeper fairness: a bit of credit for the wakeup latency, but no more
+		fair_queue_t *fair = &cpu_rqs[task->cpu].fair;
+		uint64_t floor = (fair->min_vruntime > FAIR_SLEEPER_CREDIT) ? fair->min_vruntime - FAIR_SLEEPER_CREDIT : 0;
+		if (task->vruntime < floor) {
+			task->vruntime = floor;
+		}
+	}
+	task_ready(task);
+}
+
+/* task is already off its queue, cancel its timeout (if any) and make it runnable */
 static void __task_unblock(task_t *task) {
-	assert_panic(scheduler_lock_count != 0);
+	assert_panic(this_cpu()->sched_lock_depth != 0);
 	assert_interrupts_disabled();
 	assert_panic(task != NULL);
 
-	task->state = TASK_STATE_READY;
-	task_queue(&ready_queue, task);
-	list_remove(&blocked_list, task);
+	assert(task->queue == NULL);
+	if (task->timer_pending) {
+		wait_queue_remove(task);
+	}
+	task->wait_target = 0;
+	task_wakeup(task);
 }
 
 void task_unblock_next(task_queue_t *queue) {
@@ -355,41 +1102,93 @@ void task_unblock_next(task_queue_t *queue) {
 	scheduler_unlock();
 }
 
-/* task sleep helpers */
-// TODO: implement sleep delta list https://wiki.osdev.org/Blocking_Process
+void task_unblock(task_t *task) {
+	assert(task != NULL);
+	scheduler_lock();
+	assert(task->queue != NULL);
+	task_queue_remove(task);
+	__task_unblock(task);
+	schedule();
+	scheduler_unlock();
+}
+
+/* move a blocked task over to another queue, it keeps its timeout */
+void task_requeue(task_t *task, task_queue_t *queue) {
+	assert(task != NULL);
+	assert(queue != NULL);
+	scheduler_lock();
+	assert(task->queue != NULL);
+	task_queue_remove(task);
+	task_queue(queue, task);
+	scheduler_unlock();
+}
+
+static void __task_sleep(uint64_t target) {
+	scheduler_lock();
+	assert_panic(this_cpu()->sched_lock_depth == 1);
+	task_t *task = current_task;
+	assert_panic(task != NULL);
+	assert_panic(task->state == TASK_STATE_RUNNING);
+
+	task->state = TASK_STATE_WAITING;
+	task->wait_target = target;
+	task->sleep_start = timer_ticks;
+	wait_queue_insert(task);
+
+	schedule();
+	scheduler_unlock();
+}
+
 void task_sleep_until(uint64_t target) {
 	printf("%s: task %p sleeping until %u\n", __func__, current_task, (unsigned int)target);
 
-	if (target <= timer_ticks) {
+	if (target <= timer_now()) {
 		return;
 	}
 
-	scheduler_lock();
-	assert_panic(scheduler_lock_count == 1);
-	assert_panic(current_task != NULL);
-	assert_panic(current_task->state == TASK_STATE_RUNNING);
+	__task_sleep(target);
+}
 
-	current_task->state = TASK_STATE_WAITING;
-	current_task->wait_target = target;
+void task_sleep_miliseconds(uint64_t time) {
+	__task_sleep(timer_now() + time);
+}
 
-	task_queue(&wait_queue, current_task);
+/* charge the running task for the last tick, XXX: with the scheduler locked */
+static void __scheduler_tick(void) {
+	cpu_t *cpu = this_cpu();
+	task_t *task = cpu->current;
+	if ((task != NULL) && (task != cpu->idle_task) && (task->state == TASK_STATE_RUNNING)) {
+		cpu_rq_t *rq = &cpu_rqs[cpu->id];
+		task_account(rq, task);
+		if (task->sleep_avg > 0) {
+			task->sleep_avg--;
+		}
+		if (task->timeslice > 0) {
+			task->timeslice--;
+		}
 
+		if ((cpu->id == 0) && (rq_nr_ready(rq) == 0)) {
+			// a single runnable task, there is nothing to preempt it for
+			scheduler_tickless();
+		}
+	}
+	// XXX: __schedule only switches if the time slice is over or a higher priority task is ready
 	schedule();
-	scheduler_unlock();
 }
 
-void task_sleep_miliseconds(uint64_t time) {
+/* the local apic timer of the application processors */
+void scheduler_tick(void) {
+	if (!scheduler_ready) {
+		return;
+	}
+
 	scheduler_lock();
-	assert(scheduler_lock_count == 1);
-	assert(current_task != NULL);
-	current_task->wait_target = timer_ticks + time;
-	__task_block(&wait_queue, current_task, TASK_STATE_WAITING);
-	schedule();
+	__scheduler_tick();
 	scheduler_unlock();
 }
 
 /*
- * scheduler_wakeup is called by a timer to wake up sleeping tasks
+ * scheduler_wakeup is called by the pit (on the bootstrap processor) to wake up sleeping tasks
  * and to preempt the current running task if needed
  */
 void scheduler_wakeup(void) {
@@ -399,24 +1198,17 @@ void scheduler_wakeup(void) {
 
 	scheduler_lock();
 
-	task_t *task = wait_queue.first;
-	wait_queue.first = NULL;
-	wait_queue.last = NULL;
-	while (task != NULL) {
-		task_t *next_task = task->next_task;
-		task->next_task = NULL;
-		if (task->wait_target <= timer_ticks) {
-			printf("%s: wakeup %p\n", __func__, task);
-			task->wait_target = 0;
-			__task_unblock(task);
-		} else {
-			// XXX: put the task back
-			task_queue(&wait_queue, task);
+	task_t *task;
+	while (((task = wait_queue) != NULL) && (task->wait_target <= timer_ticks)) {
+		if (task->queue != NULL) {
+			// blocked with a timeout
+			task_queue_remove(task);
+			task->timed_out = true;
 		}
-		task = next_task;
+		__task_unblock(task);
 	}
-	schedule();
 
+	__scheduler_tick();
 	scheduler_unlock();
 }
 
@@ -434,7 +1226,7 @@ void semaphore_acquire(semaphore_t *semaphore) {
 		scheduler_unlock();
 	}
 	// XXX: if we don't schedule after spin_unlock we might return without acquireing
-	assert(scheduler_lock_count == 1);
+	assert(this_cpu()->preempt_count == 1);
 	spin_unlock(semaphore->lock);
 	return;
 }
@@ -454,51 +1246,325 @@ void semaphore_release(semaphore_t *semaphore) {
 	return;
 }
 
-/* mutex_t helpers */
+/*
+mutex_t helpers
+the lock word is the owner, taken with a compare and exchange, the blocked tasks and the
+priority inheritance links only change with the scheduler locked, an unlock on another cpu
+can't miss a task that is about to block
+*/
+
+// owner of mutexes locked where no task runs yet (early boot), those never block
+#define MUTEX_NO_TASK ((task_t *)1)
+// how long a contended mutex_lock spins before blocking, in pause instructions
+#define MUTEX_SPIN_MAX 1000
+// how far a blocking task boosts along a chain of owners, also ends deadlock cycles
+#define MUTEX_PI_MAX_DEPTH 16
+
+static inline task_t *mutex_self(void) {
+	task_t *task = current_task;
+	return (task != NULL) ? task : MUTEX_NO_TASK;
+}
+
+static inline bool mutex_trylock_as(mutex_t *mutex, task_t *task) {
+	return arch_atomic_cmpxchg((volatile uint32_t *)&mutex->owner, 0, (uint32_t)task) == 0;
+}
+
+/*
+spin while the owner runs on another cpu, it's likely to unlock before a block and wake up would be done
+XXX: the owner can't go away while it holds the lock, but it may have unlocked by the time we look
+*/
+static bool mutex_spin(mutex_t *mutex, task_t *self) {
+	if (smp_num_cpus == 1) {
+		return false;
+	}
+	for (unsigned int i = 0; i < MUTEX_SPIN_MAX; i++) {
+		task_t *owner = mutex->owner;
+		if (owner == NULL) {
+			if (mutex_trylock_as(mutex, self)) {
+				return true;
+			}
+			continue;
+		} else if ((owner == MUTEX_NO_TASK) || (owner == self) || !owner->on_cpu) {
+			// blocked or preempted
+			return false;
+		}
+		cpu_relax();
+	}
+	return false;
+}
+
+/* the most urgent blocked task, the longest waiting one if there are several */
+static task_t *mutex_top_waiter(mutex_t *mutex) {
+	task_t *top = NULL;
+	for (task_t *task = mutex->blocked_tasks.first; task != NULL; task = task->next_task) {
+		if ((top == NULL) || (task_rank(task) < task_rank(top))) {
+			top = task;
+		}
+	}
+	return top;
+}
+
+/* the rank task inherits from the tasks blocked on its mutexes */
+static unsigned int mutex_pi_rank(task_t *task) {
+	unsigned int rank = TASK_PI_NONE;
+	for (mutex_t *mutex = task->pi_mutexes; mutex != NULL; mutex = mutex->pi_next) {
+		task_t *top = mutex_top_waiter(mutex);
+		if ((top != NULL) && (task_rank(top) < rank)) {
+			rank = task_rank(top);
+		}
+	}
+	return rank;
+}
+
+static void mutex_pi_queue(mutex_t *mutex, task_t *owner) {
+	if (!mutex->pi_queued) {
+		mutex->pi_next = owner->pi_mutexes;
+		owner->pi_mutexes = mutex;
+		mutex->pi_queued = true;
+	}
+}
+
+static void mutex_pi_dequeue(mutex_t *mutex, task_t *owner) {
+	if (mutex->pi_queued) {
+		mutex_t **link = &owner->pi_mutexes;
+		while (*link != mutex) {
+			assert(*link != NULL);
+			link = &(*link)->pi_next;
+		}
+		*link = mutex->pi_next;
+		mutex->pi_next = NULL;
+		mutex->pi_queued = false;
+	}
+}
+
+/* task just blocked on mutex, lend its rank to the owner, and to the owner that one is blocked on ... */
+static void mutex_pi_boost(mutex_t *mutex, task_t *task) {
+	unsigned int rank = task_rank(task);
+	for (unsigned int depth = 0; (mutex != NULL) && (depth < MUTEX_PI_MAX_DEPTH); depth++) {
+		task_t *owner = mutex->owner;
+		if (owner == MUTEX_NO_TASK) {
+			return;
+		}
+		assert(owner != NULL);
+		mutex_pi_queue(mutex, owner);
+		if (task_rank(owner) <= rank) {
+			return;
+		}
+		task_pi_set(owner, rank);
+		mutex = owner->blocked_on;
+	}
+}
+
 void mutex_lock(mutex_t *mutex) {
-	int prev = arch_atomic_swap(mutex->lock, 1);
-	if (prev != 0) {
-		// XXX: wait to be woken up
-		scheduler_lock();
-		__task_block(&mutex->blocked_tasks, current_task, TASK_STATE_BLOCKED_LOCK);
-		schedule();
-		scheduler_unlock();
+	task_t *self = mutex_self();
+	bool contended = false;
+	if (!mutex_trylock_as(mutex, self)) {
+		contended = true;
+		bool can_block = task_can_block() && (self != MUTEX_NO_TASK);
+		if (!can_block) {
+			// XXX: irq handler or spin lock held, we can't block, wait for the owner on another cpu
+			do {
+				while (mutex->owner != NULL) {
+					cpu_relax();
+				}
+			} while (!mutex_trylock_as(mutex, self));
+		} else if (!mutex_spin(mutex, self)) {
+			scheduler_lock();
+			if (!mutex_trylock_as(mutex, self)) {
+				// XXX: wait to be woken up, mutex_unlock hands the lock over
+				__task_block(&mutex->blocked_tasks, self, TASK_STATE_BLOCKED_LOCK);
+				self->blocked_on = mutex;
+				mutex_pi_boost(mutex, self);
+				schedule();
+			}
+			scheduler_unlock();
+		}
+	}
+	assert(mutex->owner == self);
+
+	mutex->n_acquired++;
+	if (contended) {
+		mutex->n_contended++;
 	}
-	assert(mutex->locked_task == NULL);
-	mutex->locked_task = current_task;
 }
 
 void mutex_unlock(mutex_t *mutex) {
-	int prev = arch_atomic_swap(mutex->lock, 1);
-	assert(prev == 1);
-	assert(mutex->locked_task == current_task);
+	task_t *self = mutex_self();
+	assert(mutex->owner == self);
 
-	mutex->locked_task = NULL;
+	scheduler_lock();
+	task_t *next = mutex_top_waiter(mutex);
+	if (next == NULL) {
+		assert(!mutex->pi_queued);
+		mutex->owner = NULL;
+	} else {
+		// the lock stays taken, next owns it as soon as it's woken up
+		mutex_pi_dequeue(mutex, self);
+		task_queue_remove(next);
+		next->blocked_on = NULL;
+		mutex->owner = next;
+		if (mutex->blocked_tasks.first != NULL) {
+			// next inherits from the ones still waiting
+			mutex_pi_queue(mutex, next);
+			task_pi_set(next, mutex_pi_rank(next));
+		}
+		__task_unblock(next);
+		schedule();
+	}
 
-	if (mutex->blocked_tasks.first != NULL) {
-		task_unblock_next(&mutex->blocked_tasks);
+	// give back what was inherited through this mutex
+	if ((self != MUTEX_NO_TASK) && (self->pi_rank != TASK_PI_NONE)) {
+		task_pi_set(self, mutex_pi_rank(self));
+	}
+	scheduler_unlock();
+}
+
+/*
+rwlock_t helpers
+all state only changes with the scheduler locked, the unlocking task does the bookkeeping
+for the tasks it wakes up, so they return from blocking with the lock held
+*/
+void rwlock_read_lock(rwlock_t *rwlock) {
+	bool can_block = task_can_block();
+	scheduler_lock();
+	if ((rwlock->writer != NULL) || (rwlock->blocked_writers.first != NULL)) {
+		rwlock->n_contended++;
+		if (can_block) {
+			__task_block(&rwlock->blocked_readers, current_task, TASK_STATE_BLOCKED_LOCK);
+			schedule();
+			scheduler_unlock();
+			return;
+		}
+		// XXX: we can't block, wait for the writers on other cpus
+		do {
+			scheduler_unlock();
+			cpu_relax();
+			scheduler_lock();
+		} while ((rwlock->writer != NULL) || (rwlock->blocked_writers.first != NULL));
+	}
+	rwlock->readers++;
+	scheduler_unlock();
+}
+
+/* with the scheduler locked and the lock free, pass it on to whoever is blocked */
+static void rwlock_handoff(rwlock_t *rwlock, bool prefer_readers) {
+	assert((rwlock->readers == 0) && (rwlock->writer == NULL));
+	if (prefer_readers && (rwlock->blocked_readers.first != NULL)) {
+		while (rwlock->blocked_readers.first != NULL) {
+			rwlock->readers++;
+			task_unblock_next(&rwlock->blocked_readers);
+		}
+	} else if (rwlock->blocked_writers.first != NULL) {
+		rwlock->writer = rwlock->blocked_writers.first;
+		task_unblock_next(&rwlock->blocked_writers);
 	} else {
-		arch_atomic_swap(mutex->lock, 0);
+		while (rwlock->blocked_readers.first != NULL) {
+			rwlock->readers++;
+			task_unblock_next(&rwlock->blocked_readers);
+		}
 	}
 }
 
-/* other helpers */
-void _sleep(uint64_t delta) {
-	// TODO: FIXME: this shouldn't be used anywhere
-	uint64_t target = delta + timer_ticks;
-	while (target < timer_ticks) {
-		__asm__ __volatile__("hlt");
+void rwlock_read_unlock(rwlock_t *rwlock) {
+	scheduler_lock();
+	assert(rwlock->readers > 0);
+	assert(rwlock->writer == NULL);
+	if (--rwlock->readers == 0) {
+		rwlock_handoff(rwlock, false);
 	}
+	scheduler_unlock();
+}
+
+void rwlock_write_lock(rwlock_t *rwlock) {
+	bool can_block = task_can_block();
+	scheduler_lock();
+	if ((rwlock->writer != NULL) || (rwlock->readers != 0)) {
+		rwlock->n_contended++;
+		if (can_block) {
+			__task_block(&rwlock->blocked_writers, current_task, TASK_STATE_BLOCKED_LOCK);
+			schedule();
+			scheduler_unlock();
+			assert(rwlock->writer == current_task);
+			return;
+		}
+		do {
+			scheduler_unlock();
+			cpu_relax();
+			scheduler_lock();
+		} while ((rwlock->writer != NULL) || (rwlock->readers != 0));
+	}
+	// MUTEX_NO_TASK in early boot, NULL would look unlocked
+	rwlock->writer = mutex_self();
+	scheduler_unlock();
+}
+
+void rwlock_write_unlock(rwlock_t *rwlock) {
+	scheduler_lock();
+	assert(rwlock->writer == mutex_self());
+	assert(rwlock->readers == 0);
+	rwlock->writer = NULL;
+	// readers that queued up behind this writer go next, then the next writer
+	rwlock_handoff(rwlock, true);
+	scheduler_unlock();
+}
+
+/* other helpers */
+bool task_can_block(void) {
+	return scheduler_ready && preemptible();
 }
 
 void task_add(task_t *task) {
 	printf("%s(task: %p)\n", __func__, task);
 	assert(task != NULL);
 	assert(task->obj != NULL);
-	task->state = TASK_STATE_READY;
+	task->pi_rank = TASK_PI_NONE;
+	// new tasks start without a bonus or penalty
+	task->sleep_avg = TASK_MAX_SLEEP_AVG / 2;
+	task->priority = task_effective_priority(task);
+	task->timeslice = task_timeslice(task);
 
 	scheduler_lock();
-	task_queue(&ready_queue, task);
+	task->cpu = task_select_cpu();
+	// new fair tasks start level with the others
+	task->vruntime = cpu_rqs[task->cpu].fair.min_vruntime;
+	task_ready(task);
+	scheduler_unlock();
+}
+
+void task_set_nice(task_t *task, int nice) {
+	assert(task != NULL);
+	if (nice < TASK_NICE_MIN) {
+		nice = TASK_NICE_MIN;
+	} else if (nice > TASK_NICE_MAX) {
+		nice = TASK_NICE_MAX;
+	}
+
+	// XXX: a queued task keeps its place until it runs again, no need to move it
+	scheduler_lock();
+	task->nice = nice;
+	if (task == current_task) {
+		task_account(this_rq(), task);
+		task->priority = task_effective_priority(task);
+		task->weight = fair_weight(task);
+		schedule();
+	}
+	scheduler_unlock();
+}
+
+void task_set_policy(task_t *task, enum task_policy policy) {
+	assert(task == current_task);
+
+	scheduler_lock();
+	task_account(this_rq(), task);
+	task->policy = policy;
+	if (task_policy(task) == TASK_POLICY_FAIR) {
+		task->vruntime = this_rq()->fair.min_vruntime;
+		task->weight = fair_weight(task);
+	} else {
+		task->priority = task_effective_priority(task);
+		task->timeslice = task_timeslice(task);
+	}
+	schedule();
 	scheduler_unlock();
 }
 
@@ -508,19 +1574,20 @@ this has the following tasks:
  add to terminated tasks list
  awake parent / reaper (if blocked on waitpid)
 
-parent / reaper / cleaner:
- free kstack, etc...
-TODO: ktask reaper / cleaner / parent
+the kstack (and for ktasks everything else) is released by task_reap after the switch
 */
 __attribute__((noreturn)) void task_exit(void) {
-	printf("%s: task: %p\n", __func__, current_task);
-	assert(scheduler_lock_count == 1); // XXX: this might even work ...
+	cpu_t *cpu = this_cpu();
+	assert(cpu->sched_lock_depth == 1); // XXX: this might even work ...
 	assert(current_task->state == TASK_STATE_RUNNING);
 	current_task->state = TASK_STATE_TERMINATED;
 
-	scheduler_lock_count--;
-	assert_panic(scheduler_lock_count == 0);
-	postponed_schedule = false;
+	cpu->sched_lock_depth = 0;
+	arch_spin_unlock(sched_spinlock);
+	cpu->preempt_count--;
+	assert_panic(cpu->preempt_count == 0);
+	cpu->postponed_schedule = false;
+	cpu->enable_ints = false;
 	__schedule();
 
 #ifndef __TINYC__
@@ -528,16 +1595,115 @@ __attribute__((noreturn)) void task_exit(void) {
 #endif
 }
 
+/*
+idle tasks, one per cpu, they are never queued and only run when the run queue of their cpu is empty
+they look for work on the other cpus and otherwise halt until the next interrupt
+*/
+static unsigned int task_idle(const char *name, void *extra) {
+	(void)name;
+	cpu_t *cpu = extra;
+	assert(cpu == this_cpu());
+
+	interrupts_disable();
+	while (1) {
+		scheduler_lock();
+		cpu_rq_t *rq = this_rq();
+		if (rq_nr_ready(rq) == 0) {
+			task_steal(rq);
+		}
+
+		bool idle = (rq_nr_ready(rq) == 0);
+		if (!idle) {
+			if (cpu->id == 0) {
+				// stolen tasks don't go through task_ready, the pit might still be in one-shot mode
+				timer_periodic();
+			}
+			schedule();
+		} else if (cpu->id == 0) {
+			/* XXX: no periodic tick while idleing, only wake up for the next sleeper (or any other irq) */
+			scheduler_tickless();
+		} else {
+			lapic_timer_stop();
+		}
+		scheduler_unlock();
+
+		if (idle) {
+			uint64_t start = timer_now();
+			uint32_t switches = cpu->idle_task->nivcsw;
+			// XXX: sti only takes effect after the next instruction, nothing can sneak in before the hlt
+			__asm__ __volatile__ ("sti\nhlt\ncli");
+			if (cpu->idle_task->nivcsw != switches) {
+				// the irq woke something up that ran in between, only count from when we got the cpu back
+				start = cpu->idle_task->exec_start;
+			}
+			// XXX: includes the time spent in the irq handler that ended the hlt
+			cpu->idle_time += timer_now() - start;
+			if (cpu->id != 0) {
+				lapic_timer_start();
+			}
+		}
+	}
+	return 0;
+}
+
+void task_idle_init(cpu_t *cpu) {
+	char name[] = "idle0";
+	name[4] = (char)('0' + cpu->id);
+
+	ktask_t *ktask = ktask_create(task_idle, name, cpu);
+	task_t *task = &ktask->task;
+	task->policy = TASK_POLICY_PRIORITY;
+	task->nice = TASK_NICE_MAX;
+	task->pi_rank = TASK_PI_NONE;
+	task->priority = TASK_PRIORITIES - 1;
+	task->state = TASK_STATE_RUNNING;
+	task->cpu = cpu->id;
+	cpu->idle_task = task;
+}
+
+/* start running the first task on cpu, with the scheduler locked */
+__attribute__((noreturn)) static void tasking_start(cpu_t *cpu) {
+	cpu_rq_t *rq = &cpu_rqs[cpu->id];
+	task_t *task = rq_dequeue(rq);
+	if (task == NULL) {
+		task = cpu->idle_task;
+	}
+	task->state = TASK_STATE_RUNNING;
+	task->exec_start = timer_now();
+	task->cpu = cpu->id;
+	task->on_cpu = true;
+	cpu->current = task;
+	arch_spin_unlock(sched_spinlock);
+	__restore_task(task, NULL);
+}
+
 __attribute__((noreturn)) void tasking_enable(void) {
 	printf("%s()\n", __func__);
 	interrupts_disable();
+	cpu_t *cpu = this_cpu();
+	assert(cpu->id == 0);
+	assert(cpu->current == NULL);
+	assert(cpu->preempt_count == 0);
+	if (cpu->idle_task == NULL) {
+		task_idle_init(cpu);
+	}
+
+	arch_spin_lock(sched_spinlock);
 	assert(scheduler_ready == false);
 	scheduler_ready = true;
-	assert(current_task == NULL);
-	current_task = task_dequeue(&ready_queue);
-	assert(current_task != NULL);
-	assert(current_task->state == TASK_STATE_READY);
-	current_task->state = TASK_STATE_RUNNING;
-	assert(scheduler_lock_count == 0);
-	__restore_task(current_task);
+	tasking_start(cpu);
+}
+
+/* the application processors wait here until the bootstrap processor is done with kmain */
+__attribute__((noreturn)) void tasking_enable_ap(void) {
+	interrupts_disable();
+	cpu_t *cpu = this_cpu();
+	assert(cpu->idle_task != NULL);
+	while (!*(volatile bool *)&scheduler_ready) {
+		cpu_relax();
+	}
+
+	lapic_timer_start();
+	arch_spin_lock(sched_spinlock);
+	tasking_start(cpu);
 }
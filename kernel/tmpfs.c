@@ -4,6 +4,7 @@
 #include <fs.h>
 #include <heap.h>
 #include <list.h>
+#include <slab.h>
 #include <string.h>
 
 /**
@@ -28,8 +29,10 @@ static int tmpfs_unlink (fs_node_t *node, char *name);
 static void tmpfs_mkdir(fs_node_t *node, char *name, uint16_t permissions);
 static void tmpfs_create (fs_node_t *node, char *name, uint16_t permissions);
 
+static kmem_cache_t tmpfs_object_cache = KMEM_CACHE_INIT("tmpfs_object", struct tmpfs_object, NULL);
+
 static struct tmpfs_object *tmpfs_create_obj(char *name, enum fs_node_flags flags) {
-	struct tmpfs_object *obj = kcalloc(1, sizeof(struct tmpfs_object));
+	struct tmpfs_object *obj = kmem_cache_alloc(&tmpfs_object_cache);
 	assert(obj != NULL);
 	obj->flags = flags;
 	obj->name = strndup(name, strlen(name));
@@ -59,7 +62,7 @@ static void tmpfs_destroy_object(struct tmpfs_object *obj) {
 		assert(obj->childs->length == 0);
 		list_free(obj->childs);
 	}
-	kfree(obj);
+	kmem_cache_free(&tmpfs_object_cache, obj);
 }
 
 static fs_node_t *fs_node_from_tmpfs(struct tmpfs_object *tmpfs_obj) {
@@ -123,8 +126,16 @@ static uint32_t tmpfs_write(fs_node_t *node, uint32_t offset, uint32_t size, voi
 		(void)offset; (void)size; (void)buf;
 		const size_t size_req = offset + size;
 		if (size_req > obj->block_size) {
-			obj->block = krealloc(obj->block, size_req);
-			assert(obj->block != NULL);
+			const size_t capacity = (obj->block != NULL) ? kmalloc_usable_size(obj->block) : 0;
+			if (size_req > capacity) {
+				// grow geometrically, appending is amortised O(1)
+				obj->block = krealloc(obj->block, (size_req > 2 * capacity) ? size_req : 2 * capacity);
+				assert(obj->block != NULL);
+			}
+			if (offset > obj->block_size) {
+				// writing past the end leaves a hole of zeroes
+				memset((void *)(((uintptr_t)obj->block) + obj->block_size), 0, offset - obj->block_size);
+			}
 			obj->block_size = size_req;
 		} else {
 			assert(obj->block != NULL);
@@ -159,14 +170,14 @@ static struct dirent *tmpfs_readdir(fs_node_t *node, uint32_t i) {
 	assert(node->object != NULL);
 	struct tmpfs_object *obj = (struct tmpfs_object *)node->object;
 	if (i == 0) {
-		struct dirent *v = kcalloc(1, sizeof(struct dirent));
+		struct dirent *v = fs_dirent_new();
 		assert(v != NULL);
 		v->ino = i;
 		strncpy(v->name, ".", 255);
 		return v;
 	}
 	if (i == 1) {
-		struct dirent *v = kcalloc(1, sizeof(struct dirent));
+		struct dirent *v = fs_dirent_new();
 		assert(v != NULL);
 		v->ino = i;
 		strncpy(v->name, "..", 255);
@@ -178,7 +189,7 @@ static struct dirent *tmpfs_readdir(fs_node_t *node, uint32_t i) {
 	for (node_t *node = l->head; node != NULL; node = node->next) {
 		if (j == 0) {
 			struct tmpfs_object *nobj = (struct tmpfs_object *)node->value;
-			struct dirent *v = kcalloc(1, sizeof(struct dirent));
+			struct dirent *v = fs_dirent_new();
 			assert(v != NULL);
 			v->ino = i;
 			strncpy(v->name, nobj->name, sizeof(v->name));
@@ -229,7 +240,7 @@ static int tmpfs_unlink (fs_node_t *node, char *name) {
 			}
 			// FIXME: use another list_* call
 			list_delete(l, v);
-			kfree(v);
+			list_node_free(v);
 			return 0;
 		}
 	}
@@ -7,6 +7,7 @@
 
 #include <cpu.h>
 #include <console.h>
+#include <dma_pool.h>
 #include <heap.h>
 #include <irq.h>
 #include <pci.h>
@@ -15,13 +16,11 @@
 #include <pmm.h>
 #include <string.h>
 #include <vmm.h>
+#include <wait.h>
 
 #include <usb/usb.h>
 #include <usb/uhci.h>
 
-#define MAX_QH 16
-#define MAX_TD 128
-
 // TODO: make use of this
 enum uhci_packet_type {
 	PACKET_IN = 0x69,
@@ -51,6 +50,15 @@ enum uchi_cmd {
 	UHCI_CMD_MAXP    = 0x0080,
 };
 
+enum uhci_sts {
+	UHCI_STS_USBINT    = 0x0001, // a td with ioc set completed
+	UHCI_STS_ERROR     = 0x0002,
+	UHCI_STS_RESUME    = 0x0004,
+	UHCI_STS_HSE       = 0x0008, // host system error
+	UHCI_STS_HCPE      = 0x0010, // host controller process error
+	UHCI_STS_HALTED    = 0x0020,
+};
+
 enum uhci_port {
 	PORT_CONNECT        = 0x0001,
 	PORT_CONNECT_CHANGE = 0x0002,
@@ -78,6 +86,7 @@ enum uhci_td_ctrl {
 	TD_CTRL_DATABUFFER  = (1<<21),
 	TD_CTRL_STALLED     = (1<<22),
 	TD_CTRL_ACTIVE      = (1<<23),
+	TD_CTRL_IOC         = (1<<24),
 	TD_CTRL_LOWSPEED    = (1<<26),
 };
 
@@ -119,11 +128,16 @@ typedef struct uhci_controller {
 	uint16_t iobase_size;
 	unsigned int port_count;
 	uint32_t *framelist;
-	uhci_qh_t *queue_heads;
-	uhci_td_t *transfer_descriptors;
+	dma_pool_t *qh_pool;
+	dma_pool_t *td_pool;
 	uhci_qh_t *async_qhs;
+	// woken up by the irq handler when a transfer completed or failed
+	wait_queue_t transfer_wait;
 } uhci_controller_t;
 
+// the irq should wake us up, poll anyway in case it got lost
+#define UHCI_TRANSFER_POLL_MS 10
+
 __attribute__((unused))
 static uint32_t uhci_reg_readl(uhci_controller_t *hc, /*uint16_t*/ enum uhci_reg reg) {
 	return inl(hc->iobase + reg);
@@ -169,35 +183,29 @@ static void uhci_port_unset(uhci_controller_t *hc, uint16_t reg, uint16_t data)
 }
 
 static uhci_td_t *uhci_alloc_td(struct uhci_controller *hc) {
-	for (unsigned int i = 0; i < MAX_TD; i++) {
-		if (!hc->transfer_descriptors[i].active) {
-			uhci_td_t *td = &hc->transfer_descriptors[i];
-			td->active = 1;
-			return td;
-		}
+	uhci_td_t *td = dma_pool_alloc(hc->td_pool, NULL);
+	if (td != NULL) {
+		td->active = 1;
 	}
-	return NULL;
+	return td;
 }
 
 static uhci_qh_t *uhci_alloc_qh(struct uhci_controller *hc) {
-	for (unsigned int i = 0; i < MAX_QH; i++) {
-		if (!hc->queue_heads[i].active) {
-			uhci_qh_t *qh = &hc->queue_heads[i];
-			qh->active = 1;
-			return qh;
-		}
+	uhci_qh_t *qh = dma_pool_alloc(hc->qh_pool, NULL);
+	if (qh != NULL) {
+		qh->active = 1;
 	}
-	return NULL;
+	return qh;
 }
 
 static void uhci_free_td(struct uhci_controller *hc, uhci_td_t *td) {
-	(void)hc;
 	td->active = 0;
+	dma_pool_free(hc->td_pool, td);
 }
 
 static void uhci_free_qh(struct uhci_controller *hc, uhci_qh_t *qh) {
-	(void)hc;
 	qh->active = 0;
+	dma_pool_free(hc->qh_pool, qh);
 }
 
 static void uhci_init_td(uhci_td_t *td, uhci_td_t *prev, unsigned int speed, uint8_t addr, uint8_t endpt, uint8_t data_toggle, uint8_t packet_type, uint16_t len, void *data) {
@@ -290,18 +298,18 @@ static uint16_t uhci_reset_port(uhci_controller_t *hc, uint16_t port) {
 			if ((port_status & PORT_ENABLE) == 0) {
 				break;
 			} else {
-				_sleep(1);
+				delay_ms(1);
 			}
 		} while (1);
 	}
 
 	uhci_port_set(hc, port, PORT_RESET);
-	_sleep(50);
+	delay_ms(50);
 	uhci_port_unset(hc, port, PORT_RESET);
 	while (1) {
 		uint16_t port_status = uhci_reg_readw(hc, port);
 		if (port_status & PORT_RESET) {
-			_sleep(1);
+			delay_ms(1);
 //			printf(".");
 		} else {
 //			printf("reset finished\n");
@@ -327,7 +335,7 @@ static uint16_t uhci_reset_port(uhci_controller_t *hc, uint16_t port) {
 				return port_status;
 			} else {
 //				printf(".");
-				_sleep(1);
+				delay_ms(1);
 			}
 		} while (1);
 	}
@@ -335,6 +343,12 @@ static uint16_t uhci_reset_port(uhci_controller_t *hc, uint16_t port) {
 	return 0;
 }
 
+/* the controller is done with qh, successfully or not, uhci_process_qh cleans up */
+static bool uhci_qh_done(uhci_qh_t *qh) {
+	uhci_td_t *td = (uhci_td_t *)(qh->element & ~0xF);
+	return (td == NULL) || (~td->control & TD_CTRL_ACTIVE);
+}
+
 static void uhci_process_qh(struct uhci_controller *hc, uhci_qh_t *qh) {
 	usb_transfer_t *transfer = qh->transfer;
 	uhci_td_t *td = (uhci_td_t *)(qh->element & ~0xF);
@@ -395,8 +409,8 @@ static void uhci_wait_for_qh(struct uhci_controller *hc, uhci_qh_t *qh) {
 	assert(qh->transfer != NULL);
 	usb_transfer_t *transfer = qh->transfer;
 	while (!transfer->complete) {
+		wait_event_timeout(&hc->transfer_wait, uhci_qh_done(qh), UHCI_TRANSFER_POLL_MS);
 		uhci_process_qh(hc, qh);
-		_sleep(1);
 	}
 }
 
@@ -453,9 +467,10 @@ void uhci_dev_control(void *_hc, usb_device_t *dev, usb_transfer_t *trans) {
 		packet_type = 0x69; // IN
 	}
 
-	// TODO: use irqs
-	// also maybe no detect short here ?
+	// TODO: maybe no detect short here ?
 	uhci_init_td(td, prev, speed, addr, endp, 0, packet_type, 0x7FF, 0);
+	// interrupt once the whole transfer is done, see uhci_wait_for_qh
+	td->control |= TD_CTRL_IOC;
 
 	uhci_qh_t *qh = uhci_alloc_qh(hc);
 	assert(qh != NULL);
@@ -467,11 +482,24 @@ void uhci_dev_control(void *_hc, usb_device_t *dev, usb_transfer_t *trans) {
 
 static unsigned int uhci_irq(unsigned int irq, void *extra) {
 	assert(extra != NULL);
+	uhci_controller_t *hc = (uhci_controller_t *)extra;
+
+	uint16_t status = uhci_reg_readw(hc, REG_STS);
+	if ((status & (UHCI_STS_USBINT | UHCI_STS_ERROR | UHCI_STS_RESUME | UHCI_STS_HSE | UHCI_STS_HCPE)) == 0) {
+		// shared irq
+		return IRQ_IGNORED;
+	}
+	// write 1 to clear
+	uhci_reg_writew(hc, REG_STS, status);
 	irq_ack(irq);
 
-	printf("uhci IRQ!\n");
-	printf("uhci status: 0x%x\n", uhci_reg_readw((uhci_controller_t *)extra, REG_STS));
-	assert(0);
+	if (status & (UHCI_STS_HSE | UHCI_STS_HCPE)) {
+		printf("uhci: controller error (status: 0x%x)\n", status);
+	}
+	if (status & (UHCI_STS_USBINT | UHCI_STS_ERROR)) {
+		wake_up(&hc->transfer_wait);
+	}
+	return IRQ_HANDLED;
 }
 
 static void uhci_probe_port(uhci_controller_t *hc, uint16_t port) {
@@ -583,25 +611,22 @@ static void uhci_controller_init(uint32_t device, uint16_t vendorid, uint16_t de
 	printf("irq: 0x%x\n", irq);
 
 	irq_set_handler(irq, uhci_irq, hc);
-	// we currently don't use the IRQ, so disable it
 
 	printf("host controller reset!\n");
 	uhci_reg_writew(hc, REG_CMD, UHCI_CMD_HCRESET);
-	_sleep(5);
+	delay_ms(5);
 	while (1) {
 		uint16_t v = uhci_reg_readw(hc, REG_CMD);
 		if ((v & UHCI_CMD_HCRESET) == 0) {
 			printf("complete\n");
 			break;
 		}
-		_sleep(5);
+		delay_ms(5);
 	}
 	// FIXME: handle the this better
 	hc->framelist = dma_malloc(sizeof(uint32_t) * 1024); // minimum alignment: 4kb
-	hc->queue_heads = dma_malloc(sizeof(uhci_qh_t) * MAX_QH);
-	assert(hc->queue_heads != NULL);
-	hc->transfer_descriptors = dma_malloc(sizeof(uhci_td_t) * MAX_TD);
-	assert(hc->transfer_descriptors != NULL);
+	hc->qh_pool = dma_pool_create("uhci_qh", sizeof(uhci_qh_t), 16);
+	hc->td_pool = dma_pool_create("uhci_td", sizeof(uhci_td_t), 16);
 	hc->async_qhs = uhci_alloc_qh(hc);
 	assert(hc->async_qhs != NULL);
 	hc->async_qhs->head = TD_PTR_TERMINATE;
@@ -628,13 +653,13 @@ static void uhci_controller_init(uint32_t device, uint16_t vendorid, uint16_t de
 
 	uhci_reg_writew(hc, REG_CMD, uhci_reg_readw(hc, REG_CMD) | UHCI_CMD_FORCE_GLOBAL_RESUME);
 	iowait();
-	_sleep(20);
+	delay_ms(20);
 	uhci_reg_writew(hc, REG_CMD, uhci_reg_readw(hc, REG_CMD) & ~UHCI_CMD_FORCE_GLOBAL_RESUME);
 
 
 	uhci_reg_writew(hc, REG_CMD, uhci_reg_readw(hc, REG_CMD) | UHCI_CMD_GLOBAL_RESUME);
 	iowait();
-	_sleep(50);
+	delay_ms(50);
 	uhci_reg_writew(hc, REG_CMD, uhci_reg_readw(hc, REG_CMD) & ~UHCI_CMD_GLOBAL_RESUME);
 
 
@@ -3,6 +3,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <atomic.h>
 #include <boot.h>
 #include <console.h>
 #include <cpu.h>
@@ -10,11 +11,19 @@
 #include <paging.h>
 #include <process.h>
 #include <pmm.h>
+#include <smp.h>
 #include <string.h>
 #include <vmm.h>
 #include <heap.h>
 
 page_directory_t *kernel_directory;
+bool vmm_nx_enabled = false;
+
+/*
+protects free kernel address space, find_vspace in the kernel directory and dma_malloc take it
+userspace directories are searched without it, only their process changes them
+*/
+static spin_t vspace_lock;
 
 page_directory_t *page_directory_reference(page_directory_t *pdir) {
 	assert(pdir != NULL);
@@ -29,29 +38,46 @@ page_directory_t *page_directory_new() {
 	assert(pdir != NULL);
 	pdir->physical_address = pmm_alloc_blocks_safe(1);
 	printf("%s: pdir: %p physical_address: 0x%8x\n", __func__, pdir, pdir->physical_address);
-	pdir->physical_tables = (uintptr_t *)find_vspace(kernel_directory, 1);
-	map_page(get_table_alloc((uintptr_t)pdir->physical_tables, kernel_directory), (uintptr_t)pdir->physical_tables,
+	pdir->pdpt = (uint64_t *)find_vspace(kernel_directory, 1);
+	map_page(get_table_alloc((uintptr_t)pdir->pdpt, kernel_directory), (uintptr_t)pdir->pdpt,
 		pdir->physical_address,
 		PAGE_PRESENT | PAGE_READWRITE);
-	memset((void *)pdir->physical_tables, 0, BLOCK_SIZE);
+	memset((void *)pdir->pdpt, 0, BLOCK_SIZE);
+
+	// XXX: the cpu caches the pdpt entries on every cr3 load, so all directories are allocated up front
+	pdir->physical_tables = (page_t *)find_vspace(kernel_directory, PAGE_DIRECTORY_POINTERS);
+	for (uintptr_t i = 0; i < PAGE_DIRECTORY_POINTERS; i++) {
+		uintptr_t phys = pmm_alloc_blocks_safe(1);
+		uintptr_t virt = (uintptr_t)pdir->physical_tables + i * BLOCK_SIZE;
+		map_page(get_table(virt, kernel_directory), virt, phys, PAGE_PRESENT | PAGE_READWRITE);
+		memset((void *)virt, 0, BLOCK_SIZE);
+		// pdpt entries only have the present and caching bits
+		pdir->pdpt[i] = (uint64_t)phys | PAGE_TABLE_PRESENT;
+	}
 	return page_directory_reference(pdir);
 }
 
-static void page_table_free(page_table_t *table, uintptr_t phys_table) {
+/* unmap a page in kernel space and free the block it was mapped to */
+static void kernel_page_free(uintptr_t virtaddr) {
+	page_table_t *table = get_table(virtaddr, kernel_directory);
+	phys_addr_t phys = PAGE_FRAME(get_page(table, virtaddr));
+	map_page(table, virtaddr, 0, 0);
+	invalidate_page(virtaddr);
+	pmm_free_blocks(phys, 1);
+}
+
+static void page_table_free(page_table_t *table, page_t phys_table) {
 	assert(table != NULL);
 	assert(phys_table != 0);
 	assert(phys_table & PAGE_TABLE_PRESENT);
 
-	for (uintptr_t i = 0; i < 1024; i++) {
+	for (uintptr_t i = 0; i < PAGE_TABLE_ENTRIES; i++) {
 		page_t page = table->pages[i];
 		assert(page == 0);
 	}
 
-	uintptr_t phys = phys_table & ~0x3FF;
-	uintptr_t virtaddr = (uintptr_t)table;
-	map_page(get_table(virtaddr, kernel_directory), virtaddr, 0, 0);
-	invalidate_page(virtaddr);
-	pmm_free_blocks(phys, 1);
+	assert(PAGE_FRAME(get_page(get_table((uintptr_t)table, kernel_directory), (uintptr_t)table)) == PAGE_FRAME(phys_table));
+	kernel_page_free((uintptr_t)table);
 }
 
 static void page_directory_free(page_directory_t **pdir) {
@@ -61,8 +87,8 @@ static void page_directory_free(page_directory_t **pdir) {
 
 	// XXX: walk the page directory and ensure there are no mappings left, freeing page tables in the process
 	// TODO: maybe this could be split into page_table_new() / page_table_free()
-	for (uintptr_t i = 0; i < 1024; i++) {
-		uintptr_t phys_table = (*pdir)->physical_tables[i];
+	for (uintptr_t i = 0; i < PAGE_DIRECTORY_ENTRIES; i++) {
+		page_t phys_table = (*pdir)->physical_tables[i];
 
 		if (phys_table & PAGE_PRESENT) {
 			page_table_t *table = (*pdir)->tables[i];
@@ -74,10 +100,10 @@ static void page_directory_free(page_directory_t **pdir) {
 		}
 		assert((*pdir)->tables[i] == NULL);
 	}
-	pmm_free_blocks((*pdir)->physical_address, 1);
-	uintptr_t virtaddr = (uintptr_t)(*pdir)->physical_tables;
-	map_page(get_table(virtaddr, kernel_directory), virtaddr, 0, 0);
-	invalidate_page(virtaddr);
+	for (uintptr_t i = 0; i < PAGE_DIRECTORY_POINTERS; i++) {
+		kernel_page_free((uintptr_t)(*pdir)->physical_tables + i * BLOCK_SIZE);
+	}
+	kernel_page_free((uintptr_t)(*pdir)->pdpt);
 	kfree(*pdir);
 	*pdir = NULL;
 }
@@ -96,15 +122,33 @@ void page_directory_release(page_directory_t *pdir) {
 	}
 }
 
-void invalidate_page(uintptr_t virtaddr) {
+// past this many pages reloading cr3 is cheaper than an invlpg each, there are no global pages
+#define VMM_FLUSH_ALL_PAGES 32
+
+void invalidate_pages_local(uintptr_t virtaddr, size_t n) {
 	assert((virtaddr & 0x3FF) == 0);
-	__asm__ __volatile__("invlpg (%0)" : : "b" (virtaddr) : "memory");
+	if (n > VMM_FLUSH_ALL_PAGES) {
+		uint32_t cr3;
+		__asm__ __volatile__("mov %%cr3, %0\nmov %0, %%cr3" : "=r" (cr3) : : "memory");
+		return;
+	}
+	for (size_t i = 0; i < n; i++) {
+		__asm__ __volatile__("invlpg (%0)" : : "b" (virtaddr + i * BLOCK_SIZE) : "memory");
+	}
+}
+
+void invalidate_pages(uintptr_t virtaddr, size_t n) {
+	smp_tlb_shootdown(virtaddr, n);
+}
+
+void invalidate_page(uintptr_t virtaddr) {
+	invalidate_pages(virtaddr, 1);
 }
 
 page_table_t *get_table(uintptr_t virtaddr, page_directory_t *directory) {
 	assert(directory != NULL);
-	uintptr_t i = virtaddr >> 22;
-	assert(i < 1024);
+	uintptr_t i = PAGE_DIRECTORY_INDEX(virtaddr);
+	assert(i < PAGE_DIRECTORY_ENTRIES);
 	return directory->tables[i];
 }
 
@@ -115,12 +159,12 @@ page_table_t *get_table_alloc(uintptr_t virtaddr, page_directory_t *directory) {
 		/* there are too many corner cases this would break */
 		assert(directory != kernel_directory);
 
-		uintptr_t index = (virtaddr >> 22) & 0x3FF;
+		uintptr_t index = PAGE_DIRECTORY_INDEX(virtaddr);
 		uintptr_t phys = pmm_alloc_blocks_safe(1);
 		uintptr_t virt = find_vspace(kernel_directory, 1);
 		assert(virt != 0);
 
-		directory->physical_tables[index] = phys |
+		directory->physical_tables[index] = (page_t)phys |
 			PAGE_TABLE_PRESENT | PAGE_TABLE_READWRITE | PAGE_TABLE_USER;
 		directory->tables[index] = (page_table_t *)virt;
 		// XXX: depends on all kernel tables being pre-allocated
@@ -135,30 +179,34 @@ page_table_t *get_table_alloc(uintptr_t virtaddr, page_directory_t *directory) {
 
 page_t get_page(page_table_t *table, uintptr_t virtaddr) {
 	assert(table != NULL);
-	uintptr_t i = virtaddr >> 12 & 0x3FF;
-	return table->pages[i];
+	return table->pages[PAGE_TABLE_INDEX(virtaddr)];
 }
 
 void set_page(page_table_t *table, uintptr_t virtaddr, page_t page) {
 	assert(table != NULL);
-	uintptr_t i = virtaddr >> 12 & 0x3FF;
-	table->pages[i] = page;
+	table->pages[PAGE_TABLE_INDEX(virtaddr)] = page;
 }
 
-void map_page(page_table_t *table, uintptr_t virtaddr, uintptr_t physaddr, enum page_flags flags) {
+void map_page(page_table_t *table, uintptr_t virtaddr, phys_addr_t physaddr, page_t flags) {
 	assert(table != NULL);
 	assert((virtaddr & 0x3FF) == 0);
 	assert(((uintptr_t)table & 0x3FF) == 0);
 
-	uintptr_t index = (virtaddr >> 12) & 0x3FF;
-	assert(index < 1024);
-	table->pages[index] = (page_t)((uint32_t)physaddr | flags);
+	if (!vmm_nx_enabled) {
+		// the bit is reserved without EFER.NXE
+		flags &= ~PAGE_NO_EXECUTE;
+		physaddr &= ~PAGE_NO_EXECUTE;
+	}
+
+	uintptr_t index = PAGE_TABLE_INDEX(virtaddr);
+	assert(index < PAGE_TABLE_ENTRIES);
+	table->pages[index] = (page_t)physaddr | flags;
 	// TODO: add a method to map a page in the kernel directory and call invlpg there
 }
 
 /* helper function */
 // directly maps from (including) start to end to kernel space
-void map_pages(uintptr_t start, uintptr_t end, enum page_flags flags, const char *name) {
+void map_pages(uintptr_t start, uintptr_t end, page_t flags, const char *name) {
 	if ((start & 0x3FF) != 0) {
 		printf("%s: WARN: start %p misaligned, adjusting to %p!\n", __func__, start, (start & ~0x3FF));
 		start = start & ~0x3FF;
@@ -169,7 +217,8 @@ void map_pages(uintptr_t start, uintptr_t end, enum page_flags flags, const char
 	}
 
 	if (name != NULL) {
-		printf("%s: 0x%x - 0x%x => 0x%x - 0x%x flags: 0x%x\n", name, (uintptr_t)start, (uintptr_t)end, (uintptr_t)start, (uintptr_t)end, flags);
+		printf("%s: 0x%x - 0x%x => 0x%x - 0x%x flags: 0x%x%s\n", name, (uintptr_t)start, (uintptr_t)end, (uintptr_t)start, (uintptr_t)end,
+			(uint32_t)flags, (flags & PAGE_NO_EXECUTE) ? " nx" : "");
 	}
 	for (uintptr_t i = start; i < end; i += BLOCK_SIZE) {
 		map_page(get_table(i, kernel_directory), i, i, flags);
@@ -185,29 +234,63 @@ void map_direct_kernel(uintptr_t v) {
 	page_table_t *table = get_table(v, kernel_directory);
 	page_t o_page = get_page(table, v);
 	if (o_page != 0) {
-		if ((o_page & ~0x3FF) == v) {
+		if (PAGE_FRAME(o_page) == v) {
 			if (o_page == (v | PAGE_PRESENT | PAGE_READWRITE)) {
 				printf(" mapped using same value 0x%x => 0x%x\n", v, v);
 			} else {
-				printf("already mapped ?!! v: 0x%x page: 0x%x\n", v, o_page);
+				printf("already mapped ?!! v: 0x%x page: 0x%x\n", v, (uint32_t)o_page);
 			}
 		} else {
 			printf("we're in deep trouble!\n");
-			printf("v: 0x%x page: 0x%x\n", v, get_page(table, v));
+			printf("v: 0x%x page: 0x%x%8x\n", v, (uint32_t)(o_page >> 32), (uint32_t)o_page);
 			assert(0);
 		}
 	}
 
 	map_page(get_table(v, kernel_directory), v, v, PAGE_PRESENT | PAGE_READWRITE);
-	invalidate_page(v);
+	invalidate_pages_local(v, 1);
+}
+
+/* map size bytes of physical memory (firmware tables, mmio) anywhere into the kernel directory */
+void *map_physical(phys_addr_t phys, size_t size, page_t flags) {
+	phys_addr_t start = phys & ~(phys_addr_t)(BLOCK_SIZE - 1);
+	size_t offset = (size_t)(phys - start);
+	size_t n = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	uintptr_t v = find_vspace(kernel_directory, n);
+	if (v == 0) {
+		return NULL;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		uintptr_t vaddr = v + i * BLOCK_SIZE;
+		map_page(get_table(vaddr, kernel_directory), vaddr, start + i * BLOCK_SIZE, flags);
+	}
+	// the address was free, only this cpu may have looked at it (and cached the miss)
+	invalidate_pages_local(v, n);
+	return (void *)(v + offset);
+}
+
+void unmap_physical(void *p, size_t size) {
+	uintptr_t v = (uintptr_t)p & ~(BLOCK_SIZE - 1);
+	size_t n = ((uintptr_t)p - v + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	for (size_t i = 0; i < n; i++) {
+		uintptr_t vaddr = v + i * BLOCK_SIZE;
+		map_page(get_table(vaddr, kernel_directory), vaddr, 0, 0);
+	}
+	invalidate_pages(v, n);
 }
 
 // TODO: optimise (it's too slow)
 // TODO: mark found pages with PAGE_VALUE_RESERVED
+// called with vspace_lock and the pmm locked
 inline uintptr_t vmm_find_dma_region(size_t size) {
 	assert(size != 0);
 
-	for (uint32_t i = 0; i < block_map_size / 32; i++) {
+	// dma regions are identity mapped, so only look below 4GiB
+	uint32_t n_blocks = block_map_size < PMM_LOW_BLOCKS ? block_map_size : PMM_LOW_BLOCKS;
+	for (uint32_t i = 0; i < n_blocks / 32; i++) {
 		if (block_map[i] == 0xFFFFFFFF) {
 			// skip
 			continue;
@@ -253,25 +336,44 @@ inline uintptr_t vmm_find_dma_region(size_t size) {
 void *dma_malloc(size_t m) {
 	assert(m != 0);
 	size_t n = (BLOCK_SIZE - 1 + m) / BLOCK_SIZE;
+	uint32_t eflags = spin_lock_irqsave(vspace_lock);
+	uint32_t pmm_eflags = pmm_lock();
 	uintptr_t v = vmm_find_dma_region(n);
 	assert(v != 0);
 	for (size_t i = 0; i < n; i++) {
 		pmm_set_block(v + i);
 		map_direct_kernel((v + i) * BLOCK_SIZE);
-		memset((void *)((v + i) * BLOCK_SIZE), 0, BLOCK_SIZE);
 	}
+	pmm_unlock(pmm_eflags);
+	spin_unlock_irqrestore(vspace_lock, eflags);
 
+	memset((void *)(v * BLOCK_SIZE), 0, n * BLOCK_SIZE);
 	return (void *)(v * BLOCK_SIZE);
 }
 
+// m has to be the size passed to dma_malloc
+void dma_free(void *p, size_t m) {
+	assert(p != NULL);
+	assert(m != 0);
+	uintptr_t v = (uintptr_t)p;
+	assert((v & (BLOCK_SIZE - 1)) == 0);
+	size_t n = (BLOCK_SIZE - 1 + m) / BLOCK_SIZE;
+	for (size_t i = 0; i < n; i++) {
+		uintptr_t addr = v + i * BLOCK_SIZE;
+		page_table_t *table = get_table(addr, kernel_directory);
+		assert(PAGE_FRAME(get_page(table, addr)) == addr);
+		map_page(table, addr, 0, 0);
+	}
+	invalidate_pages(v, n);
+	pmm_free_blocks(v, n);
+}
+
 // TODO: optimise the next 2 functions by walking in page table increments
 // finds free (continuous) virtual address space and maps it to PAGE_VALUE_RESERVED
 // n in blocks
 // FIXME: allocates tables for ranges that will be too small
 // returns 0 in case of failure
-uintptr_t find_vspace(page_directory_t *dir, size_t n) {
-	assert(dir != NULL);
-	assert(n != 0);
+static uintptr_t __find_vspace(page_directory_t *dir, size_t n) {
 	// XXX: skip special block 0
 	for (uintptr_t i = 1; i < (0x100000000 / BLOCK_SIZE); i++) {
 		uintptr_t v_addr = i * BLOCK_SIZE;
@@ -317,20 +419,35 @@ uintptr_t find_vspace(page_directory_t *dir, size_t n) {
 	return -1;
 }
 
+uintptr_t find_vspace(page_directory_t *dir, size_t n) {
+	assert(dir != NULL);
+	assert(n != 0);
+	if (dir != kernel_directory) {
+		// XXX: get_table_alloc takes vspace_lock for the kernel address of new tables
+		return __find_vspace(dir, n);
+	}
+
+	uint32_t eflags = spin_lock_irqsave(vspace_lock);
+	uintptr_t v = __find_vspace(dir, n);
+	spin_unlock_irqrestore(vspace_lock, eflags);
+	return v;
+}
+
 static void dump_table(page_table_t *table, uintptr_t table_addr, char *prefix) {
 	assert(table != NULL);
 	assert(prefix != NULL);
 	assert((table_addr & 0x3FF) == 0);
 
-	for (uintptr_t page_i = 0; page_i < 1024; page_i++) {
+	for (uintptr_t page_i = 0; page_i < PAGE_TABLE_ENTRIES; page_i++) {
 		page_t page = table->pages[page_i];
 		if (page != 0) {
 			uintptr_t v_addr = (table_addr) | (page_i << 12);
 
 			if (page & PAGE_PRESENT) {
-				printf("%s0x%8x => 0x%8x %c%c\n", prefix, v_addr, page, (page & PAGE_USER) ? 'u' : 'k', (page & PAGE_READWRITE) ? 'w' : 'r');
+				printf("%s0x%8x => 0x%x%8x %c%c%c\n", prefix, v_addr, (uint32_t)(PAGE_FRAME(page) >> 32), (uint32_t)page,
+					(page & PAGE_USER) ? 'u' : 'k', (page & PAGE_READWRITE) ? 'w' : 'r', (page & PAGE_NO_EXECUTE) ? '-' : 'x');
 			} else {
-				printf("%s0x%8x ## 0x%8x\n", prefix, v_addr, page);
+				printf("%s0x%8x ## 0x%8x\n", prefix, v_addr, (uint32_t)page);
 			}
 		}
 	}
@@ -340,18 +457,18 @@ void dump_directory(page_directory_t *directory) {
 	printf("%s(directory: %p)\n", __func__, directory);
 	assert(directory != NULL);
 	printf("--- directory (virt %p, phys: %p) ---\n", (uintptr_t)directory, directory->physical_address);
-	for (uintptr_t i = 0; i < 1024; i++) {
-		uintptr_t phys_table = directory->physical_tables[i];
+	for (uintptr_t i = 0; i < PAGE_DIRECTORY_ENTRIES; i++) {
+		page_t phys_table = directory->physical_tables[i];
 		if (phys_table == 0) {
 			assert(directory->tables[i] == NULL);
 			continue;
 		}
 
 		page_table_t *table = directory->tables[i];
-		printf("0x%8x table: (virt %p, phys: %p) (", i << 22, (uintptr_t)table, phys_table);
+		printf("0x%8x table: (virt %p, phys: 0x%8x) (", i << PAGE_TABLE_SHIFT, (uintptr_t)table, (uint32_t)phys_table);
 		if (phys_table & PAGE_TABLE_PRESENT) {
 			printf("present)\n");
-			dump_table(table, i << 22, "  ");
+			dump_table(table, i << PAGE_TABLE_SHIFT, "  ");
 		} else {
 			printf(")\n");
 		}
@@ -391,6 +508,9 @@ static void page_fault(registers_t *regs) {
 
 	if (regs->err_code & 0x10) {
 		action = "instruction fetch";
+		if (regs->err_code & 0x1) {
+			cause = "no-execute violation";
+		}
 	}
 
 	printf("[vmm] page_fault in %s mode at eip=%p during %s caused by %s of address %p (exception code: 0x%8x)\n", mode, (uintptr_t)regs->eip, action, cause, address, regs->err_code);
@@ -415,7 +535,7 @@ static void page_fault(registers_t *regs) {
 	} else {
 		printf("0x%8x table: %p\n", address, table);
 		page_t page = get_page(table, address);
-		printf("0x%8x => 0x%8x ", address, page);
+		printf("0x%8x => 0x%x%8x ", address, (uint32_t)(PAGE_FRAME(page) >> 32), (uint32_t)page);
 		if (page & PAGE_USER) {
 			printf("u");
 		} else {
@@ -431,6 +551,9 @@ static void page_fault(registers_t *regs) {
 		} else {
 			printf("-");
 		}
+		if (page & PAGE_NO_EXECUTE) {
+			printf("n");
+		}
 		printf("\n");
 	}
 
@@ -441,8 +564,6 @@ static void page_fault(registers_t *regs) {
 		printf("current_process: 0x%x\n", (uintptr_t)current_process);
 		printf("current_process->task.registers: 0x%x\n", (uintptr_t)current_process->task.registers);
 		printf("current_process->task.esp: 0x%x\n", current_process->task.esp);
-		printf("current_process->task.ebp: 0x%x\n", current_process->task.ebp);
-		printf("current_process->task.eip: 0x%x\n", current_process->task.eip);
 		printf("current_process->task.kstack: 0x%x\n", current_process->task.kstack);
 		printf("current_process->task.pdir: 0x%x\n", (uintptr_t)current_process->task.pdir);
 		printf("current_process->name: '%s'\n", current_process->name);
@@ -464,33 +585,47 @@ void vmm_init() {
 	// XXX: a lot of code depends on all the kernel tables being pre-allocated to avoid calling get_table_alloc (which could result in an infinite loop)
 	isr_set_handler(14, page_fault);
 
+	vmm_nx_enabled = cpu_enable_nx();
+	printf("no-execute pages: %s\n", vmm_nx_enabled ? "enabled" : "not supported");
+
 	// TODO: allocate the kernel_directory
-	_kernel_dir.physical_tables = (uintptr_t *)pmm_alloc_blocks_safe(1);
+	_kernel_dir.physical_tables = (page_t *)pmm_alloc_blocks_safe(PAGE_DIRECTORY_POINTERS);
 	printf("physical tables: %p\n", _kernel_dir.physical_tables);
-	_kernel_dir.physical_address = (uintptr_t)_kernel_dir.physical_tables;
-	memset(_kernel_dir.physical_tables, 0, sizeof(uintptr_t) * 1024);
-	memset(_kernel_dir.tables, 0, sizeof(page_table_t *) * 1024);
+	_kernel_dir.pdpt = (uint64_t *)pmm_alloc_blocks_safe(1);
+	_kernel_dir.physical_address = (uintptr_t)_kernel_dir.pdpt;
+	memset(_kernel_dir.pdpt, 0, BLOCK_SIZE);
+	memset(_kernel_dir.physical_tables, 0, sizeof(page_t) * PAGE_DIRECTORY_ENTRIES);
+	memset(_kernel_dir.tables, 0, sizeof(page_table_t *) * PAGE_DIRECTORY_ENTRIES);
 	_kernel_dir.__refcount = -1;
+	spin_init(vspace_lock);
 
 	kernel_directory = &_kernel_dir;
 
 	printf("real kernel directory: %p\n", kernel_directory->physical_address);
 
-	for (unsigned int i = 0; i < 1024; i++) {
+	for (unsigned int i = 0; i < PAGE_DIRECTORY_POINTERS; i++) {
+		kernel_directory->pdpt[i] = (uint64_t)((uintptr_t)kernel_directory->physical_tables + i * BLOCK_SIZE) |
+			PAGE_TABLE_PRESENT;
+	}
+
+	for (unsigned int i = 0; i < PAGE_DIRECTORY_ENTRIES; i++) {
 		uintptr_t physical_t = pmm_alloc_blocks_safe(1);
 		memset((void *)physical_t, 0, BLOCK_SIZE);
 		// XXX: Don't map page tables with USER bit set, since no usercode should ever need to use the kernel directory
-		kernel_directory->physical_tables[i] = (uintptr_t)(physical_t |
+		kernel_directory->physical_tables[i] = (page_t)(physical_t |
 			PAGE_TABLE_PRESENT | PAGE_TABLE_READWRITE |
 			PAGE_TABLE_WRITE_THROUGH | PAGE_TABLE_CACHE_DISABLE);
 		kernel_directory->tables[i] = (page_table_t *)physical_t;
 	}
 
-	for (unsigned int i = 0; i < 1024; i++) {
+	for (unsigned int i = 0; i < PAGE_DIRECTORY_ENTRIES; i++) {
 		// directly map the page tables
 		map_direct_kernel((uintptr_t)kernel_directory->tables[i]);
 	}
 
+	for (unsigned int i = 0; i < PAGE_DIRECTORY_POINTERS; i++) {
+		map_direct_kernel((uintptr_t)kernel_directory->physical_tables + i * BLOCK_SIZE);
+	}
 	map_direct_kernel(kernel_directory->physical_address);
 
 	// catch NULL pointer dereferences
@@ -0,0 +1,123 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <cpu.h>
+#include <pit.h>
+#include <task.h>
+#include <wait.h>
+
+uint64_t __wait_target(uint64_t now, uint64_t timeout) {
+	return (timeout == WAIT_FOREVER) ? 0 : now + timeout;
+}
+
+/* locks the scheduler, returns whether the caller may block */
+bool __wait_begin(void) {
+	bool can_block = task_can_block();
+	scheduler_lock();
+	return can_block;
+}
+
+/*
+called with the scheduler locked by __wait_begin, unlocks it
+returns once it's worth checking the condition again, false if target passed
+now is the caller's clock, it also counts the ticks busy-waited with interrupts disabled
+*/
+bool __wait_sleep(wait_queue_t *wq, bool can_block, uint64_t target, uint64_t *now) {
+	uint64_t ticks = timer_now();
+	if (ticks > *now) {
+		*now = ticks;
+	}
+	if ((target != 0) && (*now >= target)) {
+		scheduler_unlock();
+		return false;
+	}
+
+	if (can_block) {
+		if (target == 0) {
+			task_block(&wq->waiters, TASK_STATE_BLOCKED);
+		} else {
+			task_block_timeout(&wq->waiters, TASK_STATE_BLOCKED, target);
+		}
+		// blocks here
+		scheduler_unlock();
+		return true;
+	}
+
+	scheduler_unlock();
+	uint32_t eflags;
+	__asm__ __volatile__ ("pushf\n"
+	                      "pop %0\n"
+	                      : "=r"(eflags));
+	if (eflags & (1<<9)) {
+		// the next interrupt might be the one we're waiting for, otherwise it's the next tick
+		hlt();
+	} else {
+		// timer_ticks might not advance at all (the bootstrap processor), count for ourselves
+		timer_busy_wait(1);
+		(*now)++;
+	}
+	return true;
+}
+
+void wake_up(wait_queue_t *wq) {
+	assert(wq != NULL);
+	scheduler_lock();
+	while (wq->waiters.first != NULL) {
+		task_unblock_next(&wq->waiters);
+	}
+	scheduler_unlock();
+}
+
+void wake_up_one(wait_queue_t *wq) {
+	assert(wq != NULL);
+	task_unblock_next(&wq->waiters);
+}
+
+void delay_ms(uint64_t ms) {
+	if (task_can_block()) {
+		task_sleep_miliseconds(ms);
+	} else {
+		wait_queue_t nobody = { 0 };
+		wait_event_timeout(&nobody, false, ms);
+	}
+}
+
+void cond_wait(cond_t *cond, mutex_t *mutex) {
+	cond_wait_timeout(cond, mutex, WAIT_FOREVER);
+}
+
+bool cond_wait_timeout(cond_t *cond, mutex_t *mutex, uint64_t timeout) {
+	assert(cond != NULL);
+	assert(mutex != NULL);
+	assert(task_can_block());
+
+	// XXX: a signal between the unlock and blocking would be lost without the scheduler lock
+	scheduler_lock();
+	mutex_unlock(mutex);
+	if (timeout == WAIT_FOREVER) {
+		task_block(&cond->waiters, TASK_STATE_BLOCKED);
+	} else {
+		task_block_timeout(&cond->waiters, TASK_STATE_BLOCKED, timer_now() + timeout);
+	}
+	// blocks here
+	scheduler_unlock();
+
+	bool signaled = (timeout == WAIT_FOREVER) || !current_task->timed_out;
+	mutex_lock(mutex);
+	return signaled;
+}
+
+void cond_signal(cond_t *cond) {
+	assert(cond != NULL);
+	task_unblock_next(&cond->waiters);
+}
+
+void cond_broadcast(cond_t *cond) {
+	assert(cond != NULL);
+	scheduler_lock();
+	while (cond->waiters.first != NULL) {
+		task_unblock_next(&cond->waiters);
+	}
+	scheduler_unlock();
+}
@@ -0,0 +1,267 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <atomic.h>
+#include <console.h>
+#include <kernel_task.h>
+#include <pit.h>
+#include <task.h>
+#include <wait.h>
+#include <workqueue.h>
+
+// workers shared by all workqueues
+#define WORKQUEUE_WORKERS 4
+
+workqueue_t system_workqueue = WORKQUEUE_INIT("system", WORKQUEUE_WORKERS);
+
+/*
+all state below and in work_t/workqueue_t is protected by workqueue_lock,
+taken with interrupts disabled since irq handlers queue work
+*/
+static spin_t workqueue_lock;
+// items a worker may pick up, in order
+static work_t *ready_first;
+static work_t *ready_last;
+// delayed items, sorted by target
+static work_t *delayed;
+// bumped when the first delayed item changes, idle workers have to look at their timeout again
+static volatile unsigned int delayed_seq;
+
+static wait_queue_t worker_wait;
+
+/* work_t list helpers */
+static void work_append(work_t **first, work_t **last, work_t *work) {
+	work->next = NULL;
+	if (*first == NULL) {
+		*first = work;
+	} else {
+		(*last)->next = work;
+	}
+	*last = work;
+}
+
+static work_t *work_pop(work_t **first, work_t **last) {
+	work_t *work = *first;
+	if (work != NULL) {
+		*first = work->next;
+		if (*first == NULL) {
+			*last = NULL;
+		}
+		work->next = NULL;
+	}
+	return work;
+}
+
+static bool work_remove(work_t **first, work_t **last, work_t *work) {
+	work_t *prev = NULL;
+	for (work_t *w = *first; w != NULL; prev = w, w = w->next) {
+		if (w != work) {
+			continue;
+		}
+		if (prev == NULL) {
+			*first = work->next;
+		} else {
+			prev->next = work->next;
+		}
+		if ((last != NULL) && (*last == work)) {
+			*last = prev;
+		}
+		work->next = NULL;
+		return true;
+	}
+	return false;
+}
+
+/* hand queued items of wq to the workers while it has slots left, returns how many */
+static unsigned int workqueue_dispatch(workqueue_t *wq) {
+	unsigned int n = 0;
+	while ((wq->active < wq->max_active) && (wq->first != NULL)) {
+		work_t *work = work_pop(&wq->first, &wq->last);
+		work->state = WORK_READY;
+		work_append(&ready_first, &ready_last, work);
+		wq->active++;
+		n++;
+	}
+	return n;
+}
+
+static unsigned int __queue_work(work_t *work) {
+	workqueue_t *wq = work->wq;
+	work->state = WORK_QUEUED;
+	work_append(&wq->first, &wq->last, work);
+	wq->n_queued++;
+
+	unsigned int n = workqueue_dispatch(wq);
+	unsigned int backlog = 0;
+	for (work_t *w = wq->first; w != NULL; w = w->next) {
+		backlog++;
+	}
+	if (backlog > wq->n_peak_backlog) {
+		wq->n_peak_backlog = backlog;
+	}
+	return n;
+}
+
+static void workers_wake(unsigned int n) {
+	while (n-- > 0) {
+		wake_up_one(&worker_wait);
+	}
+}
+
+void work_init(work_t *work, work_func *func) {
+	assert(work != NULL);
+	assert(func != NULL);
+	work->func = func;
+	work->wq = NULL;
+	work->next = NULL;
+	work->state = WORK_IDLE;
+	work->target = 0;
+}
+
+bool queue_work(workqueue_t *wq, work_t *work) {
+	assert(wq != NULL);
+	assert(wq->max_active > 0);
+	assert(work != NULL);
+	assert(work->func != NULL);
+
+	uint32_t eflags = spin_lock_irqsave(workqueue_lock);
+	if (work->state != WORK_IDLE) {
+		spin_unlock_irqrestore(workqueue_lock, eflags);
+		return false;
+	}
+	work->wq = wq;
+	unsigned int n = __queue_work(work);
+	spin_unlock_irqrestore(workqueue_lock, eflags);
+
+	workers_wake(n);
+	return true;
+}
+
+bool queue_delayed_work(workqueue_t *wq, work_t *work, uint64_t delay) {
+	if (delay == 0) {
+		return queue_work(wq, work);
+	}
+	assert(wq != NULL);
+	assert(work != NULL);
+	assert(work->func != NULL);
+
+	uint32_t eflags = spin_lock_irqsave(workqueue_lock);
+	if (work->state != WORK_IDLE) {
+		spin_unlock_irqrestore(workqueue_lock, eflags);
+		return false;
+	}
+	work->wq = wq;
+	work->state = WORK_DELAYED;
+	work->target = timer_now() + delay;
+
+	work_t **link = &delayed;
+	while ((*link != NULL) && ((*link)->target <= work->target)) {
+		link = &(*link)->next;
+	}
+	work->next = *link;
+	*link = work;
+	bool first = (delayed == work);
+	if (first) {
+		delayed_seq++;
+	}
+	spin_unlock_irqrestore(workqueue_lock, eflags);
+
+	if (first) {
+		workers_wake(1);
+	}
+	return true;
+}
+
+bool cancel_work(work_t *work) {
+	assert(work != NULL);
+
+	unsigned int n = 0;
+	bool cancelled = true;
+	uint32_t eflags = spin_lock_irqsave(workqueue_lock);
+	switch (work->state) {
+		case WORK_IDLE:
+			cancelled = false;
+			break;
+		case WORK_DELAYED:
+			assert(work_remove(&delayed, NULL, work));
+			break;
+		case WORK_QUEUED:
+			assert(work_remove(&work->wq->first, &work->wq->last, work));
+			break;
+		case WORK_READY:
+			assert(work_remove(&ready_first, &ready_last, work));
+			// give its slot to the next one
+			work->wq->active--;
+			n = workqueue_dispatch(work->wq);
+			break;
+	}
+	work->state = WORK_IDLE;
+	spin_unlock_irqrestore(workqueue_lock, eflags);
+
+	workers_wake(n);
+	return cancelled;
+}
+
+/* queue the delayed items that are due, returns how many workers are needed for them */
+static unsigned int workqueue_run_timers(uint64_t now) {
+	unsigned int n = 0;
+	while ((delayed != NULL) && (delayed->target <= now)) {
+		work_t *work = delayed;
+		delayed = work->next;
+		n += __queue_work(work);
+	}
+	return n;
+}
+
+static unsigned int ktask_worker(const char *name, void *extra) {
+	(void)name;
+	(void)extra;
+
+	while (1) {
+		uint64_t now = timer_now();
+		uint32_t eflags = spin_lock_irqsave(workqueue_lock);
+		unsigned int n = workqueue_run_timers(now);
+		work_t *work = work_pop(&ready_first, &ready_last);
+		workqueue_t *wq = NULL;
+		uint64_t timeout = WAIT_FOREVER;
+		unsigned int seq = delayed_seq;
+		if (work != NULL) {
+			work->state = WORK_IDLE;
+			wq = work->wq;
+			if (n > 0) {
+				// this one doesn't need waking up
+				n--;
+			}
+		} else if (delayed != NULL) {
+			// XXX: all idle workers wait for the first delayed item, the first one to wake up queues it
+			timeout = delayed->target - now;
+		}
+		spin_unlock_irqrestore(workqueue_lock, eflags);
+		workers_wake(n);
+
+		if (work == NULL) {
+			wait_event_timeout(&worker_wait, (ready_first != NULL) || (delayed_seq != seq), timeout);
+			continue;
+		}
+
+		// XXX: work may be queued again, or freed, from here on, only wq is safe to use
+		work->func(work);
+
+		eflags = spin_lock_irqsave(workqueue_lock);
+		assert(wq->active > 0);
+		wq->active--;
+		n = workqueue_dispatch(wq);
+		spin_unlock_irqrestore(workqueue_lock, eflags);
+		workers_wake(n);
+	}
+}
+
+void workqueue_init(void) {
+	spin_init(workqueue_lock);
+	for (unsigned int i = 0; i < WORKQUEUE_WORKERS; i++) {
+		char name[] = "[kworker0]";
+		name[8] = (char)('0' + i);
+		ktask_spawn(ktask_worker, name, NULL);
+	}
+}